@@ -20,6 +20,8 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
+
 #include "pebble_os.h"
 #include "http.h"
 
@@ -40,387 +42,3851 @@
 #define HTTP_IS_DST_KEY 0xFFF7
 #define HTTP_TZ_NAME_KEY 0xFFF8
 
+#define HTTP_STREAM_KEY 0xFFD0
+#define HTTP_FRAGMENT_KEY 0xFFD1
+#define HTTP_FRAGMENT_COUNT_KEY 0xFFD2
+#define HTTP_BATCH_KEY 0xFFD3
+#define HTTP_VALIDATOR_KEY 0xFFD4
+#define HTTP_PACKED_KEY 0xFFD5
+#define HTTP_COMPRESSED_KEY 0xFFD6
+#define HTTP_BATCH_PART_KEY 0xFFC0
+
 #define HTTP_LOCATION_KEY 0xFFE0
 #define HTTP_LATITUDE_KEY 0xFFE1
 #define HTTP_LONGITUDE_KEY 0xFFE2
 #define HTTP_ALTITUDE_KEY 0xFFE3
 
+// Outbound queue sizing. Each slot holds one serialized dictionary, so a slot
+// should be no larger than the outbox size the app registers with AppMessage.
+#ifndef HTTP_QUEUE_SIZE
+#define HTTP_QUEUE_SIZE 4
+#endif
+#ifndef HTTP_QUEUE_BUFFER_SIZE
+#define HTTP_QUEUE_BUFFER_SIZE 128
+#endif
+
+// Queued messages are sent highest priority class first. Each time a message is
+// passed over it gets closer to the front: after HTTP_PRIORITY_AGING passes it is
+// treated as one class higher. Lower classes are also limited in how many of their
+// requests may be awaiting an answer at once.
+#ifndef HTTP_PRIORITY_AGING
+#define HTTP_PRIORITY_AGING 4
+#endif
+#ifndef HTTP_MAX_IN_FLIGHT_NORMAL
+#define HTTP_MAX_IN_FLIGHT_NORMAL 6
+#endif
+#ifndef HTTP_MAX_IN_FLIGHT_BACKGROUND
+#define HTTP_MAX_IN_FLIGHT_BACKGROUND 2
+#endif
+
+// Messages the phone didn't acknowledge because it was busy or wasn't connected are
+// put back in the queue and resent up to HTTP_MAX_RETRIES times, waiting about
+// HTTP_RETRY_DELAY seconds, doubling each time. Define HTTP_MAX_RETRIES as 0 to report
+// these failures straight away instead. A send that timed out may still have reached
+// the bridge, and resending it repeats whatever it did there, so those are only
+// retried if HTTP_RETRY_TIMEOUTS is defined.
+#ifndef HTTP_MAX_RETRIES
+#define HTTP_MAX_RETRIES 3
+#endif
+#ifndef HTTP_RETRY_DELAY
+#define HTTP_RETRY_DELAY 2
+#endif
+
+// Requests awaiting an answer from the bridge. Anything not answered within
+// HTTP_REQUEST_TIMEOUT seconds is reported as failed.
+#ifndef HTTP_MAX_IN_FLIGHT
+#define HTTP_MAX_IN_FLIGHT 8
+#endif
+#ifndef HTTP_REQUEST_TIMEOUT
+#define HTTP_REQUEST_TIMEOUT 30
+#endif
+
+// Opt-in write-back cookie cache: define HTTP_COOKIE_WRITE_BACK to stage cookie sets
+// on the watch and send them in as few messages as possible.
+#ifdef HTTP_COOKIE_WRITE_BACK
+#ifndef HTTP_WRITE_BACK_MAX_KEYS
+#define HTTP_WRITE_BACK_MAX_KEYS 16
+#endif
+// Staged values note which callers they are for in a 32-bit mask.
+#if HTTP_WRITE_BACK_MAX_KEYS > 32
+#error "HTTP_WRITE_BACK_MAX_KEYS can be at most 32"
+#endif
+#ifndef HTTP_WRITE_BACK_BUFFER_SIZE
+#define HTTP_WRITE_BACK_BUFFER_SIZE 256
+#endif
+#ifndef HTTP_WRITE_BACK_DELAY
+#define HTTP_WRITE_BACK_DELAY 5
+#endif
+#endif
+
+// Opt-in read-through cookie cache: define HTTP_COOKIE_CACHE to answer cookie gets
+// from values the watch has recently read or written.
+#ifdef HTTP_COOKIE_CACHE
+#ifndef HTTP_COOKIE_CACHE_ENTRIES
+#define HTTP_COOKIE_CACHE_ENTRIES 8
+#endif
+#ifndef HTTP_COOKIE_CACHE_VALUE_SIZE
+#define HTTP_COOKIE_CACHE_VALUE_SIZE 16
+#endif
+#endif
+
+// Cookie gets that are split across messages or partly answered from the cache
+// have their replies merged in a buffer this big before being handed to the app.
+#ifndef HTTP_COOKIE_MERGE_SIZE
+#define HTTP_COOKIE_MERGE_SIZE 256
+#endif
+
+// Keys of a cookie get or delete that needs several messages are copied here, so the
+// messages can go out one at a time as the queue makes room.
+#ifndef HTTP_COOKIE_PENDING_KEYS
+#define HTTP_COOKIE_PENDING_KEYS 64
+#endif
+
+// Number of streamed HTTP responses that can be arriving at once.
+#ifndef HTTP_MAX_STREAMS
+#define HTTP_MAX_STREAMS 2
+#endif
+
+// Opt-in instrumentation: define HTTP_STATS to count what happens to each type of
+// message, and keep the last HTTP_TRACE_SIZE events.
+#ifdef HTTP_STATS
+#ifndef HTTP_TRACE_SIZE
+#define HTTP_TRACE_SIZE 8
+#endif
+#endif
+
+// Number of app ids that can have callbacks of their own.
+#ifndef HTTP_MAX_APP_ROUTES
+#define HTTP_MAX_APP_ROUTES 4
+#endif
+
+// Opt-in request sharing: define HTTP_SHARE_REQUESTS to send an HTTP request that is
+// identical to one already in flight only once, and give every caller the response.
+#ifdef HTTP_SHARE_REQUESTS
+#ifndef HTTP_MAX_SHARED_REQUESTS
+#define HTTP_MAX_SHARED_REQUESTS 4
+#endif
+#ifndef HTTP_MAX_SUBSCRIBERS
+#define HTTP_MAX_SUBSCRIBERS 4
+#endif
+// Requests are compared byte for byte before being shared, so each pending one keeps a
+// copy; longer requests are never shared.
+#ifndef HTTP_SHARED_REQUEST_SIZE
+#define HTTP_SHARED_REQUEST_SIZE 96
+#endif
+#else
+#define HTTP_MAX_SUBSCRIBERS 1
+#endif
+
+// Time information from the phone is reused by http_time_get for this many seconds.
+#ifndef HTTP_TIME_MAX_AGE
+#define HTTP_TIME_MAX_AGE 21600
+#endif
+// The watch's clock is local time, so a DST change or a new time zone moves it. While
+// there is time information our timer fires at least every HTTP_TIME_CHECK_INTERVAL
+// seconds, and if the clock moved HTTP_TIME_JUMP seconds more or less than the timer
+// ran, the information is refreshed.
+#ifndef HTTP_TIME_CHECK_INTERVAL
+#define HTTP_TIME_CHECK_INTERVAL 600
+#endif
+#ifndef HTTP_TIME_JUMP
+#define HTTP_TIME_JUMP 900
+#endif
+#ifndef HTTP_TIME_TZ_NAME_SIZE
+#define HTTP_TIME_TZ_NAME_SIZE 32
+#endif
+
+// Opt-in offline journal: define HTTP_OFFLINE_JOURNAL to keep HTTP requests and cookie
+// sets that failed because the phone or bridge was away, and send them on reconnect.
+#ifdef HTTP_OFFLINE_JOURNAL
+#ifndef HTTP_JOURNAL_SIZE
+#define HTTP_JOURNAL_SIZE 512
+#endif
+#ifndef HTTP_JOURNAL_REPLAY_RATE
+#define HTTP_JOURNAL_REPLAY_RATE 2
+#endif
+#endif
+
+// Opt-in batching: define HTTP_BATCH to let http_batch_begin/http_batch_end pack
+// several calls into one message. Each part is a dictionary nested under its own key
+// from HTTP_BATCH_PART_KEY up. Replies are read with the same limit, batching or not.
+#ifndef HTTP_BATCH_MAX_PARTS
+#define HTTP_BATCH_MAX_PARTS 8
+#endif
+// Part keys run up to HTTP_BATCH_PART_KEY + 15; the next key is HTTP_STREAM_KEY.
+#if HTTP_BATCH_MAX_PARTS > 16
+#error "HTTP_BATCH_MAX_PARTS can be at most 16"
+#endif
+#ifdef HTTP_BATCH
+#ifndef HTTP_BATCH_BUFFER_SIZE
+#define HTTP_BATCH_BUFFER_SIZE HTTP_QUEUE_BUFFER_SIZE
+#endif
+#endif
+
+// Opt-in conditional requests: define HTTP_CONDITIONAL_REQUESTS to remember the
+// validator the bridge gives each response and send it with the next identical
+// request, so an unchanged response comes back as a bare 304.
+#ifdef HTTP_CONDITIONAL_REQUESTS
+#ifndef HTTP_VALIDATOR_ENTRIES
+#define HTTP_VALIDATOR_ENTRIES 4
+#endif
+// Identical requests that may be on their way at once, per validator.
+#ifndef HTTP_VALIDATOR_PENDING
+#define HTTP_VALIDATOR_PENDING 4
+#endif
+// Request ids, per validator, known to have the response the validator describes.
+#ifndef HTTP_VALIDATOR_OWNERS
+#define HTTP_VALIDATOR_OWNERS 4
+#endif
+#endif
+
+// Opt-in packed encoding: define HTTP_PACKED to send the integer values of HTTP
+// requests as one varint-encoded tuple, and accept responses packed the same way,
+// optionally compressed. Packed responses are unpacked into a buffer this big.
+#ifdef HTTP_PACKED
+#ifndef HTTP_PACKED_BUFFER_SIZE
+#define HTTP_PACKED_BUFFER_SIZE 256
+#endif
+#endif
+
+// Opt-in resync: define HTTP_RESYNC to let modules register what they need refreshed
+// after a reconnect and how stale it may get. Whatever is stale by then is sent one
+// item at a time, no more than HTTP_RESYNC_RATE a second.
+#ifdef HTTP_RESYNC
+#ifndef HTTP_RESYNC_ENTRIES
+#define HTTP_RESYNC_ENTRIES 8
+#endif
+#ifndef HTTP_RESYNC_RATE
+#define HTTP_RESYNC_RATE 2
+#endif
+#endif
+
+// Number of http_location_get callers that can be waiting on a fix at once.
+#ifndef HTTP_LOCATION_WAITERS
+#define HTTP_LOCATION_WAITERS 4
+#endif
+// Number of fixes a waiter is offered before it is told none was accurate enough.
+#ifndef HTTP_LOCATION_ATTEMPTS
+#define HTTP_LOCATION_ATTEMPTS 3
+#endif
+
+// Request ids from here up are used by the library for its own messages.
+#define HTTP_INTERNAL_REQUEST_ID 0x7FFFFF00
+#define TIME_SYNC_REQUEST_ID (HTTP_INTERNAL_REQUEST_ID + 2)
+#define LOCATION_SYNC_REQUEST_ID (HTTP_INTERNAL_REQUEST_ID + 3)
+// Each message of a write-back flush has its own id from here up, so its outcome can
+// be told apart from the others'.
+#define WRITE_BACK_REQUEST_ID (HTTP_INTERNAL_REQUEST_ID + 0x80)
+
+// Cookie passed to app_timer_send_event so we can recognise our own timers.
+#define HTTP_TIMER_COOKIE 0x48545450
+
+typedef enum {
+    REQUEST_NONE,
+    REQUEST_HTTP,
+    REQUEST_COOKIE_SET,
+    REQUEST_COOKIE_GET,
+    REQUEST_COOKIE_DELETE,
+    REQUEST_COOKIE_FSYNC,
+    REQUEST_TIME,
+    REQUEST_LOCATION,
+    REQUEST_BATCH,
+} RequestType;
+
+typedef struct {
+    uint8_t type;
+    uint8_t priority;
+    uint8_t attempts;
+    uint8_t batch; // Non-zero for a request sent as part of that batch.
+    int32_t request_id;
+    int32_t app_id;
+    uint32_t sent_at;
+    uint32_t deadline;
+#ifdef HTTP_STATS
+    uint32_t begun_at;
+#endif
+} InFlightRequest;
+
+typedef struct {
+    bool used;
+    uint8_t type;
+    uint8_t priority;
+    uint8_t passed;
+    uint8_t attempts;
+    int32_t request_id;
+    int32_t app_id;
+    uint32_t sequence;
+    uint32_t not_before;
+#ifdef HTTP_STATS
+    uint32_t queued_at;
+#endif
+    uint16_t size;
+    uint8_t buffer[HTTP_QUEUE_BUFFER_SIZE];
+} QueueSlot;
+
+// Where the message currently being built lives.
+typedef enum {
+    OUTBOX_IDLE,
+    OUTBOX_DIRECT,
+    OUTBOX_QUEUED,
+    OUTBOX_BATCHED,
+} OutboxState;
+
+// Who hears about messages for an app id.
+typedef struct {
+    int32_t app_id;
+    HTTPCallbacks callbacks;
+    void* context;
+} AppRoute;
+
 static bool callbacks_registered;
 static AppMessageCallbacksNode app_callbacks;
-static HTTPCallbacks http_callbacks;
 static int32_t our_app_id;
+// The callbacks from http_register_callbacks, for the last app id set that has no route
+// of its own. Failures nobody else claims go here too.
+static AppRoute default_route;
+static AppRoute app_routes[HTTP_MAX_APP_ROUTES];
+static uint8_t app_route_count;
+// Where callbacks are currently going.
+static const AppRoute* route = &default_route;
+
+static QueueSlot queue[HTTP_QUEUE_SIZE];
+static QueueSlot* queue_building;
+static uint8_t queue_count;
+static uint32_t queue_sequence;
+static uint32_t queue_overflows;
+static OutboxState outbox_state;
+static DictionaryIterator* outbox_iter;
+static RequestType outbox_type;
+static HTTPPriority outbox_priority;
+static int32_t outbox_request_id;
+static DictionaryIterator queue_iter;
+static HTTPPriority current_priority = HTTP_PRIORITY_NORMAL;
+
+static InFlightRequest in_flight[HTTP_MAX_IN_FLIGHT];
+static InFlightRequest* sending_request;
+
+// Set when a send fails because the phone isn't there; retries wait for it to come back.
+static bool link_down;
+static uint32_t retry_seed;
+
+#ifdef HTTP_BATCH
+// The batch being assembled, and the part currently being built for it.
+typedef struct {
+    uint8_t type;
+    int32_t request_id;
+    int32_t app_id;
+} BatchPart;
+
+static bool batch_active;
+static uint8_t batch_id;
+static uint8_t batch_count;
+static BatchPart batch_parts[HTTP_BATCH_MAX_PARTS];
+static Tuple* batch_count_tuple;
+static DictionaryIterator batch_iter;
+static DictionaryIterator batch_part_iter;
+static uint8_t batch_buffer[HTTP_BATCH_BUFFER_SIZE];
+static uint8_t batch_part[HTTP_BATCH_BUFFER_SIZE];
+#endif
+
+#ifdef HTTP_OFFLINE_JOURNAL
+// Each entry is a JournalEntry followed by `size` bytes of serialized dictionary,
+// packed oldest first from the start of the buffer.
+typedef struct {
+    uint8_t type;
+    uint8_t priority;
+    uint16_t size;
+    int32_t request_id;
+    int32_t app_id;
+} JournalEntry;
+
+static uint8_t journal[HTTP_JOURNAL_SIZE];
+static uint16_t journal_used;
+static bool journal_replaying;
+// The last entry handed to the queue, so we only hand over one at a time.
+static QueueSlot* journal_slot;
+static uint32_t journal_slot_sequence;
+static uint32_t journal_second;
+static uint8_t journal_sent;
+#endif
+
+#ifdef HTTP_RESYNC
+// Something a module wants refreshed on reconnect. Entries for the same request
+// share one refresh, and are all made fresh by its answer.
+typedef struct {
+    uint8_t type;
+    bool fresh;
+    bool due;
+    int32_t request_id;
+    int32_t app_id;
+    uint32_t max_age;
+    uint32_t fresh_at;
+    HTTPResyncHandler handler;
+    void* context;
+} ResyncEntry;
+
+static ResyncEntry resync_entries[HTTP_RESYNC_ENTRIES];
+static uint8_t resync_count;
+// The last item sent, so we only hand over one at a time.
+static ResyncEntry resync_last;
+static uint32_t resync_second;
+static uint8_t resync_sent;
+#endif
+
+static AppContextRef timer_app_ctx;
+static AppTimerHandle timer_handle;
+static bool timer_armed;
+static uint32_t timer_deadline;
+// The clock when the timer was armed, and how long it was armed for.
+static uint32_t timer_armed_at;
+static uint32_t timer_delay;
+
+#ifdef HTTP_COOKIE_CACHE
+// Cookies belong to an app id, so entries are kept per app id.
+typedef struct {
+    bool used;
+    uint8_t type;
+    uint16_t length;
+    int32_t app_id;
+    uint32_t key;
+    uint32_t last_used;
+    uint8_t value[HTTP_COOKIE_CACHE_VALUE_SIZE];
+} CachedCookie;
+
+static CachedCookie cookie_cache[HTTP_COOKIE_CACHE_ENTRIES];
+static uint32_t cookie_cache_clock;
+static uint32_t cookie_cache_hits;
+static uint32_t cookie_cache_misses;
+
+static void cookie_cache_store(int32_t app_id, uint32_t key, TupleType type, const void* value, uint16_t length);
+static void cookie_cache_clear();
+static void cookie_cache_forget(int32_t app_id);
+#endif
+
+// A cookie get or delete that is waiting on more than one reply. Gets assemble
+// their answer in `buffer`; the app hears about either only once all replies are in.
+typedef struct {
+    bool active;
+    bool building;
+    bool failed;
+    bool overflowed;
+    uint8_t replies;
+    uint8_t cached;
+    int32_t request_id;
+    DictionaryIterator iter;
+    uint8_t buffer[HTTP_COOKIE_MERGE_SIZE];
+} PendingGet;
+
+typedef struct {
+    bool active;
+    bool building;
+    bool failed;
+    uint8_t replies;
+    int32_t request_id;
+} PendingDelete;
+
+static PendingGet pending_get;
+static PendingDelete pending_delete;
+
+// The keys of the split get or delete being sent, and how many of them have gone.
+typedef struct {
+    bool active;
+    RequestType type;
+    uint16_t count;
+    uint16_t next;
+    int32_t app_id;
+    int32_t request_id;
+    uint32_t keys[HTTP_COOKIE_PENDING_KEYS];
+} PendingKeys;
+
+static PendingKeys pending_keys;
+
+// An HTTP response arriving in fragments. Without a buffer each fragment is passed
+// to the fragment handler as it arrives; with one they are reassembled into it. A
+// cancelled stream keeps its request id until the slot is reused, so the rest of its
+// fragments can be dropped quietly.
+typedef struct {
+    bool active;
+    bool cancelled;
+    bool overflowed;
+    uint16_t next_index;
+    int32_t request_id;
+    uint8_t* buffer;
+    DictionaryIterator iter;
+} ResponseStream;
+
+static ResponseStream streams[HTTP_MAX_STREAMS];
+
+// The last time information received from the phone, and when it arrived.
+typedef struct {
+    bool valid;
+    bool stale;
+    bool refreshing;
+    bool is_dst;
+    int32_t utc_offset;
+    uint32_t unixtime;
+    uint32_t received_at;
+    char tz_name[HTTP_TIME_TZ_NAME_SIZE];
+} TimeSync;
+
+static TimeSync time_sync;
+
+// The last location fix received from the phone, and the callers waiting for a new one.
+typedef struct {
+    HTTPLocationHandler handler;
+    void* context;
+    float max_accuracy;
+    uint8_t attempts;
+} LocationWaiter;
+
+typedef struct {
+    bool valid;
+    bool refreshing;
+    // The refresh went out when the in-flight table was full, so nothing will time it out.
+    bool untracked;
+    float latitude;
+    float longitude;
+    float altitude;
+    float accuracy;
+    uint32_t received_at;
+    uint8_t waiter_count;
+    LocationWaiter waiters[HTTP_LOCATION_WAITERS];
+} LocationSync;
+
+static LocationSync location_sync;
+
+#ifdef HTTP_CONDITIONAL_REQUESTS
+typedef struct {
+    int32_t app_id;
+    int32_t request_id;
+} ValidatorRequest;
+
+// The validator of the last response to a request, the requests sent since whose
+// responses may update it, and the requests whose callers were given that response,
+// oldest first. Only those callers can be told the response hasn't changed.
+typedef struct {
+    bool used;
+    bool valid;
+    uint8_t pending_count;
+    uint8_t owner_count;
+    uint32_t hash;
+    uint32_t validator;
+    uint32_t last_used;
+    ValidatorRequest pending[HTTP_VALIDATOR_PENDING];
+    ValidatorRequest owners[HTTP_VALIDATOR_OWNERS];
+} ValidatorEntry;
+
+static ValidatorEntry validators[HTTP_VALIDATOR_ENTRIES];
+static uint32_t validator_clock;
+#endif
+
+#ifdef HTTP_SHARE_REQUESTS
+// An HTTP request that is on its way, and the later identical requests waiting on its response.
+typedef struct {
+    bool active;
+    uint8_t subscriber_count;
+    uint16_t size;
+    uint32_t hash;
+    int32_t request_id;
+    int32_t subscribers[HTTP_MAX_SUBSCRIBERS];
+#ifdef HTTP_CONDITIONAL_REQUESTS
+    // It went out with a validator, so its response may be a bare 304.
+    bool conditional;
+#endif
+    // The tuples that were hashed.
+    uint8_t request[HTTP_SHARED_REQUEST_SIZE];
+} SharedRequest;
+
+static SharedRequest shared_requests[HTTP_MAX_SHARED_REQUESTS];
+#endif
+
+static void pending_get_reply(void* context);
+static void pending_delete_reply(void* context);
+static void cookie_keys_continue();
+
+#ifdef HTTP_COOKIE_WRITE_BACK
+// A cookie value waiting to be flushed; its bytes live in staged_data. Bit n of `ids`
+// is set if staged_ids[n] wrote it, or an earlier value for its key.
+typedef struct {
+    uint32_t key;
+    uint8_t type;
+    uint16_t length;
+    uint16_t offset;
+    uint32_t ids;
+} StagedCookie;
+
+static StagedCookie staged[HTTP_WRITE_BACK_MAX_KEYS];
+static uint8_t staged_count;
+// Staged values all belong to this app id.
+static int32_t staged_app_id;
+static uint8_t staged_data[HTTP_WRITE_BACK_BUFFER_SIZE];
+static uint16_t staged_data_used;
+static uint32_t staged_since;
+// Caller request ids covered by the staged and flushing values.
+static int32_t staged_ids[HTTP_WRITE_BACK_MAX_KEYS];
+static uint8_t staged_id_count;
+static uint8_t flushing_messages;
+// The callers each flush message in flight carries values for, by WRITE_BACK_REQUEST_ID
+// offset, and the callers with a value that didn't make it.
+static uint32_t flush_parts[HTTP_WRITE_BACK_MAX_KEYS];
+static uint32_t flush_parts_used;
+static uint32_t flush_failed_ids;
+
+static int write_back_part(int32_t request_id);
+static void write_back_message_done(int part, bool successful);
+static void write_back_poll(uint32_t now);
+static void write_back_next_deadline(uint32_t* deadline);
+#endif
 
+static void app_sent(DictionaryIterator* sent, void* context);
 static void app_send_failed(DictionaryIterator* failed, AppMessageResult reason, void* context);
 static void app_received(DictionaryIterator* received, void* context);
+static void app_received_dispatch(DictionaryIterator* received, void* context);
 static void app_dropped(void* context, AppMessageResult reason);
+static void queue_drain();
+static void timer_schedule();
+static void stream_cancel(int32_t request_id);
+static uint8_t shared_take(int32_t request_id, int32_t* subscribers);
+#ifdef HTTP_SHARE_REQUESTS
+static bool shared_attach(SharedRequest** entry_out);
+#endif
+static HTTPResult time_sync_refresh();
+static HTTPResult location_sync_refresh();
+static void location_waiters_notify(float latitude, float longitude, float altitude, float accuracy);
+static void location_untracked_sent();
+static void retry_next_deadline(uint32_t* deadline);
+#ifdef HTTP_OFFLINE_JOURNAL
+static void journal_replay();
+static void journal_next_deadline(uint32_t* deadline);
+#endif
+#ifdef HTTP_RESYNC
+static void resync_fresh(RequestType type, int32_t request_id);
+static void resync_run();
+static void resync_next_deadline(uint32_t* deadline);
+#else
+#define resync_fresh(type, request_id)
+#endif
 
-HTTPResult http_out_get(const char* url, int32_t cookie, DictionaryIterator **iter_out) {
-    AppMessageResult app_result = app_message_out_get(iter_out);
-    if(app_result != APP_MSG_OK) {
-        return app_result;
+// Seconds on the watch's local clock. Only differences between two readings are
+// meaningful; the count is monotonic unless the watch's time is changed.
+static uint32_t http_clock() {
+    PblTm now;
+    get_time(&now);
+    uint32_t days = (now.tm_year - 70) * 365 + (now.tm_year - 69) / 4 + now.tm_yday;
+    return ((days * 24 + now.tm_hour) * 60 + now.tm_min) * 60 + now.tm_sec;
+}
+
+// Instrumentation. Without HTTP_STATS the hooks below compile to nothing.
+#ifdef HTTP_STATS
+static HTTPStats stats[HTTP_STATS_TYPES];
+static HTTPTraceEvent trace[HTTP_TRACE_SIZE];
+static uint8_t trace_next;
+static uint8_t trace_count;
+
+static uint8_t stats_type(uint8_t type) {
+    switch(type) {
+    case REQUEST_HTTP: return HTTP_STATS_HTTP;
+    case REQUEST_COOKIE_SET:
+    case REQUEST_COOKIE_GET:
+    case REQUEST_COOKIE_DELETE:
+    case REQUEST_COOKIE_FSYNC: return HTTP_STATS_COOKIE;
+    case REQUEST_TIME: return HTTP_STATS_TIME;
+    case REQUEST_LOCATION: return HTTP_STATS_LOCATION;
+    default: return HTTP_STATS_TYPES; // Batches are counted by their parts.
     }
-    DictionaryResult dict_result = dict_write_cstring(*iter_out, HTTP_URL_KEY, url);
-    if(dict_result != DICT_OK) {
-        return dict_result << 12;
+}
+
+static void stats_bump(uint16_t* counter) {
+    if(*counter < UINT16_MAX) ++*counter;
+}
+
+// Buckets double in width: 0, 1, 2-3, 4-7 seconds and so on.
+static void stats_record(uint16_t* histogram, uint32_t seconds) {
+    uint8_t bucket = 0;
+    while(seconds > 0 && bucket < HTTP_STATS_BUCKETS - 1) {
+        seconds >>= 1;
+        ++bucket;
     }
-    dict_result = dict_write_int32(*iter_out, HTTP_COOKIE_KEY, cookie);
-    if(dict_result != DICT_OK) {
-        return dict_result << 12;
+    stats_bump(&histogram[bucket]);
+}
+
+// Counts the event against its type and adds it to the trace; returns the type's
+// stats, or NULL if it has none.
+static HTTPStats* stats_event(HTTPTraceKind kind, uint8_t type, int32_t request_id, int32_t status) {
+    uint8_t index = stats_type(type);
+    if(index == HTTP_STATS_TYPES) return NULL;
+    trace[trace_next] = (HTTPTraceEvent){
+        .time = http_clock(),
+        .request_id = request_id,
+        .status = status,
+        .kind = kind,
+        .type = index,
+    };
+    trace_next = (trace_next + 1) % HTTP_TRACE_SIZE;
+    if(trace_count < HTTP_TRACE_SIZE) {
+        ++trace_count;
     }
-    dict_result = dict_write_int32(*iter_out, HTTP_APP_ID_KEY, our_app_id);
-    if(dict_result != DICT_OK) {
-        return dict_result << 12;
+    return &stats[index];
+}
+
+static void stats_busy(uint8_t type, int32_t request_id) {
+    HTTPStats* entry = stats_event(HTTP_TRACE_BUSY, type, request_id, HTTP_BUSY);
+    if(entry) {
+        stats_bump(&entry->busy);
     }
-    return HTTP_OK;
 }
 
+static void stats_queued(uint8_t type, int32_t request_id) {
+    stats_event(HTTP_TRACE_QUEUED, type, request_id, 0);
+}
 
-HTTPResult http_out_send() {
-    AppMessageResult result = app_message_out_send();
-    app_message_out_release(); // We don't care if it's already released.
-    return result;
+static void stats_sent(const InFlightRequest* request) {
+    if(!request) return;
+    HTTPStats* entry = stats_event(HTTP_TRACE_SENT, request->type, request->request_id, 0);
+    if(entry) {
+        stats_bump(&entry->sent);
+        stats_record(entry->wait, request->sent_at - request->begun_at);
+    }
 }
 
-bool http_register_callbacks(HTTPCallbacks callbacks, void* context) {
-    http_callbacks = callbacks;
-    if(callbacks_registered) {
-        if(app_message_deregister_callbacks(&app_callbacks) == APP_MSG_OK)
-            callbacks_registered = false;
+static void stats_answered(const InFlightRequest* request) {
+    HTTPStats* entry = stats_event(HTTP_TRACE_ANSWERED, request->type, request->request_id, 0);
+    if(entry) {
+        stats_bump(&entry->answered);
+        stats_record(entry->latency, http_clock() - request->begun_at);
     }
-    if(!callbacks_registered) {
-        app_callbacks = (AppMessageCallbacksNode){
-            .callbacks = {
-                .out_failed = app_send_failed,
-                .in_received = app_received,
-                .in_dropped = app_dropped,
-            },
-            .context = context
+}
+
+static void stats_failed(uint8_t type, int32_t request_id, int32_t status) {
+    HTTPStats* entry = stats_event(HTTP_TRACE_FAILED, type, request_id, status);
+    if(!entry) return;
+    stats_bump(&entry->failed);
+    if(status == 1000 + HTTP_SEND_TIMEOUT) {
+        stats_bump(&entry->timeouts);
+    } else if(status == 1000 + HTTP_INVALID_BRIDGE_RESPONSE) {
+        stats_bump(&entry->invalid_responses);
+    }
+}
+
+static void stats_retried(const InFlightRequest* request, HTTPTraceKind kind) {
+    HTTPStats* entry = stats_event(kind, request->type, request->request_id, 0);
+    if(entry) {
+        stats_bump(&entry->retried);
+    }
+}
+#else
+#define stats_busy(type, request_id)
+#define stats_queued(type, request_id)
+#define stats_sent(request)
+#define stats_answered(request)
+#define stats_failed(type, request_id, status)
+#define stats_retried(request, kind)
+#endif
+
+// App id routing
+static AppRoute* route_find(int32_t app_id) {
+    for(int i = 0; i < app_route_count; ++i) {
+        if(app_routes[i].app_id == app_id) return &app_routes[i];
+    }
+    return NULL;
+}
+
+// Sends callbacks to the route for `app_id`, or the default one, until the returned
+// route is restored.
+static const AppRoute* route_enter(int32_t app_id) {
+    const AppRoute* outer = route;
+    const AppRoute* found = route_find(app_id);
+    route = found ? found : &default_route;
+    return outer;
+}
+
+static void report_failure_routed(RequestType type, int32_t request_id, int status);
+
+static void report_failure(int32_t app_id, RequestType type, int32_t request_id, int status) {
+    const AppRoute* outer = route_enter(app_id);
+    report_failure_routed(type, request_id, status);
+    route = outer;
+}
+
+static void report_failure_routed(RequestType type, int32_t request_id, int status) {
+    stats_failed(type, request_id, status);
+    if(type == REQUEST_BATCH) {
+        // Everything that was in it failed.
+        for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+            if(in_flight[i].type == REQUEST_NONE || in_flight[i].batch != request_id) continue;
+            RequestType part_type = in_flight[i].type;
+            in_flight[i].type = REQUEST_NONE;
+            report_failure(in_flight[i].app_id, part_type, in_flight[i].request_id, status);
+        }
+        return;
+    }
+#ifdef HTTP_COOKIE_WRITE_BACK
+    if(type == REQUEST_COOKIE_SET && write_back_part(request_id) >= 0) {
+        write_back_message_done(write_back_part(request_id), false);
+        return;
+    }
+#endif
+#ifdef HTTP_COOKIE_CACHE
+    // We can't tell which values didn't make it, so stop trusting any of them.
+    if(type == REQUEST_COOKIE_SET) {
+        cookie_cache_clear();
+    }
+#endif
+    if(type == REQUEST_TIME && request_id == TIME_SYNC_REQUEST_ID) {
+        // Keep answering from what we have; the next http_time_get tries again.
+        time_sync.refreshing = false;
+        return;
+    }
+    if(type == REQUEST_LOCATION && request_id == LOCATION_SYNC_REQUEST_ID) {
+        // Waiters are told there is no location; the app hears about it as for http_location_request.
+        location_sync.refreshing = false;
+        location_waiters_notify(0, 0, 0, HTTP_LOCATION_FAILED);
+        request_id = 0;
+    }
+    if(type == REQUEST_HTTP) {
+        stream_cancel(request_id);
+        int32_t subscribers[HTTP_MAX_SUBSCRIBERS];
+        uint8_t count = shared_take(request_id, subscribers);
+        for(int i = 0; i < count && route->callbacks.failure; ++i) {
+            route->callbacks.failure(subscribers[i], status, route->context);
+        }
+    }
+    // Split requests report their first failure only, and finish once every part is accounted for.
+    if(type == REQUEST_COOKIE_GET && pending_get.active && pending_get.request_id == request_id) {
+        bool reported = pending_get.failed;
+        pending_get.failed = true;
+        pending_get_reply(route->context);
+        if(reported) return;
+    }
+    if(type == REQUEST_COOKIE_DELETE && pending_delete.active && pending_delete.request_id == request_id) {
+        bool reported = pending_delete.failed;
+        pending_delete.failed = true;
+        pending_delete_reply(route->context);
+        if(reported) return;
+    }
+    if(route->callbacks.failure) {
+        route->callbacks.failure(request_id, status, route->context);
+    }
+}
+
+// In-flight request table. Entries are added when a message is handed to
+// app_message_out_send and removed when the bridge answers, the send fails,
+// or the deadline passes.
+static InFlightRequest* request_track(RequestType type, HTTPPriority priority, int32_t request_id) {
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type != REQUEST_NONE) continue;
+        uint32_t now = http_clock();
+        in_flight[i] = (InFlightRequest){
+            .type = type,
+            .priority = priority,
+            .request_id = request_id,
+            .app_id = our_app_id,
+            .sent_at = now,
+            .deadline = now + HTTP_REQUEST_TIMEOUT,
+#ifdef HTTP_STATS
+            .begun_at = now,
+#endif
         };
-        if(app_message_register_callbacks(&app_callbacks) == APP_MSG_OK)
-            callbacks_registered = true;
+        timer_schedule();
+        return &in_flight[i];
     }
-    return callbacks_registered;
+    // Table full: the request goes out untracked, as it would have before. Nothing
+    // will time it out, so it mustn't hold back the next refresh of the time or location.
+    if(type == REQUEST_TIME && request_id == TIME_SYNC_REQUEST_ID) {
+        time_sync.refreshing = false;
+    }
+    // Its waiters are told as soon as it has been sent, rather than from in here.
+    if(type == REQUEST_LOCATION && request_id == LOCATION_SYNC_REQUEST_ID) {
+        location_sync.untracked = true;
+    }
+    return NULL;
 }
 
-static void app_send_failed(DictionaryIterator* failed, AppMessageResult reason, void* context) {
-    if(!http_callbacks.failure) return;
-    http_callbacks.failure(0, 1000 + reason, context);
+static void request_start(RequestType type, HTTPPriority priority, int32_t request_id) {
+    sending_request = request_track(type, priority, request_id);
 }
 
-static void app_received_http_response(DictionaryIterator* received, bool success, void* context) {
-    Tuple* status_tuple = dict_find(received, HTTP_STATUS_KEY);
-    Tuple* cookie_tuple = dict_find(received, HTTP_COOKIE_KEY);
-    if(status_tuple == NULL || cookie_tuple == NULL) {
-        if(http_callbacks.failure) {
-            http_callbacks.failure(0, 1000 + HTTP_INVALID_BRIDGE_RESPONSE, context);
+static void request_finish(RequestType type, int32_t request_id) {
+    // Time and location answers don't say which of several identical requests they
+    // answer. The one the phone has yet to acknowledge is the least likely.
+    InFlightRequest* request = NULL;
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type != type || in_flight[i].request_id != request_id) continue;
+        request = &in_flight[i];
+        if(request != sending_request) break;
+    }
+    if(!request) return;
+    stats_answered(request);
+    request->type = REQUEST_NONE;
+    if(sending_request == request) {
+        sending_request = NULL;
+    }
+}
+
+// Pushes back the deadline of a request that is still making progress.
+static void request_touch(RequestType type, int32_t request_id) {
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type != type || in_flight[i].request_id != request_id) continue;
+        in_flight[i].deadline = http_clock() + HTTP_REQUEST_TIMEOUT;
+        return;
+    }
+}
+
+static void requests_expire(uint32_t now) {
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type == REQUEST_NONE || now < in_flight[i].deadline) continue;
+        RequestType type = in_flight[i].type;
+        in_flight[i].type = REQUEST_NONE;
+        if(sending_request == &in_flight[i]) {
+            sending_request = NULL;
+        }
+        report_failure(in_flight[i].app_id, type, in_flight[i].request_id, 1000 + HTTP_SEND_TIMEOUT);
+    }
+}
+
+// Whether another request of this class may be sent before some are answered.
+static bool requests_below_limit(HTTPPriority priority) {
+    static const uint8_t limits[] = {
+        [HTTP_PRIORITY_INTERACTIVE] = HTTP_MAX_IN_FLIGHT,
+        [HTTP_PRIORITY_NORMAL] = HTTP_MAX_IN_FLIGHT_NORMAL,
+        [HTTP_PRIORITY_BACKGROUND] = HTTP_MAX_IN_FLIGHT_BACKGROUND,
+    };
+    uint8_t count = 0;
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type != REQUEST_NONE && in_flight[i].priority == priority) ++count;
+    }
+    return count < limits[priority];
+}
+
+#ifdef HTTP_BATCH
+static uint8_t requests_free() {
+    uint8_t count = 0;
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type == REQUEST_NONE) ++count;
+    }
+    return count;
+}
+#endif
+
+static void requests_next_deadline(uint32_t* deadline) {
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type != REQUEST_NONE && in_flight[i].deadline < *deadline) {
+            *deadline = in_flight[i].deadline;
+        }
+    }
+}
+
+// Timers. The SDK delivers timer events to the app's timer_handler, which has to
+// pass them on through http_timer_handler. We keep a single timer armed for the
+// earliest deadline anything in the library is waiting on.
+static void timer_poll() {
+    uint32_t now = http_clock();
+    requests_expire(now);
+#ifdef HTTP_COOKIE_WRITE_BACK
+    write_back_poll(now);
+#endif
+#ifdef HTTP_OFFLINE_JOURNAL
+    journal_replay();
+#endif
+#ifdef HTTP_RESYNC
+    resync_run();
+#endif
+    // Expired requests may have made room for a class at its in-flight limit.
+    queue_drain();
+}
+
+static void timer_schedule() {
+    if(!timer_app_ctx) return;
+    uint32_t deadline = UINT32_MAX;
+    requests_next_deadline(&deadline);
+    retry_next_deadline(&deadline);
+#ifdef HTTP_OFFLINE_JOURNAL
+    journal_next_deadline(&deadline);
+#endif
+#ifdef HTTP_RESYNC
+    resync_next_deadline(&deadline);
+#endif
+#ifdef HTTP_COOKIE_WRITE_BACK
+    write_back_next_deadline(&deadline);
+#endif
+    uint32_t now = http_clock();
+    if(time_sync.valid && now + HTTP_TIME_CHECK_INTERVAL < deadline) {
+        deadline = now + HTTP_TIME_CHECK_INTERVAL;
+    }
+    if(deadline == UINT32_MAX) return;
+    if(timer_armed) {
+        if(timer_deadline <= deadline) return;
+        app_timer_cancel_event(timer_app_ctx, timer_handle);
+    }
+    uint32_t delay = deadline > now ? deadline - now : 0;
+    timer_handle = app_timer_send_event(timer_app_ctx, delay * 1000, HTTP_TIMER_COOKIE);
+    timer_armed = true;
+    timer_deadline = deadline;
+    timer_armed_at = now;
+    timer_delay = delay;
+}
+
+// Compares how far the clock moved with how long the timer that just fired ran.
+static void time_sync_clock_check(uint32_t now) {
+    if(!time_sync.valid) return;
+    int32_t jump = (int32_t)(now - timer_armed_at) - (int32_t)timer_delay;
+    if(jump < HTTP_TIME_JUMP && jump > -HTTP_TIME_JUMP) return;
+    // The time the phone sent is still right; how long ago it came isn't.
+    time_sync.received_at += jump;
+    time_sync.stale = true;
+    time_sync_refresh();
+}
+
+void http_set_app_context(AppContextRef app_ctx) {
+    timer_app_ctx = app_ctx;
+    timer_schedule();
+}
+
+bool http_timer_handler(AppContextRef app_ctx, AppTimerHandle handle, uint32_t cookie) {
+    (void)app_ctx;
+    if(cookie != HTTP_TIMER_COOKIE || !timer_armed || handle != timer_handle) return false;
+    timer_armed = false;
+    time_sync_clock_check(http_clock());
+    timer_poll();
+    timer_schedule();
+    return true;
+}
+
+// Writes a raw value of the given tuple type; cstring lengths include the terminator.
+static DictionaryResult dict_write_value(DictionaryIterator* iter, uint32_t key, TupleType type, const void* value, uint16_t length) {
+    switch(type) {
+    case TUPLE_BYTE_ARRAY:
+        return dict_write_data(iter, key, value, length);
+    case TUPLE_CSTRING:
+        return dict_write_cstring(iter, key, value);
+    case TUPLE_UINT:
+    case TUPLE_INT:
+        return dict_write_int(iter, key, value, length, type == TUPLE_INT);
+    }
+    return DICT_INVALID_ARGS;
+}
+
+// Copies a single tuple into a dictionary being written, preserving its type and width.
+static DictionaryResult dict_write_tuple(DictionaryIterator* iter, const Tuple* tuple) {
+    return dict_write_value(iter, tuple->key, tuple->type, tuple->value, tuple->length);
+}
+
+// A serialized dictionary is a count byte followed by its tuples, exactly as it goes
+// over the air, so whole messages can be moved around with a single copy.
+// Returns the size of the one `iter` reads, looking only at the tuple headers.
+static uint16_t dict_serialized_size(DictionaryIterator* iter) {
+    const uint8_t* end = (const uint8_t*)iter->dictionary + 1;
+    for(Tuple* tuple = dict_read_first(iter); tuple; tuple = dict_read_next(iter)) {
+        end = tuple->value->data + tuple->length;
+    }
+    return end - (const uint8_t*)iter->dictionary;
+}
+
+// Fills a dictionary that has just been begun with a serialized one.
+static DictionaryResult dict_write_serialized(DictionaryIterator* iter, const uint8_t* buffer, uint16_t size) {
+    uint8_t* start = (uint8_t*)iter->dictionary;
+    if(size < 1 || (uint8_t*)iter->cursor != start + 1) return DICT_INVALID_ARGS;
+    if(size > (const uint8_t*)iter->end - start) return DICT_NOT_ENOUGH_STORAGE;
+    memcpy(start, buffer, size);
+    iter->cursor = (Tuple*)(start + size);
+    return DICT_OK;
+}
+
+// Response decoding
+// Reads an integer tuple of any width; false if it isn't one.
+static bool tuple_int(const Tuple* tuple, int64_t* value) {
+    if(tuple->type == TUPLE_INT) {
+        switch(tuple->length) {
+        case 1: *value = tuple->value->int8; return true;
+        case 2: *value = tuple->value->int16; return true;
+        case 4: *value = tuple->value->int32; return true;
+        }
+    } else if(tuple->type == TUPLE_UINT) {
+        switch(tuple->length) {
+        case 1: *value = tuple->value->uint8; return true;
+        case 2: *value = tuple->value->uint16; return true;
+        case 4: *value = tuple->value->uint32; return true;
+        }
+    }
+    return false;
+}
+
+// A string with at least its terminator, which ends where the tuple does.
+static bool tuple_cstring(const Tuple* tuple) {
+    const char* string = tuple->value->cstring;
+    return tuple->type == TUPLE_CSTRING && tuple->length > 0 && string[tuple->length - 1] == '\0';
+}
+
+static bool decode_int(const Tuple* tuple, const HTTPField* field, uint8_t* out) {
+    int64_t value;
+    if(!tuple_int(tuple, &value)) return false;
+    int64_t min, max;
+    switch(field->width) {
+    case 1: min = field->type == HTTP_FIELD_INT ? INT8_MIN : 0; max = field->type == HTTP_FIELD_INT ? INT8_MAX : UINT8_MAX; break;
+    case 2: min = field->type == HTTP_FIELD_INT ? INT16_MIN : 0; max = field->type == HTTP_FIELD_INT ? INT16_MAX : UINT16_MAX; break;
+    case 4: min = field->type == HTTP_FIELD_INT ? INT32_MIN : 0; max = field->type == HTTP_FIELD_INT ? INT32_MAX : UINT32_MAX; break;
+    default: return false;
+    }
+    if(value < min || value > max) return false;
+    switch(field->width) {
+    case 1: { uint8_t v = value; memcpy(out, &v, 1); break; }
+    case 2: { uint16_t v = value; memcpy(out, &v, 2); break; }
+    case 4: { uint32_t v = value; memcpy(out, &v, 4); break; }
+    }
+    return true;
+}
+
+// Decodes `response` into the struct at `out` as described by `fields`, walking the
+// dictionary once. Returns a bitmask, by position in `fields`, of fields that were
+// missing or couldn't be decoded; those are left untouched, bar truncated strings.
+uint32_t http_decode(DictionaryIterator* response, const HTTPField* fields, uint8_t count, void* out) {
+    uint32_t failed = count >= 32 ? UINT32_MAX : (1u << count) - 1;
+    Tuple* tuple = dict_read_first(response);
+    while(tuple) {
+        for(int i = 0; i < count; ++i) {
+            const HTTPField* field = &fields[i];
+            if(field->key != tuple->key) continue;
+            uint8_t* dest = (uint8_t*)out + field->offset;
+            bool ok = false;
+            switch(field->type) {
+            case HTTP_FIELD_INT:
+            case HTTP_FIELD_UINT:
+                ok = decode_int(tuple, field, dest);
+                break;
+            case HTTP_FIELD_CSTRING:
+                // Always terminated; a string that had to be cut short still counts as failed.
+                if(tuple_cstring(tuple) && field->width > 0) {
+                    uint16_t length = tuple->length < field->width ? tuple->length : field->width;
+                    memcpy(dest, tuple->value->cstring, length);
+                    dest[length - 1] = '\0';
+                    ok = tuple->length <= field->width;
+                }
+                break;
+            case HTTP_FIELD_DATA:
+                if(tuple->type == TUPLE_BYTE_ARRAY && tuple->length <= field->width) {
+                    memcpy(dest, tuple->value->data, tuple->length);
+                    ok = true;
+                }
+                break;
+            }
+            if(i < 32) {
+                failed = ok ? failed & ~(1u << i) : failed | (1u << i);
+            }
+        }
+        tuple = dict_read_next(response);
+    }
+    return failed;
+}
+
+// Packed encoding. Each value is a varint of the zigzagged difference from the
+// previous key, then a varint tag: the tuple type in the low two bits and above
+// that the integer width, or the cstring (including terminator) or data length.
+// Integers follow as a varint, zigzagged if signed; strings and data follow raw.
+#ifdef HTTP_PACKED
+// Outbound requests are rebuilt here; inbound compressed values are expanded into
+// the scratch buffer and then unpacked into a dictionary of their own.
+static uint8_t packed_message[HTTP_QUEUE_BUFFER_SIZE];
+static uint8_t packed_scratch[HTTP_PACKED_BUFFER_SIZE];
+static uint8_t unpacked_buffer[HTTP_PACKED_BUFFER_SIZE];
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static uint8_t* varint_write(uint8_t* out, const uint8_t* end, uint32_t value) {
+    do {
+        if(out == end) return NULL;
+        *out++ = (value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+        value >>= 7;
+    } while(value);
+    return out;
+}
+
+static const uint8_t* varint_read(const uint8_t* in, const uint8_t* end, uint32_t* value) {
+    *value = 0;
+    for(int shift = 0; shift < 35; shift += 7) {
+        if(in == end) return NULL;
+        *value |= (uint32_t)(*in & 0x7F) << shift;
+        if(!(*in++ & 0x80)) return in;
+    }
+    return NULL;
+}
+
+// Rebuilds the HTTP request being built with its integer values packed into one
+// tuple. The packed tuple is always added, even if empty, to tell the bridge that
+// the response may be packed too. Left as it was if that wouldn't fit.
+static void packed_encode() {
+    uint8_t* out = packed_scratch;
+    const uint8_t* out_end = packed_scratch + sizeof(packed_scratch);
+    uint32_t previous = 0;
+    DictionaryIterator rebuilt;
+    dict_write_begin(&rebuilt, packed_message, sizeof(packed_message));
+    DictionaryIterator read;
+    Tuple* tuple = dict_read_begin_from_buffer(&read, (uint8_t*)outbox_iter->dictionary, (uint8_t*)outbox_iter->cursor - (uint8_t*)outbox_iter->dictionary);
+    while(tuple) {
+        bool user = tuple->key < 0xF000 || tuple->key > 0xFFFF;
+        int64_t value;
+        if(user && tuple_int(tuple, &value)) {
+            out = varint_write(out, out_end, zigzag(tuple->key - previous));
+            if(out) out = varint_write(out, out_end, tuple->type | (tuple->length << 2));
+            if(out) out = varint_write(out, out_end, tuple->type == TUPLE_INT ? zigzag(value) : (uint32_t)value);
+            if(!out) return;
+            previous = tuple->key;
+        } else if(dict_write_tuple(&rebuilt, tuple) != DICT_OK) {
+            return;
+        }
+        tuple = dict_read_next(&read);
+    }
+    if(dict_write_data(&rebuilt, HTTP_PACKED_KEY, packed_scratch, out - packed_scratch) != DICT_OK) return;
+    uint16_t size = dict_write_end(&rebuilt);
+    if(size > (const uint8_t*)outbox_iter->end - (uint8_t*)outbox_iter->dictionary) return;
+    // Same tuples in the same order, so this can't run out of room.
+    dict_write_begin(outbox_iter, (uint8_t*)outbox_iter->dictionary, (const uint8_t*)outbox_iter->end - (uint8_t*)outbox_iter->dictionary);
+    tuple = dict_read_begin_from_buffer(&read, packed_message, size);
+    while(tuple) {
+        dict_write_tuple(outbox_iter, tuple);
+        tuple = dict_read_next(&read);
+    }
+}
+
+// Expands LZ-compressed bytes. A control byte below 0x80 is followed by that many
+// plus one literal bytes; otherwise (control & 0x7F) + 3 bytes are copied from a
+// varint distance back in the output.
+static HTTPResult lz_decode(const uint8_t* in, uint16_t length, uint8_t* out, uint16_t capacity, uint16_t* size_out) {
+    const uint8_t* end = in + length;
+    uint16_t size = 0;
+    while(in < end) {
+        uint8_t control = *in++;
+        if(control < 0x80) {
+            uint16_t count = control + 1;
+            if(count > end - in) return HTTP_INVALID_BRIDGE_RESPONSE;
+            if(count > capacity - size) return HTTP_BUFFER_OVERFLOW;
+            memcpy(&out[size], in, count);
+            in += count;
+            size += count;
+        } else {
+            uint16_t count = (control & 0x7F) + 3;
+            uint32_t distance;
+            in = varint_read(in, end, &distance);
+            if(!in || distance == 0 || distance > size) return HTTP_INVALID_BRIDGE_RESPONSE;
+            if(count > capacity - size) return HTTP_BUFFER_OVERFLOW;
+            // Byte by byte: the copy may overlap what it is producing.
+            for(uint16_t i = 0; i < count; ++i, ++size) {
+                out[size] = out[size - distance];
+            }
+        }
+    }
+    *size_out = size;
+    return HTTP_OK;
+}
+
+static DictionaryResult packed_write_int(DictionaryIterator* iter, uint32_t key, bool is_signed, uint8_t width, uint32_t value) {
+    int32_t signed_value = is_signed ? unzigzag(value) : 0;
+    switch(width) {
+    case 1: return is_signed ? dict_write_int8(iter, key, signed_value) : dict_write_uint8(iter, key, value);
+    case 2: return is_signed ? dict_write_int16(iter, key, signed_value) : dict_write_uint16(iter, key, value);
+    case 4: return is_signed ? dict_write_int32(iter, key, signed_value) : dict_write_uint32(iter, key, value);
+    }
+    return DICT_INVALID_ARGS;
+}
+
+// Copies `received` into `unpacked` with its packed values turned back into tuples.
+static HTTPResult packed_decode(DictionaryIterator* received, Tuple* packed, Tuple* compressed, DictionaryIterator* unpacked) {
+    dict_write_begin(unpacked, unpacked_buffer, sizeof(unpacked_buffer));
+    Tuple* tuple = dict_read_first(received);
+    while(tuple) {
+        if(tuple->key != HTTP_PACKED_KEY && tuple->key != HTTP_COMPRESSED_KEY && dict_write_tuple(unpacked, tuple) != DICT_OK) {
+            return HTTP_BUFFER_OVERFLOW;
+        }
+        tuple = dict_read_next(received);
+    }
+    const uint8_t* in = packed ? packed->value->data : NULL;
+    const uint8_t* end = packed ? in + packed->length : NULL;
+    if(compressed) {
+        uint16_t size;
+        HTTPResult http_result = lz_decode(compressed->value->data, compressed->length, packed_scratch, sizeof(packed_scratch), &size);
+        if(http_result != HTTP_OK) return http_result;
+        in = packed_scratch;
+        end = packed_scratch + size;
+    }
+    uint32_t key = 0;
+    while(in && in < end) {
+        uint32_t delta, tag;
+        in = varint_read(in, end, &delta);
+        if(in) in = varint_read(in, end, &tag);
+        if(!in) return HTTP_INVALID_BRIDGE_RESPONSE;
+        key += unzigzag(delta);
+        uint32_t length = tag >> 2;
+        DictionaryResult dict_result;
+        switch(tag & 3) {
+        case TUPLE_INT:
+        case TUPLE_UINT: {
+            uint32_t value;
+            in = varint_read(in, end, &value);
+            if(!in) return HTTP_INVALID_BRIDGE_RESPONSE;
+            dict_result = packed_write_int(unpacked, key, (tag & 3) == TUPLE_INT, length, value);
+            break;
+        }
+        case TUPLE_CSTRING:
+            if(length == 0 || length > (uint32_t)(end - in) || in[length - 1] != '\0') return HTTP_INVALID_BRIDGE_RESPONSE;
+            dict_result = dict_write_cstring(unpacked, key, (const char*)in);
+            in += length;
+            break;
+        default:
+            if(length > (uint32_t)(end - in)) return HTTP_INVALID_BRIDGE_RESPONSE;
+            dict_result = dict_write_data(unpacked, key, in, length);
+            in += length;
+            break;
+        }
+        if(dict_result == DICT_INVALID_ARGS) return HTTP_INVALID_BRIDGE_RESPONSE;
+        if(dict_result != DICT_OK) return HTTP_BUFFER_OVERFLOW;
+    }
+    dict_read_begin_from_buffer(unpacked, unpacked_buffer, dict_write_end(unpacked));
+    return HTTP_OK;
+}
+#endif
+
+// The library's own housekeeping never gets in the way of the app.
+static HTTPPriority request_priority(int32_t request_id) {
+    if(request_id == TIME_SYNC_REQUEST_ID) {
+        return HTTP_PRIORITY_BACKGROUND;
+    }
+#ifdef HTTP_COOKIE_WRITE_BACK
+    if(write_back_part(request_id) >= 0) {
+        return HTTP_PRIORITY_BACKGROUND;
+    }
+#endif
+    return current_priority;
+}
+
+// Batches may contain cookie operations, so they are kept in order with them.
+static bool request_is_cookie(uint8_t type) {
+    return type == REQUEST_COOKIE_SET || type == REQUEST_COOKIE_GET || type == REQUEST_COOKIE_DELETE || type == REQUEST_COOKIE_FSYNC
+           || type == REQUEST_BATCH;
+}
+
+// Outbox access. Everything we send goes through here: if nothing is waiting and the
+// AppMessage outbox is free we write straight into it, otherwise the message is built
+// in a free queue slot and sent when queue_drain picks it.
+static HTTPResult outbox_begin(RequestType type, int32_t request_id, DictionaryIterator **iter_out) {
+    if(outbox_state != OUTBOX_IDLE) {
+        stats_busy(type, request_id);
+        return HTTP_BUSY;
+    }
+    outbox_type = type;
+    outbox_request_id = request_id;
+    outbox_priority = request_priority(request_id);
+#ifdef HTTP_BATCH
+    if(batch_active) {
+        // Each part takes an in-flight slot, and once there are two the batch takes one
+        // more until the phone has it.
+        uint8_t slots = batch_count + 1 + (batch_count > 0);
+        if(batch_count == HTTP_BATCH_MAX_PARTS || slots > requests_free()) {
+            stats_busy(type, request_id);
+            return HTTP_BUSY;
+        }
+        dict_write_begin(&batch_part_iter, batch_part, sizeof(batch_part));
+        *iter_out = &batch_part_iter;
+        outbox_state = OUTBOX_BATCHED;
+        outbox_iter = &batch_part_iter;
+        return HTTP_OK;
+    }
+#endif
+    queue_drain();
+    if(queue_count == 0 && requests_below_limit(outbox_priority)) {
+        AppMessageResult app_result = app_message_out_get(iter_out);
+        if(app_result == APP_MSG_OK) {
+            outbox_state = OUTBOX_DIRECT;
+            outbox_iter = *iter_out;
+            return HTTP_OK;
+        }
+        if(app_result != APP_MSG_BUSY) {
+            return (HTTPResult)app_result;
+        }
+    }
+    if(queue_count >= HTTP_QUEUE_SIZE) {
+        ++queue_overflows;
+        stats_busy(type, request_id);
+        return HTTP_BUSY;
+    }
+    QueueSlot* slot = queue;
+    while(slot->used) ++slot;
+    DictionaryResult dict_result = dict_write_begin(&queue_iter, slot->buffer, sizeof(slot->buffer));
+    if(dict_result != DICT_OK) {
+        return dict_result << 12;
+    }
+    slot->type = type;
+    slot->priority = outbox_priority;
+    slot->request_id = request_id;
+    slot->app_id = our_app_id;
+#ifdef HTTP_STATS
+    slot->queued_at = http_clock();
+#endif
+    queue_building = slot;
+    *iter_out = &queue_iter;
+    outbox_state = OUTBOX_QUEUED;
+    outbox_iter = &queue_iter;
+    return HTTP_OK;
+}
+
+static HTTPResult outbox_commit() {
+    OutboxState state = outbox_state;
+    outbox_state = OUTBOX_IDLE;
+    if(state == OUTBOX_QUEUED) {
+        queue_building->used = true;
+        queue_building->passed = 0;
+        queue_building->attempts = 0;
+        queue_building->sequence = queue_sequence++;
+        queue_building->size = dict_write_end(&queue_iter);
+        ++queue_count;
+        stats_queued(queue_building->type, queue_building->request_id);
+        queue_drain();
+        return HTTP_OK;
+    }
+#ifdef HTTP_BATCH
+    if(state == OUTBOX_BATCHED) {
+        uint16_t size = dict_write_end(&batch_part_iter);
+        DictionaryResult dict_result = dict_write_data(&batch_iter, HTTP_BATCH_PART_KEY + batch_count, batch_part, size);
+        if(dict_result != DICT_OK) {
+            if(outbox_type == REQUEST_HTTP) {
+                stream_cancel(outbox_request_id);
+            }
+            return dict_result << 12;
+        }
+        batch_parts[batch_count++] = (BatchPart){
+            .type = outbox_type,
+            .request_id = outbox_request_id,
+            .app_id = our_app_id,
+        };
+        return HTTP_OK;
+    }
+#endif
+    AppMessageResult result = app_message_out_send();
+    app_message_out_release(); // We don't care if it's already released.
+    if(state == OUTBOX_DIRECT && result == APP_MSG_OK) {
+        request_start(outbox_type, outbox_priority, outbox_request_id);
+        stats_sent(sending_request);
+    } else if(state == OUTBOX_DIRECT && outbox_type == REQUEST_HTTP) {
+        stream_cancel(outbox_request_id);
+    }
+    return (HTTPResult)result;
+}
+
+static void outbox_abort() {
+    if(outbox_state == OUTBOX_DIRECT) {
+        app_message_out_release();
+    }
+    if(outbox_state != OUTBOX_IDLE && outbox_type == REQUEST_HTTP) {
+        stream_cancel(outbox_request_id);
+    }
+    outbox_state = OUTBOX_IDLE;
+}
+
+// Picks the queued message to send next: the highest class after aging, oldest first
+// within a class. Cookie operations are never reordered among themselves, so a get
+// can't overtake the set before it. Classes at their in-flight limit wait, as do
+// retries that are backing off.
+static QueueSlot* queue_next() {
+    QueueSlot* best = NULL;
+    int best_rank = 0;
+    uint32_t now = http_clock();
+    for(int i = 0; i < HTTP_QUEUE_SIZE; ++i) {
+        QueueSlot* slot = &queue[i];
+        if(!slot->used || !requests_below_limit(slot->priority)) continue;
+        if(slot->attempts && (link_down || now < slot->not_before)) continue;
+        bool blocked = false;
+        for(int j = 0; j < HTTP_QUEUE_SIZE && request_is_cookie(slot->type); ++j) {
+            if(queue[j].used && request_is_cookie(queue[j].type) && queue[j].sequence < slot->sequence) {
+                blocked = true;
+            }
+        }
+        if(blocked) continue;
+        int aged = slot->passed / HTTP_PRIORITY_AGING;
+        int rank = aged >= slot->priority ? 0 : slot->priority - aged;
+        if(!best || rank < best_rank || (rank == best_rank && slot->sequence < best->sequence)) {
+            best = slot;
+            best_rank = rank;
+        }
+    }
+    return best;
+}
+
+// Ages every message that `slot` is overtaking.
+static void queue_pass(QueueSlot* slot) {
+    for(int i = 0; i < HTTP_QUEUE_SIZE; ++i) {
+        if(queue[i].used && queue[i].sequence < slot->sequence && queue[i].passed < UINT8_MAX) {
+            ++queue[i].passed;
+        }
+    }
+}
+
+// Sends queued messages until one is in flight or the outbox refuses us.
+static void queue_drain() {
+    while(queue_count > 0 && outbox_state == OUTBOX_IDLE) {
+        QueueSlot* slot = queue_next();
+        if(!slot) return;
+        DictionaryIterator *iter;
+        if(app_message_out_get(&iter) != APP_MSG_OK) return;
+        slot->used = false;
+        --queue_count;
+        queue_pass(slot);
+
+        DictionaryResult dict_result = dict_write_serialized(iter, slot->buffer, slot->size);
+        AppMessageResult result = dict_result == DICT_OK ? app_message_out_send() : dict_result << 12;
+        app_message_out_release();
+        if(result == APP_MSG_OK) {
+            request_start(slot->type, slot->priority, slot->request_id);
+            if(sending_request) {
+                sending_request->attempts = slot->attempts;
+                sending_request->app_id = slot->app_id;
+#ifdef HTTP_STATS
+                sending_request->begun_at = slot->queued_at;
+#endif
+            }
+            stats_sent(sending_request);
+            return;
+        }
+        report_failure(slot->app_id, slot->type, slot->request_id, 1000 + result);
+    }
+}
+
+HTTPResult http_out_get(const char* url, int32_t cookie, DictionaryIterator **iter_out) {
+    HTTPResult http_result = outbox_begin(REQUEST_HTTP, cookie, iter_out);
+    if(http_result != HTTP_OK) {
+        return http_result;
+    }
+    DictionaryResult dict_result = dict_write_cstring(*iter_out, HTTP_URL_KEY, url);
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_int32(*iter_out, HTTP_COOKIE_KEY, cookie);
+    }
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_int32(*iter_out, HTTP_APP_ID_KEY, our_app_id);
+    }
+    if(dict_result != DICT_OK) {
+        outbox_abort();
+        return dict_result << 12;
+    }
+    return HTTP_OK;
+}
+
+// Prepared requests are serialized once, into the caller's buffer, and can then be
+// sent any number of times. Each send copies the buffer wherever an ordinary request
+// would have been built, so the caller may reuse it at once.
+HTTPResult http_out_prepare(DictionaryIterator* iter, uint8_t* buffer, uint16_t size, const char* url, int32_t request_id) {
+    DictionaryResult dict_result = dict_write_begin(iter, buffer, size);
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_cstring(iter, HTTP_URL_KEY, url);
+    }
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_int32(iter, HTTP_COOKIE_KEY, request_id);
+    }
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_int32(iter, HTTP_APP_ID_KEY, our_app_id);
+    }
+    if(dict_result != DICT_OK) {
+        return dict_result << 12;
+    }
+    return HTTP_OK;
+}
+
+HTTPResult http_out_send_prepared(const uint8_t* buffer, uint16_t size) {
+    if(!buffer || size < 1) return HTTP_INVALID_ARGS;
+    DictionaryIterator prepared;
+    dict_read_begin_from_buffer(&prepared, buffer, size);
+    Tuple* cookie_tuple = dict_find(&prepared, HTTP_COOKIE_KEY);
+    Tuple* app_id_tuple = dict_find(&prepared, HTTP_APP_ID_KEY);
+    // Answers are routed by the app id inside the message, so it has to be the current one.
+    if(!dict_find(&prepared, HTTP_URL_KEY) || !cookie_tuple || !app_id_tuple || app_id_tuple->value->int32 != our_app_id) {
+        return HTTP_INVALID_ARGS;
+    }
+    DictionaryIterator *iter;
+    HTTPResult http_result = outbox_begin(REQUEST_HTTP, cookie_tuple->value->int32, &iter);
+    if(http_result != HTTP_OK) {
+        return http_result;
+    }
+    DictionaryResult dict_result = dict_write_serialized(iter, buffer, size);
+    if(dict_result != DICT_OK) {
+        outbox_abort();
+        return dict_result << 12;
+    }
+    return http_out_send();
+}
+
+// Request fingerprints
+#if defined(HTTP_SHARE_REQUESTS) || defined(HTTP_CONDITIONAL_REQUESTS)
+// FNV-1a over the request being built, leaving out the cookie, which identical
+// requests from different callers don't share, and the validator. The app id is
+// hashed, so requests are only ever identical to ones from the same app. If `copy` is
+// given, as much of the hashed tuples as fits in `capacity` bytes is copied there.
+static uint32_t request_hash(DictionaryIterator* iter, uint8_t* copy, uint16_t capacity, uint16_t* size_out) {
+    uint32_t hash = 2166136261u;
+    uint16_t size = 0;
+    DictionaryIterator read;
+    Tuple* tuple = dict_read_begin_from_buffer(&read, (uint8_t*)iter->dictionary, (uint8_t*)iter->cursor - (uint8_t*)iter->dictionary);
+    while(tuple) {
+        if(tuple->key != HTTP_COOKIE_KEY && tuple->key != HTTP_VALIDATOR_KEY) {
+            // Key, type and length sit directly ahead of the value.
+            const uint8_t* bytes = (const uint8_t*)tuple;
+            uint16_t length = (tuple->value->data - bytes) + tuple->length;
+            for(uint16_t i = 0; i < length; ++i) {
+                hash = (hash ^ bytes[i]) * 16777619u;
+            }
+            if(copy && size + length <= capacity) {
+                memcpy(copy + size, bytes, length);
+            }
+            size += length;
+        }
+        tuple = dict_read_next(&read);
+    }
+    *size_out = size;
+    return hash;
+}
+#endif
+
+// Conditional requests
+#ifdef HTTP_CONDITIONAL_REQUESTS
+static int validator_request_find(const ValidatorRequest* requests, uint8_t count, int32_t app_id, int32_t request_id) {
+    for(int i = 0; i < count; ++i) {
+        if(requests[i].app_id == app_id && requests[i].request_id == request_id) return i;
+    }
+    return -1;
+}
+
+// Adds a request to a list kept oldest first, dropping the oldest if it is full.
+static void validator_request_add(ValidatorRequest* requests, uint8_t* count, uint8_t capacity, int32_t app_id, int32_t request_id) {
+    if(validator_request_find(requests, *count, app_id, request_id) >= 0) return;
+    if(*count == capacity) {
+        memmove(requests, requests + 1, --*count * sizeof(ValidatorRequest));
+    }
+    requests[(*count)++] = (ValidatorRequest){
+        .app_id = app_id,
+        .request_id = request_id,
+    };
+}
+
+static void validator_request_remove(ValidatorRequest* requests, uint8_t* count, int index) {
+    memmove(requests + index, requests + index + 1, (--*count - index) * sizeof(ValidatorRequest));
+}
+
+static ValidatorEntry* validator_find(uint32_t hash) {
+    for(int i = 0; i < HTTP_VALIDATOR_ENTRIES; ++i) {
+        if(validators[i].used && validators[i].hash == hash) return &validators[i];
+    }
+    return NULL;
+}
+
+// Whether the caller of a request would be sent the validator with it.
+static bool validator_owned(uint32_t hash, int32_t app_id, int32_t request_id) {
+    ValidatorEntry* entry = validator_find(hash);
+    return entry && entry->valid && validator_request_find(entry->owners, entry->owner_count, app_id, request_id) >= 0;
+}
+
+// Adds the validator we have for this request if its caller was given the response
+// the validator describes, and notes that its response may bring a new one. The
+// least recently used entry makes way for new requests. Only requests that actually
+// go out are noted; ones sharing another's response aren't.
+static HTTPResult validator_attach(bool* attached) {
+    uint16_t size;
+    uint32_t hash = request_hash(outbox_iter, NULL, 0, &size);
+    ValidatorEntry* entry = validator_find(hash);
+    if(!entry) {
+        entry = &validators[0];
+        for(int i = 0; i < HTTP_VALIDATOR_ENTRIES && entry->used; ++i) {
+            if(!validators[i].used || validators[i].last_used < entry->last_used) {
+                entry = &validators[i];
+            }
+        }
+        *entry = (ValidatorEntry){
+            .used = true,
+            .hash = hash,
+        };
+    }
+    entry->last_used = ++validator_clock;
+    *attached = entry->valid && validator_request_find(entry->owners, entry->owner_count, our_app_id, outbox_request_id) >= 0;
+    if(*attached) {
+        DictionaryResult dict_result = dict_write_uint32(outbox_iter, HTTP_VALIDATOR_KEY, entry->validator);
+        if(dict_result != DICT_OK) {
+            return dict_result << 12;
+        }
+    }
+    validator_request_add(entry->pending, &entry->pending_count, HTTP_VALIDATOR_PENDING, our_app_id, outbox_request_id);
+    return HTTP_OK;
+}
+
+// Notes who now has which response after a request and those sharing it succeed.
+static void validator_answered(int32_t app_id, int32_t request_id, uint16_t status, const Tuple* validator,
+                               const int32_t* subscribers, uint8_t count) {
+    for(int i = 0; i < HTTP_VALIDATOR_ENTRIES; ++i) {
+        ValidatorEntry* entry = &validators[i];
+        if(!entry->used) continue;
+        int index = validator_request_find(entry->pending, entry->pending_count, app_id, request_id);
+        if(index < 0) continue;
+        validator_request_remove(entry->pending, &entry->pending_count, index);
+        // Not modified: the callers still have the response they had.
+        if(status == 304) return;
+        if(!validator) {
+            // A response we can't validate; these callers no longer have the old one.
+            for(int j = 0; j <= count; ++j) {
+                int owner = validator_request_find(entry->owners, entry->owner_count, app_id, j ? subscribers[j - 1] : request_id);
+                if(owner >= 0) {
+                    validator_request_remove(entry->owners, &entry->owner_count, owner);
+                }
+            }
+            return;
+        }
+        if(!entry->valid || entry->validator != validator->value->uint32) {
+            entry->owner_count = 0;
+        }
+        entry->valid = true;
+        entry->validator = validator->value->uint32;
+        for(int j = 0; j <= count; ++j) {
+            validator_request_add(entry->owners, &entry->owner_count, HTTP_VALIDATOR_OWNERS, app_id, j ? subscribers[j - 1] : request_id);
+        }
+        return;
+    }
+}
+#endif
+
+void http_validators_clear() {
+#ifdef HTTP_CONDITIONAL_REQUESTS
+    for(int i = 0; i < HTTP_VALIDATOR_ENTRIES; ++i) {
+        validators[i].used = false;
+    }
+#endif
+}
+
+HTTPResult http_out_send() {
+#ifdef HTTP_SHARE_REQUESTS
+    SharedRequest* shared = NULL;
+    if(outbox_state != OUTBOX_IDLE && outbox_type == REQUEST_HTTP && shared_attach(&shared)) {
+        return HTTP_OK;
+    }
+#endif
+#ifdef HTTP_CONDITIONAL_REQUESTS
+    if(outbox_state != OUTBOX_IDLE && outbox_type == REQUEST_HTTP) {
+        bool conditional;
+        HTTPResult http_result = validator_attach(&conditional);
+        if(http_result != HTTP_OK) {
+            outbox_abort();
+            return http_result;
+        }
+#ifdef HTTP_SHARE_REQUESTS
+        if(shared) {
+            shared->conditional = conditional;
+        }
+#endif
+    }
+#endif
+#ifdef HTTP_PACKED
+    if(outbox_state != OUTBOX_IDLE && outbox_type == REQUEST_HTTP) {
+        packed_encode();
+    }
+#endif
+    return outbox_commit();
+}
+
+// Streamed responses
+static ResponseStream* stream_find(int32_t request_id) {
+    for(int i = 0; i < HTTP_MAX_STREAMS; ++i) {
+        if(streams[i].active && streams[i].request_id == request_id) {
+            return &streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void stream_cancel(int32_t request_id) {
+    ResponseStream* stream = stream_find(request_id);
+    if(stream) {
+        stream->active = false;
+        stream->cancelled = true;
+    }
+}
+
+static ResponseStream* stream_find_cancelled(int32_t request_id) {
+    for(int i = 0; i < HTTP_MAX_STREAMS; ++i) {
+        if(!streams[i].active && streams[i].cancelled && streams[i].request_id == request_id) {
+            return &streams[i];
+        }
+    }
+    return NULL;
+}
+
+HTTPResult http_out_stream(uint8_t* buffer, uint16_t size) {
+    if(outbox_state == OUTBOX_IDLE || outbox_type != REQUEST_HTTP) {
+        return HTTP_INVALID_ARGS;
+    }
+    ResponseStream* stream = NULL;
+    for(int i = 0; i < HTTP_MAX_STREAMS && !stream; ++i) {
+        if(!streams[i].active) {
+            stream = &streams[i];
+        }
+    }
+    if(!stream) {
+        return HTTP_BUSY;
+    }
+    *stream = (ResponseStream){
+        .request_id = outbox_request_id,
+        .buffer = buffer,
+    };
+    if(buffer) {
+        DictionaryResult dict_result = dict_write_begin(&stream->iter, buffer, size);
+        if(dict_result != DICT_OK) {
+            return dict_result << 12;
+        }
+    }
+    DictionaryResult dict_result = dict_write_uint8(outbox_iter, HTTP_STREAM_KEY, 1);
+    if(dict_result != DICT_OK) {
+        return dict_result << 12;
+    }
+    stream->active = true;
+    return HTTP_OK;
+}
+
+// Shared requests
+#ifdef HTTP_SHARE_REQUESTS
+// Whether the request is still queued or awaiting its response.
+static bool shared_pending(int32_t request_id) {
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(in_flight[i].type == REQUEST_HTTP && in_flight[i].request_id == request_id) return true;
+    }
+    for(int i = 0; i < HTTP_QUEUE_SIZE; ++i) {
+        QueueSlot* slot = &queue[i];
+        if(slot->used && slot->type == REQUEST_HTTP && slot->request_id == request_id) return true;
+    }
+#ifdef HTTP_OFFLINE_JOURNAL
+    for(uint16_t offset = 0; offset < journal_used;) {
+        JournalEntry entry;
+        memcpy(&entry, &journal[offset], sizeof(entry));
+        if(entry.type == REQUEST_HTTP && entry.request_id == request_id) return true;
+        offset += sizeof(entry) + entry.size;
+    }
+#endif
+    return false;
+}
+
+// Called with an HTTP request built but not yet sent. If an identical one is pending
+// the new one is dropped and its caller subscribed to the pending one's response;
+// otherwise the new one is remembered, in *entry_out, so later copies can do the same.
+static bool shared_attach(SharedRequest** entry_out) {
+    // Streamed responses go to a single caller.
+    if(stream_find(outbox_request_id)) return false;
+    uint8_t request[HTTP_SHARED_REQUEST_SIZE];
+    uint16_t size;
+    uint32_t hash = request_hash(outbox_iter, request, sizeof(request), &size);
+    if(size > sizeof(request)) return false;
+    SharedRequest* free_entry = NULL;
+    for(int i = 0; i < HTTP_MAX_SHARED_REQUESTS; ++i) {
+        SharedRequest* entry = &shared_requests[i];
+        if(entry->active && !shared_pending(entry->request_id)) {
+            // The response was never going to come; forget it.
+            entry->active = false;
+        }
+        if(!entry->active) {
+            if(!free_entry) free_entry = entry;
+            continue;
+        }
+        if(entry->hash != hash || entry->size != size || memcmp(entry->request, request, size) != 0 ||
+           stream_find(entry->request_id)) continue;
+#ifdef HTTP_CONDITIONAL_REQUESTS
+        // A bare 304 would tell a caller who never had the response to keep using it.
+        if(entry->conditional && !validator_owned(hash, our_app_id, outbox_request_id)) continue;
+#endif
+        if(entry->subscriber_count == HTTP_MAX_SUBSCRIBERS) return false;
+        entry->subscribers[entry->subscriber_count++] = outbox_request_id;
+        outbox_abort();
+        return true;
+    }
+    if(free_entry) {
+        *free_entry = (SharedRequest){
+            .active = true,
+            .size = size,
+            .hash = hash,
+            .request_id = outbox_request_id,
+        };
+        memcpy(free_entry->request, request, size);
+        *entry_out = free_entry;
+    }
+    return false;
+}
+
+// Forgets a request once it has been answered, returning who else is waiting for the answer.
+static uint8_t shared_take(int32_t request_id, int32_t* subscribers) {
+    for(int i = 0; i < HTTP_MAX_SHARED_REQUESTS; ++i) {
+        SharedRequest* entry = &shared_requests[i];
+        if(!entry->active || entry->request_id != request_id) continue;
+        entry->active = false;
+        memcpy(subscribers, entry->subscribers, entry->subscriber_count * sizeof(int32_t));
+        return entry->subscriber_count;
+    }
+    return 0;
+}
+#else
+static uint8_t shared_take(int32_t request_id, int32_t* subscribers) {
+    (void)request_id;
+    (void)subscribers;
+    return 0;
+}
+#endif
+
+void http_set_priority(HTTPPriority priority) {
+    if(priority <= HTTP_PRIORITY_BACKGROUND) {
+        current_priority = priority;
+    }
+}
+
+HTTPResult http_batch_begin() {
+#ifdef HTTP_BATCH
+    if(batch_active || outbox_state != OUTBOX_IDLE) return HTTP_BUSY;
+    dict_write_begin(&batch_iter, batch_buffer, sizeof(batch_buffer));
+    // The count goes first; we fill it in once we know it.
+    batch_count_tuple = batch_iter.cursor;
+    DictionaryResult dict_result = dict_write_uint8(&batch_iter, HTTP_BATCH_KEY, 0);
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_int32(&batch_iter, HTTP_APP_ID_KEY, our_app_id);
+    }
+    if(dict_result != DICT_OK) {
+        return dict_result << 12;
+    }
+    batch_count = 0;
+    batch_active = true;
+#endif
+    return HTTP_OK;
+}
+
+HTTPResult http_batch_end() {
+#ifdef HTTP_BATCH
+    if(!batch_active || outbox_state != OUTBOX_IDLE) return HTTP_INVALID_ARGS;
+    batch_active = false;
+    if(batch_count == 0) return HTTP_OK;
+    batch_count_tuple->value->uint8 = batch_count;
+    const uint8_t* message = batch_buffer;
+    uint16_t size = dict_write_end(&batch_iter);
+    // A batch of one goes out as an ordinary message.
+    RequestType type = REQUEST_BATCH;
+    int32_t request_id = ++batch_id ? batch_id : ++batch_id;
+    if(batch_count == 1) {
+        type = batch_parts[0].type;
+        request_id = batch_parts[0].request_id;
+        DictionaryIterator source;
+        dict_read_begin_from_buffer(&source, batch_buffer, size);
+        Tuple* part = dict_find(&source, HTTP_BATCH_PART_KEY);
+        message = part->value->data;
+        size = part->length;
+    }
+    DictionaryIterator *iter;
+    HTTPResult http_result = outbox_begin(type, request_id, &iter);
+    if(http_result == HTTP_OK) {
+        DictionaryResult dict_result = dict_write_serialized(iter, message, size);
+        if(dict_result != DICT_OK) {
+            outbox_abort();
+            http_result = dict_result << 12;
+        }
+    }
+    if(http_result == HTTP_OK) {
+        http_result = outbox_commit();
+    }
+    if(http_result != HTTP_OK) {
+        // Each part was accepted on its own, so each is told it didn't go.
+        for(int i = 0; i < batch_count; ++i) {
+            report_failure(batch_parts[i].app_id, batch_parts[i].type, batch_parts[i].request_id, 1000 + http_result);
+        }
+        return http_result;
+    }
+    if(type == REQUEST_BATCH) {
+        // The batch itself is only tracked until the phone takes it; each part waits for its own answer.
+        for(int i = 0; i < batch_count; ++i) {
+            InFlightRequest* request = request_track(batch_parts[i].type, outbox_priority, batch_parts[i].request_id);
+            if(request) {
+                request->batch = batch_id;
+                request->app_id = batch_parts[i].app_id;
+                stats_sent(request);
+            }
+        }
+    }
+#endif
+    return HTTP_OK;
+}
+
+uint8_t http_queue_depth() {
+    return queue_count;
+}
+
+uint32_t http_queue_overflows() {
+    return queue_overflows;
+}
+
+bool http_register_callbacks(HTTPCallbacks callbacks, void* context) {
+    default_route.callbacks = callbacks;
+    default_route.context = context;
+    if(callbacks_registered) {
+        if(app_message_deregister_callbacks(&app_callbacks) == APP_MSG_OK)
+            callbacks_registered = false;
+    }
+    if(!callbacks_registered) {
+        app_callbacks = (AppMessageCallbacksNode){
+            .callbacks = {
+                .out_sent = app_sent,
+                .out_failed = app_send_failed,
+                .in_received = app_received,
+                .in_dropped = app_dropped,
+            },
+            .context = context
+        };
+        if(app_message_register_callbacks(&app_callbacks) == APP_MSG_OK)
+            callbacks_registered = true;
+    }
+    return callbacks_registered;
+}
+
+// Retries
+static bool retry_allowed(AppMessageResult reason) {
+#ifdef HTTP_RETRY_TIMEOUTS
+    if(reason == APP_MSG_SEND_TIMEOUT) return true;
+#endif
+    return reason == APP_MSG_BUSY || reason == APP_MSG_NOT_CONNECTED;
+}
+
+// Seconds to wait before the given retry: exponential, with jitter so that several
+// failed messages don't all come back at once.
+static uint32_t retry_delay(uint8_t attempt) {
+    uint32_t delay = HTTP_RETRY_DELAY << attempt;
+    retry_seed = retry_seed * 1103515245 + 12345 + http_clock();
+    return delay / 2 + (retry_seed >> 16) % (delay - delay / 2 + 1);
+}
+
+// Puts a message the phone failed to take back in the queue. Returns false if it
+// has used up its retries or there's nowhere to keep it.
+static bool retry_queue(const InFlightRequest* request, DictionaryIterator* message, AppMessageResult reason) {
+    if(HTTP_MAX_RETRIES == 0 || !retry_allowed(reason) || request->attempts + 1 > HTTP_MAX_RETRIES) return false;
+    // Leave alone any slot the app is part way through building.
+    bool building = outbox_state == OUTBOX_QUEUED;
+    if(queue_count + building >= HTTP_QUEUE_SIZE) return false;
+    uint16_t size = dict_serialized_size(message);
+    if(size > HTTP_QUEUE_BUFFER_SIZE) return false;
+    QueueSlot* slot = queue;
+    while(slot->used || (building && slot == queue_building)) ++slot;
+    memcpy(slot->buffer, message->dictionary, size);
+    slot->size = size;
+    slot->used = true;
+    slot->type = request->type;
+    slot->priority = request->priority;
+    slot->request_id = request->request_id;
+    slot->app_id = request->app_id;
+    slot->passed = 0;
+    slot->attempts = request->attempts + 1;
+    slot->sequence = queue_sequence++;
+    slot->not_before = http_clock() + retry_delay(request->attempts);
+#ifdef HTTP_STATS
+    slot->queued_at = request->begun_at;
+#endif
+    ++queue_count;
+    stats_retried(request, HTTP_TRACE_RETRIED);
+    if(reason == APP_MSG_NOT_CONNECTED) {
+        link_down = true;
+    }
+    timer_schedule();
+    return true;
+}
+
+static void retry_next_deadline(uint32_t* deadline) {
+    if(link_down) return;
+    // Retries already due go out with the next queue_drain; no need to wake for them.
+    uint32_t now = http_clock();
+    for(int i = 0; i < HTTP_QUEUE_SIZE; ++i) {
+        if(queue[i].used && queue[i].attempts && queue[i].not_before > now && queue[i].not_before < *deadline) {
+            *deadline = queue[i].not_before;
+        }
+    }
+}
+
+// The phone is back: send anything that was waiting on it straight away.
+static void retry_resume() {
+    link_down = false;
+    uint32_t now = http_clock();
+    for(int i = 0; i < HTTP_QUEUE_SIZE; ++i) {
+        if(queue[i].used && queue[i].attempts) {
+            queue[i].not_before = now;
+        }
+    }
+}
+
+// Offline journal
+#ifdef HTTP_OFFLINE_JOURNAL
+static JournalEntry journal_entry_at(uint16_t offset) {
+    JournalEntry entry;
+    memcpy(&entry, &journal[offset], sizeof(entry));
+    return entry;
+}
+
+static void journal_cut(uint16_t offset, uint16_t length) {
+    memmove(&journal[offset], &journal[offset + length], journal_used - offset - length);
+    journal_used -= length;
+}
+
+// Removes the values `message` sets from the cookie sets already journaled, since
+// they would only be overwritten. Emptied sets are kept so their callbacks still fire.
+static void journal_collapse(int32_t app_id, DictionaryIterator* message) {
+    for(uint16_t offset = 0; offset < journal_used;) {
+        JournalEntry entry = journal_entry_at(offset);
+        uint16_t length = sizeof(entry) + entry.size;
+        if(entry.type != REQUEST_COOKIE_SET || entry.app_id != app_id) {
+            offset += length;
+            continue;
+        }
+        uint8_t buffer[HTTP_QUEUE_BUFFER_SIZE];
+        DictionaryIterator kept;
+        DictionaryIterator read;
+        dict_write_begin(&kept, buffer, sizeof(buffer));
+        Tuple* tuple = dict_read_begin_from_buffer(&read, &journal[offset + sizeof(entry)], entry.size);
+        while(tuple) {
+            bool superseded = (tuple->key < 0xF000 || tuple->key > 0xFFFF) && dict_find(message, tuple->key);
+            if(!superseded) {
+                dict_write_tuple(&kept, tuple);
+            }
+            tuple = dict_read_next(&read);
+        }
+        uint16_t size = dict_write_end(&kept);
+        if(size < entry.size) {
+            memcpy(&journal[offset + sizeof(entry)], buffer, size);
+            journal_cut(offset + sizeof(entry) + size, entry.size - size);
+            entry.size = size;
+            memcpy(&journal[offset], &entry, sizeof(entry));
+        }
+        offset += sizeof(entry) + entry.size;
+    }
+}
+
+// Keeps a message the phone wasn't there to take. The oldest entries are given up
+// on, and reported as failed, to make room.
+static bool journal_append(const InFlightRequest* request, DictionaryIterator* message) {
+    if(request->type != REQUEST_HTTP && request->type != REQUEST_COOKIE_SET) return false;
+    JournalEntry entry = {
+        .type = request->type,
+        .priority = request->priority,
+        .size = dict_serialized_size(message),
+        .request_id = request->request_id,
+        .app_id = request->app_id,
+    };
+    // It has to fit back in a queue slot to be replayed.
+    if(entry.size > HTTP_QUEUE_BUFFER_SIZE || sizeof(entry) + entry.size > HTTP_JOURNAL_SIZE) return false;
+    if(entry.type == REQUEST_COOKIE_SET) {
+        journal_collapse(entry.app_id, message);
+    }
+    while(journal_used + sizeof(entry) + entry.size > HTTP_JOURNAL_SIZE) {
+        JournalEntry oldest = journal_entry_at(0);
+        journal_cut(0, sizeof(oldest) + oldest.size);
+        report_failure(oldest.app_id, oldest.type, oldest.request_id, 1000 + HTTP_NOT_CONNECTED);
+    }
+    memcpy(&journal[journal_used], &entry, sizeof(entry));
+    memcpy(&journal[journal_used + sizeof(entry)], message->dictionary, entry.size);
+    journal_used += sizeof(entry) + entry.size;
+    stats_retried(request, HTTP_TRACE_JOURNALED);
+    return true;
+}
+
+// Moves the oldest entry into the queue once the one before it has gone, no more
+// than HTTP_JOURNAL_REPLAY_RATE a second, and always leaving a slot for the app.
+static void journal_replay() {
+    if(!journal_replaying) return;
+    if(journal_used == 0) {
+        journal_replaying = false;
+        return;
+    }
+    if(journal_slot && journal_slot->used && journal_slot->sequence == journal_slot_sequence) return;
+    uint32_t now = http_clock();
+    if(now != journal_second) {
+        journal_second = now;
+        journal_sent = 0;
+    }
+    if(journal_sent >= HTTP_JOURNAL_REPLAY_RATE) {
+        timer_schedule();
+        return;
+    }
+    bool building = outbox_state == OUTBOX_QUEUED;
+    if(queue_count + building + 1 >= HTTP_QUEUE_SIZE) return;
+    QueueSlot* slot = queue;
+    while(slot->used || (building && slot == queue_building)) ++slot;
+    JournalEntry entry = journal_entry_at(0);
+    memcpy(slot->buffer, &journal[sizeof(entry)], entry.size);
+    slot->size = entry.size;
+    slot->used = true;
+    slot->type = entry.type;
+    slot->priority = entry.priority;
+    slot->request_id = entry.request_id;
+    slot->app_id = entry.app_id;
+#ifdef HTTP_STATS
+    slot->queued_at = now;
+#endif
+    slot->passed = 0;
+    slot->attempts = 0;
+    slot->sequence = queue_sequence++;
+    ++queue_count;
+    journal_cut(0, sizeof(entry) + entry.size);
+    journal_slot = slot;
+    journal_slot_sequence = slot->sequence;
+    ++journal_sent;
+    queue_drain();
+}
+
+static void journal_next_deadline(uint32_t* deadline) {
+    if(journal_replaying && journal_used > 0 && journal_sent >= HTTP_JOURNAL_REPLAY_RATE && journal_second + 1 < *deadline) {
+        *deadline = journal_second + 1;
+    }
+}
+#endif
+
+uint16_t http_journal_count() {
+    uint16_t count = 0;
+#ifdef HTTP_OFFLINE_JOURNAL
+    for(uint16_t offset = 0; offset < journal_used; ++count) {
+        offset += sizeof(JournalEntry) + journal_entry_at(offset).size;
+    }
+#endif
+    return count;
+}
+
+bool http_stats_get(HTTPStatsType type, HTTPStats* out) {
+#ifdef HTTP_STATS
+    if(type >= HTTP_STATS_TYPES) return false;
+    *out = stats[type];
+    return true;
+#else
+    (void)type;
+    (void)out;
+    return false;
+#endif
+}
+
+void http_stats_reset() {
+#ifdef HTTP_STATS
+    memset(stats, 0, sizeof(stats));
+    trace_count = 0;
+    trace_next = 0;
+#endif
+}
+
+// Copies up to `max` of the most recent events, oldest first.
+uint8_t http_trace_read(HTTPTraceEvent* events, uint8_t max) {
+#ifdef HTTP_STATS
+    uint8_t count = trace_count < max ? trace_count : max;
+    for(int i = 0; i < count; ++i) {
+        events[i] = trace[(trace_next + HTTP_TRACE_SIZE - count + i) % HTTP_TRACE_SIZE];
+    }
+    return count;
+#else
+    (void)events;
+    (void)max;
+    return 0;
+#endif
+}
+
+// Stores the trace as a cookie, dropping the oldest events until it fits in a message.
+HTTPResult http_trace_save(int32_t request_id, uint32_t key) {
+#ifdef HTTP_STATS
+    HTTPTraceEvent events[HTTP_TRACE_SIZE];
+    uint8_t count = http_trace_read(events, HTTP_TRACE_SIZE);
+    uint8_t skipped = 0;
+    HTTPResult http_result;
+    do {
+        http_result = http_cookie_set_data(request_id, key, (const uint8_t*)&events[skipped], (count - skipped) * sizeof(HTTPTraceEvent));
+    } while(http_result == HTTP_NOT_ENOUGH_STORAGE && ++skipped < count);
+    return http_result;
+#else
+    (void)request_id;
+    (void)key;
+    return HTTP_INVALID_ARGS;
+#endif
+}
+
+#ifdef HTTP_RESYNC
+static const uint8_t resync_types[] = {
+    [HTTP_RESYNC_TIME] = REQUEST_TIME,
+    [HTTP_RESYNC_LOCATION] = REQUEST_LOCATION,
+    [HTTP_RESYNC_COOKIES] = REQUEST_COOKIE_GET,
+    [HTTP_RESYNC_REQUEST] = REQUEST_HTTP,
+};
+
+static bool resync_matches(const ResyncEntry* entry, uint8_t type, int32_t app_id, int32_t request_id) {
+    if(entry->type != type) return false;
+    // There is only one time and one location, whoever asked for them.
+    if(type == REQUEST_TIME || type == REQUEST_LOCATION) return true;
+    return entry->app_id == app_id && entry->request_id == request_id;
+}
+
+static bool resync_stale(const ResyncEntry* entry, uint32_t now) {
+    bool fresh = entry->fresh;
+    uint32_t fresh_at = entry->fresh_at;
+    if(entry->type == REQUEST_TIME) {
+        fresh = time_sync.valid;
+        fresh_at = time_sync.received_at;
+    } else if(entry->type == REQUEST_LOCATION) {
+        fresh = location_sync.valid;
+        fresh_at = location_sync.received_at;
+    }
+    // Anything from before the watch's clock was set back is of unknown age.
+    return !fresh || now < fresh_at || now - fresh_at > entry->max_age;
+}
+
+static bool resync_queued(const ResyncEntry* entry) {
+    for(int i = 0; i < HTTP_QUEUE_SIZE; ++i) {
+        if(queue[i].used && resync_matches(entry, queue[i].type, queue[i].app_id, queue[i].request_id)) return true;
+    }
+    return false;
+}
+
+// Whether someone has already asked for it since the reconnect.
+static bool resync_in_progress(const ResyncEntry* entry) {
+    if(entry->type == REQUEST_TIME && time_sync.refreshing) return true;
+    if(entry->type == REQUEST_LOCATION && location_sync.refreshing) return true;
+    for(int i = 0; i < HTTP_MAX_IN_FLIGHT; ++i) {
+        if(resync_matches(entry, in_flight[i].type, in_flight[i].app_id, in_flight[i].request_id)) return true;
+    }
+    return resync_queued(entry);
+}
+
+static void resync_fresh(RequestType type, int32_t request_id) {
+    uint32_t now = http_clock();
+    for(int i = 0; i < resync_count; ++i) {
+        if(!resync_matches(&resync_entries[i], type, route->app_id, request_id)) continue;
+        resync_entries[i].fresh = true;
+        resync_entries[i].fresh_at = now;
+        resync_entries[i].due = false;
+    }
+}
+
+// Works out what went stale while we were apart. Each request is refreshed once,
+// however many entries want it.
+static void resync_begin() {
+    uint32_t now = http_clock();
+    for(int i = 0; i < resync_count; ++i) {
+        ResyncEntry* entry = &resync_entries[i];
+        entry->due = resync_stale(entry, now);
+        for(int j = 0; j < i && entry->due; ++j) {
+            if(resync_entries[j].due && resync_matches(&resync_entries[j], entry->type, entry->app_id, entry->request_id)) {
+                entry->due = false;
+            }
+        }
+    }
+    resync_run();
+}
+
+static HTTPResult resync_send(const ResyncEntry* entry) {
+    switch(entry->type) {
+    case REQUEST_TIME:
+        return time_sync_refresh();
+    case REQUEST_LOCATION:
+        return location_sync_refresh();
+    default:
+        return entry->handler(entry->request_id, entry->context);
+    }
+}
+
+// Sends the next stale item once the one before it has gone, no more than
+// HTTP_RESYNC_RATE a second, and always leaving a slot for the app.
+static void resync_run() {
+#ifdef HTTP_OFFLINE_JOURNAL
+    // Let anything written while we were apart land before reading it back.
+    if(journal_replaying) return;
+#endif
+    if(link_down || outbox_state != OUTBOX_IDLE || queue_count + 1 >= HTTP_QUEUE_SIZE) return;
+    if(resync_last.type != REQUEST_NONE && resync_queued(&resync_last)) return;
+    uint32_t now = http_clock();
+    if(now != resync_second) {
+        resync_second = now;
+        resync_sent = 0;
+    }
+    for(int i = 0; i < resync_count; ++i) {
+        if(!resync_entries[i].due) continue;
+        if(resync_sent >= HTTP_RESYNC_RATE) {
+            timer_schedule();
+            return;
+        }
+        // The handler may register or unregister entries, so work from a copy.
+        ResyncEntry entry = resync_entries[i];
+        resync_entries[i].due = false;
+        if(resync_in_progress(&entry)) continue;
+        HTTPResult http_result = resync_send(&entry);
+        if(http_result == HTTP_OK) {
+            resync_last = entry;
+            ++resync_sent;
+            return;
+        }
+        if(http_result == HTTP_BUSY) {
+            // Try again once something has been sent.
+            if(i < resync_count && resync_entries[i].handler == entry.handler && resync_entries[i].context == entry.context) {
+                resync_entries[i].due = true;
+            }
+            return;
+        }
+        // Anything else won't get better by asking again; the app still hears about
+        // the failure as usual for requests that got as far as being sent.
+    }
+}
+
+static void resync_next_deadline(uint32_t* deadline) {
+    if(resync_sent < HTTP_RESYNC_RATE || resync_second + 1 >= *deadline) return;
+    for(int i = 0; i < resync_count; ++i) {
+        if(resync_entries[i].due) {
+            *deadline = resync_second + 1;
+            return;
+        }
+    }
+}
+#endif
+
+// Registering the same thing again with the same handler just changes its max age.
+HTTPResult http_resync_register(HTTPResyncType type, int32_t request_id, uint32_t max_age, HTTPResyncHandler handler, void* context) {
+#ifdef HTTP_RESYNC
+    if(type > HTTP_RESYNC_REQUEST) return HTTP_INVALID_ARGS;
+    if(!handler && (type == HTTP_RESYNC_COOKIES || type == HTTP_RESYNC_REQUEST)) return HTTP_INVALID_ARGS;
+    ResyncEntry entry = {
+        .type = resync_types[type],
+        .request_id = request_id,
+        .app_id = our_app_id,
+        .max_age = max_age,
+        .handler = handler,
+        .context = context,
+    };
+    for(int i = 0; i < resync_count; ++i) {
+        ResyncEntry* existing = &resync_entries[i];
+        if(!resync_matches(existing, entry.type, entry.app_id, entry.request_id)) continue;
+        if(existing->app_id == entry.app_id && existing->request_id == request_id &&
+           existing->handler == handler && existing->context == context) {
+            existing->max_age = max_age;
+            return HTTP_OK;
+        }
+        // Another module wants the same thing, so it's exactly as fresh.
+        entry.fresh = existing->fresh;
+        entry.fresh_at = existing->fresh_at;
+    }
+    if(resync_count == HTTP_RESYNC_ENTRIES) return HTTP_NOT_ENOUGH_STORAGE;
+    resync_entries[resync_count++] = entry;
+    return HTTP_OK;
+#else
+    (void)type;
+    (void)request_id;
+    (void)max_age;
+    (void)handler;
+    (void)context;
+    return HTTP_INVALID_ARGS;
+#endif
+}
+
+void http_resync_unregister(HTTPResyncType type, int32_t request_id) {
+#ifdef HTTP_RESYNC
+    if(type > HTTP_RESYNC_REQUEST) return;
+    for(int i = resync_count - 1; i >= 0; --i) {
+        ResyncEntry* entry = &resync_entries[i];
+        if(entry->type == resync_types[type] && entry->app_id == our_app_id && entry->request_id == request_id) {
+            *entry = resync_entries[--resync_count];
+        }
+    }
+#else
+    (void)type;
+    (void)request_id;
+#endif
+}
+
+uint8_t http_resync_pending() {
+    uint8_t count = 0;
+#ifdef HTTP_RESYNC
+    for(int i = 0; i < resync_count; ++i) {
+        if(resync_entries[i].due) ++count;
+    }
+#endif
+    return count;
+}
+
+static void app_sent(DictionaryIterator* sent, void* context) {
+    (void)sent;
+    (void)context;
+    // The request stays in the in-flight table until the bridge answers it.
+    link_down = false;
+    if(sending_request && sending_request->type == REQUEST_BATCH) {
+        sending_request->type = REQUEST_NONE;
+    }
+    sending_request = NULL;
+    location_untracked_sent();
+    queue_drain();
+#ifdef HTTP_OFFLINE_JOURNAL
+    journal_replay();
+#endif
+#ifdef HTTP_RESYNC
+    resync_run();
+#endif
+#ifdef HTTP_COOKIE_WRITE_BACK
+    // Carry on with a flush that ran out of queue space.
+    if(flushing_messages > 0 && staged_count > 0) {
+        http_cookie_flush();
+    }
+#endif
+    // And with a split cookie get or delete.
+    cookie_keys_continue();
+}
+
+static void app_send_failed(DictionaryIterator* failed, AppMessageResult reason, void* context) {
+    (void)context;
+    RequestType type = REQUEST_NONE;
+    int32_t request_id = 0;
+    int32_t app_id = our_app_id;
+    if(sending_request) {
+        InFlightRequest request = *sending_request;
+        sending_request->type = REQUEST_NONE;
+        sending_request = NULL;
+#ifdef HTTP_OFFLINE_JOURNAL
+        if((reason == APP_MSG_NOT_CONNECTED || reason == APP_MSG_APP_NOT_RUNNING) && journal_append(&request, failed)) {
+            // Whatever was being replayed will have to wait for the next reconnect.
+            link_down = true;
+            journal_replaying = false;
+            queue_drain();
+            return;
+        }
+#endif
+        if(retry_queue(&request, failed, reason)) {
+            queue_drain();
+            return;
+        }
+        type = request.type;
+        request_id = request.request_id;
+        app_id = request.app_id;
+    }
+    location_untracked_sent();
+    report_failure(app_id, type, request_id, 1000 + reason);
+    queue_drain();
+}
+
+// The reserved tuples of an inbound message, gathered in a single pass so that
+// classifying a message doesn't mean walking the dictionary once per key. Tuples that
+// aren't of the type and width we read them as are left out, as if they weren't there.
+typedef struct {
+    bool truncated; // A tuple ran past the end of the message; nothing after it was read.
+    Tuple* connect;
+    Tuple* time;
+    Tuple* location;
+    Tuple* app_id;
+    Tuple* url;
+    Tuple* status;
+    Tuple* cookie;
+    Tuple* cookie_store;
+    Tuple* cookie_load;
+    Tuple* cookie_fsync;
+    Tuple* cookie_delete;
+    Tuple* utc_offset;
+    Tuple* is_dst;
+    Tuple* tz_name;
+    Tuple* latitude;
+    Tuple* longitude;
+    Tuple* altitude;
+    Tuple* fragment;
+    Tuple* fragment_count;
+    Tuple* batch;
+    Tuple* validator;
+    Tuple* packed;
+    Tuple* compressed;
+} InboundMessage;
+
+// Whether a tuple claims more bytes than the message it's in has left.
+static bool tuple_overruns(const DictionaryIterator* iter, const Tuple* tuple) {
+    const uint8_t* end = iter->end;
+    return (const uint8_t*)tuple + sizeof(Tuple) > end || tuple->length > end - tuple->value->data;
+}
+
+// Expected shape of a reserved tuple: an integer at least this many bytes wide, or one of these.
+#define INBOUND_ANY 0
+#define INBOUND_CSTRING 0xFE
+#define INBOUND_DATA 0xFF
+
+static bool inbound_valid(const Tuple* tuple, uint8_t shape) {
+    switch(shape) {
+    case INBOUND_ANY:
+        return true;
+    case INBOUND_CSTRING:
+        return tuple_cstring(tuple);
+    case INBOUND_DATA:
+        return tuple->type == TUPLE_BYTE_ARRAY;
+    default:
+        return (tuple->type == TUPLE_INT || tuple->type == TUPLE_UINT) && tuple->length >= shape;
+    }
+}
+
+static void inbound_scan(DictionaryIterator* received, InboundMessage* message) {
+    memset(message, 0, sizeof(*message));
+    Tuple* tuple = dict_read_first(received);
+    while(tuple) {
+        if(tuple_overruns(received, tuple)) {
+            message->truncated = true;
+            return;
+        }
+        Tuple** field = NULL;
+        uint8_t shape = INBOUND_ANY;
+        // Keys outside the reserved range are the server's; skip them quickly.
+        if(tuple->key >= 0xF000 && tuple->key <= 0xFFFF) {
+            switch(tuple->key) {
+            case HTTP_CONNECT_KEY: field = &message->connect; shape = 1; break;
+            case HTTP_TIME_KEY: field = &message->time; shape = 4; break;
+            case HTTP_LOCATION_KEY: field = &message->location; shape = 4; break;
+            case HTTP_APP_ID_KEY: field = &message->app_id; shape = 4; break;
+            case HTTP_URL_KEY: field = &message->url; shape = 1; break;
+            case HTTP_STATUS_KEY: field = &message->status; shape = 2; break;
+            case HTTP_COOKIE_KEY: field = &message->cookie; shape = 4; break;
+            case HTTP_COOKIE_STORE_KEY: field = &message->cookie_store; shape = 4; break;
+            case HTTP_COOKIE_LOAD_KEY: field = &message->cookie_load; shape = 4; break;
+            case HTTP_COOKIE_FSYNC_KEY: field = &message->cookie_fsync; shape = 1; break;
+            case HTTP_COOKIE_DELETE_KEY: field = &message->cookie_delete; shape = 4; break;
+            case HTTP_UTC_OFFSET_KEY: field = &message->utc_offset; shape = 4; break;
+            case HTTP_IS_DST_KEY: field = &message->is_dst; shape = 1; break;
+            case HTTP_TZ_NAME_KEY: field = &message->tz_name; shape = INBOUND_CSTRING; break;
+            case HTTP_LATITUDE_KEY: field = &message->latitude; shape = 4; break;
+            case HTTP_LONGITUDE_KEY: field = &message->longitude; shape = 4; break;
+            case HTTP_ALTITUDE_KEY: field = &message->altitude; shape = 4; break;
+            case HTTP_FRAGMENT_KEY: field = &message->fragment; shape = 2; break;
+            case HTTP_FRAGMENT_COUNT_KEY: field = &message->fragment_count; shape = 2; break;
+            case HTTP_BATCH_KEY: field = &message->batch; break;
+            case HTTP_VALIDATOR_KEY: field = &message->validator; shape = 4; break;
+            case HTTP_PACKED_KEY: field = &message->packed; shape = INBOUND_DATA; break;
+            case HTTP_COMPRESSED_KEY: field = &message->compressed; shape = INBOUND_DATA; break;
+            default: break;
+            }
+        }
+        // Like dict_find, the first occurrence of a key wins.
+        if(field && !*field && inbound_valid(tuple, shape)) {
+            *field = tuple;
+        }
+        tuple = dict_read_next(received);
+    }
+}
+
+static void app_received_http_fragment(DictionaryIterator* received, const InboundMessage* message, uint16_t status, int32_t cookie, void* context) {
+    uint16_t index = message->fragment->value->uint16;
+    uint16_t count = message->fragment_count->value->uint16;
+    ResponseStream* stream = stream_find(cookie);
+    if(!stream) {
+        // The rest of a response we already gave up on, and failed, once.
+        ResponseStream* cancelled = stream_find_cancelled(cookie);
+        if(cancelled) {
+            if(index + 1 >= count) {
+                cancelled->cancelled = false;
+            }
+            return;
+        }
+    }
+    if(!stream || index != stream->next_index || index >= count) {
+        // Not something we asked to stream, or a fragment went missing.
+        request_finish(REQUEST_HTTP, cookie);
+        stream_cancel(cookie);
+        stats_failed(REQUEST_HTTP, cookie, 1000 + HTTP_INVALID_BRIDGE_RESPONSE);
+        if(route->callbacks.failure) {
+            route->callbacks.failure(cookie, 1000 + HTTP_INVALID_BRIDGE_RESPONSE, context);
+        }
+        return;
+    }
+    ++stream->next_index;
+    bool last = stream->next_index == count;
+    if(last) {
+        request_finish(REQUEST_HTTP, cookie);
+        stream->active = false;
+    } else {
+        request_touch(REQUEST_HTTP, cookie);
+    }
+
+    if(!stream->buffer) {
+        if(last) {
+            resync_fresh(REQUEST_HTTP, cookie);
+        }
+        if(route->callbacks.fragment) {
+            route->callbacks.fragment(cookie, status, index, count, received, context);
+        }
+        return;
+    }
+    Tuple* tuple = dict_read_first(received);
+    while(tuple && !stream->overflowed) {
+        // Each fragment repeats the response header; only keep the body.
+        bool header = tuple->key == HTTP_URL_KEY || tuple->key == HTTP_STATUS_KEY || tuple->key == HTTP_COOKIE_KEY ||
+                      tuple->key == HTTP_APP_ID_KEY || tuple->key == HTTP_FRAGMENT_KEY || tuple->key == HTTP_FRAGMENT_COUNT_KEY;
+        if(!header && dict_write_tuple(&stream->iter, tuple) != DICT_OK) {
+            stream->overflowed = true;
+        }
+        tuple = dict_read_next(received);
+    }
+    if(!last) return;
+    if(stream->overflowed) {
+        stats_failed(REQUEST_HTTP, cookie, 1000 + HTTP_BUFFER_OVERFLOW);
+        if(route->callbacks.failure) {
+            route->callbacks.failure(cookie, 1000 + HTTP_BUFFER_OVERFLOW, context);
+        }
+        return;
+    }
+    DictionaryIterator assembled;
+    dict_read_begin_from_buffer(&assembled, stream->buffer, dict_write_end(&stream->iter));
+    resync_fresh(REQUEST_HTTP, cookie);
+    if(route->callbacks.success) {
+        route->callbacks.success(cookie, status, &assembled, context);
+    }
+}
+
+static void app_received_http_response(DictionaryIterator* received, const InboundMessage* message, void* context) {
+    bool success = message->url->value->uint8;
+    Tuple* status_tuple = message->status;
+    Tuple* cookie_tuple = message->cookie;
+    if(status_tuple == NULL || cookie_tuple == NULL) {
+        // If we can tell which request it answers, that one fails now rather than timing out.
+        int32_t cookie = 0;
+        if(cookie_tuple) {
+            cookie = cookie_tuple->value->int32;
+            request_finish(REQUEST_HTTP, cookie);
+        }
+        report_failure_routed(REQUEST_HTTP, cookie, 1000 + HTTP_INVALID_BRIDGE_RESPONSE);
+        return;
+    }
+    uint16_t status = status_tuple->value->int16;
+    int32_t cookie = cookie_tuple->value->int32;
+#ifdef HTTP_PACKED
+    // The app only ever sees ordinary tuples.
+    DictionaryIterator unpacked;
+    if(message->packed || message->compressed) {
+        HTTPResult http_result = packed_decode(received, message->packed, message->compressed, &unpacked);
+        if(http_result != HTTP_OK) {
+            request_finish(REQUEST_HTTP, cookie);
+            report_failure_routed(REQUEST_HTTP, cookie, 1000 + http_result);
+            return;
+        }
+        received = &unpacked;
+    }
+#endif
+    if(success && message->fragment && message->fragment_count) {
+        app_received_http_fragment(received, message, status, cookie, context);
+        return;
+    }
+    request_finish(REQUEST_HTTP, cookie);
+    stream_cancel(cookie);
+    int32_t subscribers[HTTP_MAX_SUBSCRIBERS];
+    uint8_t count = shared_take(cookie, subscribers);
+#ifdef HTTP_CONDITIONAL_REQUESTS
+    if(success) {
+        validator_answered(route->app_id, cookie, status, message->validator, subscribers, count);
+    }
+#endif
+    if(!success) {
+        stats_failed(REQUEST_HTTP, cookie, status);
+        if(route->callbacks.failure) {
+            route->callbacks.failure(cookie, status, context);
+            for(int i = 0; i < count; ++i) {
+                route->callbacks.failure(subscribers[i], status, context);
+            }
+        }
+        return;
+    }
+    resync_fresh(REQUEST_HTTP, cookie);
+    for(int i = 0; i < count; ++i) {
+        resync_fresh(REQUEST_HTTP, subscribers[i]);
+    }
+    if(route->callbacks.success) {
+        route->callbacks.success(cookie, status, received, context);
+        for(int i = 0; i < count; ++i) {
+            route->callbacks.success(subscribers[i], status, received, context);
+        }
+    }
+}
+
+static void app_received_cookie_set_response(int32_t request_id, void* context) {
+    request_finish(REQUEST_COOKIE_SET, request_id);
+#ifdef HTTP_COOKIE_WRITE_BACK
+    if(write_back_part(request_id) >= 0) {
+        write_back_message_done(write_back_part(request_id), true);
+        return;
+    }
+#endif
+    if(route->callbacks.cookie_set) {
+        route->callbacks.cookie_set(request_id, true, context);
+    }
+}
+
+// Calls the per-key handler for up to `limit` of the user values in `iter`.
+static void cookie_get_each(int32_t request_id, DictionaryIterator* iter, uint8_t limit, void* context) {
+    if(!route->callbacks.cookie_get) return;
+    Tuple* tuple = dict_read_first(iter);
+    while(tuple && limit > 0) {
+        // Don't pass along reserved values.
+        if(tuple->key < 0xF000 || tuple->key > 0xFFFF) {
+            route->callbacks.cookie_get(request_id, tuple, context);
+            --limit;
+        }
+        tuple = dict_read_next(iter);
+    }
+}
+
+static void cookie_get_deliver(int32_t request_id, DictionaryIterator* iter, void* context) {
+    resync_fresh(REQUEST_COOKIE_GET, request_id);
+    if(route->callbacks.cookie_batch_get) {
+        route->callbacks.cookie_batch_get(request_id, iter, context);
+    }
+    cookie_get_each(request_id, iter, UINT8_MAX, context);
+}
+
+// Hands the assembled answer to the app. The slot stays busy until the callbacks
+// return, since they are reading from it.
+static void pending_get_finish(void* context) {
+    DictionaryIterator merged;
+    dict_read_begin_from_buffer(&merged, pending_get.buffer, dict_write_end(&pending_get.iter));
+    if(!pending_get.overflowed) {
+        resync_fresh(REQUEST_COOKIE_GET, pending_get.request_id);
+    }
+    if(route->callbacks.cookie_batch_get) {
+        route->callbacks.cookie_batch_get(pending_get.request_id, &merged, context);
+    }
+    // Values from the phone went to the per-key handler as they arrived; only the cached ones are left.
+    cookie_get_each(pending_get.request_id, &merged, pending_get.cached, context);
+    pending_get.active = false;
+    if(pending_get.overflowed && route->callbacks.failure) {
+        route->callbacks.failure(pending_get.request_id, 1000 + HTTP_BUFFER_OVERFLOW, context);
+    }
+}
+
+static void pending_get_reply(void* context) {
+    if(pending_get.replies > 0) {
+        --pending_get.replies;
+    }
+    if(pending_get.replies > 0 || pending_get.building) return;
+    if(pending_get.failed) {
+        pending_get.active = false;
+        return;
+    }
+    pending_get_finish(context);
+}
+
+static bool pending_get_begin(int32_t request_id) {
+    if(pending_get.active) return false;
+    DictionaryIterator* iter = &pending_get.iter;
+    dict_write_begin(iter, pending_get.buffer, sizeof(pending_get.buffer));
+    if(dict_write_int32(iter, HTTP_COOKIE_LOAD_KEY, request_id) != DICT_OK ||
+       dict_write_int32(iter, HTTP_APP_ID_KEY, our_app_id) != DICT_OK) return false;
+    pending_get.active = true;
+    pending_get.building = false;
+    pending_get.failed = false;
+    pending_get.overflowed = false;
+    pending_get.replies = 0;
+    pending_get.cached = 0;
+    pending_get.request_id = request_id;
+    return true;
+}
+
+static void pending_delete_reply(void* context) {
+    if(pending_delete.replies > 0) {
+        --pending_delete.replies;
+    }
+    if(pending_delete.replies > 0 || pending_delete.building) return;
+    pending_delete.active = false;
+    if(route->callbacks.cookie_delete) {
+        route->callbacks.cookie_delete(pending_delete.request_id, !pending_delete.failed, context);
+    }
+}
+
+static void app_received_cookie_get_response(int32_t request_id, DictionaryIterator* iter, void* context) {
+    request_finish(REQUEST_COOKIE_GET, request_id);
+    bool merge = pending_get.active && pending_get.request_id == request_id;
+    Tuple* tuple = dict_read_first(iter);
+    while(tuple) {
+        if(tuple->key < 0xF000 || tuple->key > 0xFFFF) {
+#ifdef HTTP_COOKIE_CACHE
+            cookie_cache_store(route->app_id, tuple->key, tuple->type, tuple->value, tuple->length);
+#endif
+            if(merge && dict_write_tuple(&pending_get.iter, tuple) != DICT_OK) {
+                pending_get.overflowed = true;
+            }
+        }
+        tuple = dict_read_next(iter);
+    }
+    if(merge) {
+        cookie_get_each(request_id, iter, UINT8_MAX, context);
+        pending_get_reply(context);
+        return;
+    }
+    cookie_get_deliver(request_id, iter, context);
+}
+
+static void app_received_cookie_fsync_response(bool successful, void* context) {
+    request_finish(REQUEST_COOKIE_FSYNC, 0);
+    if(route->callbacks.cookie_fsync) {
+        route->callbacks.cookie_fsync(successful, context);
+    }
+}
+static void app_received_cookie_delete_response(int32_t request_id, void* context) {
+    request_finish(REQUEST_COOKIE_DELETE, request_id);
+    if(pending_delete.active && pending_delete.request_id == request_id) {
+        pending_delete_reply(context);
+        return;
+    }
+    if(route->callbacks.cookie_delete) {
+        route->callbacks.cookie_delete(request_id, true, context);
+    }
+}
+
+static void app_received_time(const InboundMessage* message, void* context) {
+    // Responses don't say which request they answer; either will do.
+    if(time_sync.refreshing) {
+        time_sync.refreshing = false;
+        request_finish(REQUEST_TIME, TIME_SYNC_REQUEST_ID);
+    } else {
+        request_finish(REQUEST_TIME, 0);
+    }
+    if(!message->utc_offset || !message->is_dst || !message->tz_name) return;
+    time_sync.valid = true;
+    time_sync.stale = false;
+    time_sync.utc_offset = message->utc_offset->value->int32;
+    time_sync.is_dst = message->is_dst->value->uint8;
+    time_sync.unixtime = message->time->value->uint32;
+    time_sync.received_at = http_clock();
+    // Start watching the clock.
+    timer_schedule();
+    strncpy(time_sync.tz_name, message->tz_name->value->cstring, HTTP_TIME_TZ_NAME_SIZE - 1);
+    time_sync.tz_name[HTTP_TIME_TZ_NAME_SIZE - 1] = '\0';
+    // Every app sharing the connection hears about it, as it would not know who asked.
+    for(int i = -1; i < app_route_count; ++i) {
+        route = i < 0 ? &default_route : &app_routes[i];
+        if(route->callbacks.time) {
+            route->callbacks.time(message->utc_offset->value->int32, message->is_dst->value->uint8,
+                                  message->time->value->uint32, message->tz_name->value->cstring,
+                                  i < 0 ? context : route->context);
+        }
+    }
+    route = &default_route;
+}
+
+// Handy helper for getting floats out of ints.
+struct alias_float {
+    float f;
+} __attribute__((__may_alias__));
+
+float floatFromUint32(uint32_t value) {
+    return ((struct alias_float*)&value)->f;
+}
+
+static void location_waiters_notify(float latitude, float longitude, float altitude, float accuracy) {
+    // Waiters may ask again from their handlers, so take them off the list first.
+    LocationWaiter waiters[HTTP_LOCATION_WAITERS];
+    bool served[HTTP_LOCATION_WAITERS];
+    uint8_t count = 0;
+    uint8_t kept = 0;
+    for(int i = 0; i < location_sync.waiter_count; ++i) {
+        LocationWaiter waiter = location_sync.waiters[i];
+        bool failed = accuracy == HTTP_LOCATION_FAILED;
+        if(!failed && accuracy > waiter.max_accuracy) {
+            // Not good enough for this one: ask again, a few times.
+            if(++waiter.attempts < HTTP_LOCATION_ATTEMPTS) {
+                location_sync.waiters[kept++] = waiter;
+                continue;
+            }
+            failed = true;
         }
-        return;
+        served[count] = !failed;
+        waiters[count++] = waiter;
     }
-    uint16_t status = status_tuple->value->int16;
-    int32_t cookie = cookie_tuple->value->int32;
-    if(!success) {
-        if(http_callbacks.failure) {
-            http_callbacks.failure(cookie, status, context);
+    location_sync.waiter_count = kept;
+    if(kept > 0 && location_sync_refresh() != HTTP_OK) {
+        for(int i = 0; i < kept; ++i) {
+            served[count] = false;
+            waiters[count++] = location_sync.waiters[i];
         }
-        return;
+        location_sync.waiter_count = 0;
     }
-    if(http_callbacks.success) {
-        http_callbacks.success(cookie, status, received, context);
+    for(int i = 0; i < count; ++i) {
+        if(served[i]) {
+            waiters[i].handler(latitude, longitude, altitude, accuracy, waiters[i].context);
+        } else {
+            waiters[i].handler(0, 0, 0, HTTP_LOCATION_FAILED, waiters[i].context);
+        }
     }
 }
 
-static void app_received_cookie_set_response(int32_t request_id, void* context) {
-    if(http_callbacks.cookie_set) {
-        http_callbacks.cookie_set(request_id, true, context);
-    }
+// An untracked refresh is the message whose send has just finished, one way or the other.
+static void location_untracked_sent() {
+    if(!location_sync.untracked) return;
+    location_sync.untracked = false;
+    location_sync.refreshing = false;
+    location_waiters_notify(0, 0, 0, HTTP_LOCATION_FAILED);
 }
 
-static void app_received_cookie_get_response(int32_t request_id, DictionaryIterator* iter, void* context) {
-    if(http_callbacks.cookie_batch_get) {
-        http_callbacks.cookie_batch_get(request_id, iter, context);
+static void app_received_location(const InboundMessage* message, void* context) {
+    // Responses don't say which request they answer; either will do.
+    if(location_sync.refreshing) {
+        location_sync.refreshing = false;
+        location_sync.untracked = false;
+        request_finish(REQUEST_LOCATION, LOCATION_SYNC_REQUEST_ID);
+    } else {
+        request_finish(REQUEST_LOCATION, 0);
     }
-    if(http_callbacks.cookie_get) {
-        Tuple* tuple = dict_read_first(iter);
-        if(!tuple) return;
-        do {
-            // Don't pass along reserved values.
-            if(tuple->key >= 0xF000 && tuple->key <= 0xFFFF) continue;
-            http_callbacks.cookie_get(request_id, tuple, context);
-        } while((tuple = dict_read_next(iter)));
+    float accuracy = floatFromUint32(message->location->value->uint32);
+    float latitude = message->latitude ? floatFromUint32(message->latitude->value->uint32) : 0.f;
+    float longitude = message->longitude ? floatFromUint32(message->longitude->value->uint32) : 0.f;
+    float altitude = message->altitude ? floatFromUint32(message->altitude->value->uint32) : 0.f;
+    location_sync.valid = true;
+    location_sync.latitude = latitude;
+    location_sync.longitude = longitude;
+    location_sync.altitude = altitude;
+    location_sync.accuracy = accuracy;
+    location_sync.received_at = http_clock();
+
+    location_waiters_notify(latitude, longitude, altitude, accuracy);
+    // Every app sharing the connection hears about it, as it would not know who asked.
+    for(int i = -1; i < app_route_count; ++i) {
+        route = i < 0 ? &default_route : &app_routes[i];
+        if(route->callbacks.location) {
+            route->callbacks.location(latitude, longitude, altitude, accuracy, i < 0 ? context : route->context);
+        }
     }
+    route = &default_route;
 }
 
-static void app_received_cookie_fsync_response(bool successful, void* context) {
-    if(http_callbacks.cookie_fsync) {
-        http_callbacks.cookie_fsync(successful, context);
+// Fails whatever request a truncated message was answering, if it got far enough to say.
+static void app_received_truncated(const InboundMessage* message) {
+    RequestType type;
+    Tuple* id = NULL;
+    if(message->url) {
+        type = REQUEST_HTTP;
+        id = message->cookie;
+    } else if(message->cookie_store) {
+        type = REQUEST_COOKIE_SET;
+        id = message->cookie_store;
+    } else if(message->cookie_load) {
+        type = REQUEST_COOKIE_GET;
+        id = message->cookie_load;
+    } else if(message->cookie_delete) {
+        type = REQUEST_COOKIE_DELETE;
+        id = message->cookie_delete;
+    } else if(message->cookie_fsync) {
+        type = REQUEST_COOKIE_FSYNC;
+    } else {
+        return;
     }
-}
-static void app_received_cookie_delete_response(int32_t request_id, void* context) {
-    if(http_callbacks.cookie_delete) {
-        http_callbacks.cookie_delete(request_id, true, context);
+    int32_t request_id = id ? id->value->int32 : 0;
+    if(id || type == REQUEST_COOKIE_FSYNC) {
+        request_finish(type, request_id);
     }
+    report_failure_routed(type, request_id, 1000 + HTTP_INVALID_BRIDGE_RESPONSE);
 }
 
-static void app_received_time(uint32_t unixtime, DictionaryIterator *iter, void* context) {
-    if(!http_callbacks.time) return;
-    int32_t utc_offset;
-    bool is_dst;
-    const char* tz_name;
-    Tuple* tuple = dict_find(iter, HTTP_UTC_OFFSET_KEY);
-    if(!tuple) return;
-    utc_offset = tuple->value->int32;
-    tuple = dict_find(iter, HTTP_IS_DST_KEY);
-    if(!tuple) return;
-    is_dst = tuple->value->uint8;
-    tuple = dict_find(iter, HTTP_TZ_NAME_KEY);
-    if(!tuple) return;
-    tz_name = tuple->value->cstring;
-    http_callbacks.time(utc_offset, is_dst, unixtime, tz_name, context);
+// Routes a message by its app id; false if it has none, or nobody is listening for it.
+static bool app_received_route(const InboundMessage* message) {
+    if(!message->app_id) return false;
+    int32_t app_id = message->app_id->value->int32;
+    if(app_id != default_route.app_id && !route_find(app_id)) return false;
+    route_enter(app_id);
+    return true;
 }
 
-// Handy helper for getting floats out of ints.
-struct alias_float {
-    float f;
-} __attribute__((__may_alias__));
+// Replies to a batch may come back batched too. Each part is handled as though it
+// had arrived on its own; parts can't themselves be batches.
+static bool batch_dispatching;
 
-float floatFromUint32(uint32_t value) {
-    return ((struct alias_float*)&value)->f;
+static void app_received_batch(DictionaryIterator* received, void* context) {
+    batch_dispatching = true;
+    Tuple* tuple = dict_read_first(received);
+    while(tuple && !tuple_overruns(received, tuple)) {
+        // A part is a whole dictionary, so it has at least its count.
+        if(tuple->key - HTTP_BATCH_PART_KEY < HTTP_BATCH_MAX_PARTS && tuple->type == TUPLE_BYTE_ARRAY && tuple->length > 0) {
+            DictionaryIterator part;
+            dict_read_begin_from_buffer(&part, tuple->value->data, tuple->length);
+            app_received_dispatch(&part, context);
+        }
+        tuple = dict_read_next(received);
+    }
+    batch_dispatching = false;
 }
 
-static void app_received_location(uint32_t accuracy_int, DictionaryIterator *iter, void* context) {
-    if(!http_callbacks.location) return;
-    float accuracy = floatFromUint32(accuracy_int);
-    float latitude = 0.f;
-    float longitude = 0.f;
-    float altitude = 0.f;   
+static void app_received_dispatch(DictionaryIterator* received, void* context) {
+    route = &default_route;
+    InboundMessage message;
+    inbound_scan(received, &message);
 
-    Tuple* tuple = dict_read_first(iter);
-    if(!tuple) return;
-    do {
-        switch(tuple->key) {
-        case HTTP_LATITUDE_KEY:
-            latitude = floatFromUint32(tuple->value->uint32);
-            break;
-        case HTTP_LONGITUDE_KEY:
-            longitude = floatFromUint32(tuple->value->uint32);
-            break;
-        case HTTP_ALTITUDE_KEY:
-            altitude = floatFromUint32(tuple->value->uint32);
-            break;
-        default:
-            break;
+    // The app never sees a message it can't walk safely, and nothing is cached from one.
+    if(message.truncated) {
+        if(app_received_route(&message)) {
+            app_received_truncated(&message);
         }
-    } while((tuple = dict_read_next(iter)));
-    http_callbacks.location(latitude, longitude, altitude, accuracy, context);  
-}
+        return;
+    }
+
+    if(message.batch) {
+        if(!batch_dispatching) {
+            app_received_batch(received, context);
+        }
+        return;
+    }
 
-static void app_received(DictionaryIterator* received, void* context) {
     // Reconnect message (special: no app id)
-    Tuple* tuple = dict_find(received, HTTP_CONNECT_KEY);
-    if(tuple && tuple->value->uint8) {
-        if(http_callbacks.reconnect) {
-            http_callbacks.reconnect(context);
+    if(message.connect && message.connect->value->uint8) {
+        retry_resume();
+#ifdef HTTP_OFFLINE_JOURNAL
+        journal_replaying = true;
+        journal_replay();
+#endif
+        // The phone may have changed timezone while we were apart.
+        if(time_sync.valid) {
+            time_sync.stale = true;
+            time_sync_refresh();
+        }
+#ifdef HTTP_RESYNC
+        resync_begin();
+#endif
+        // Every app sharing the connection hears about it.
+        if(default_route.callbacks.reconnect) {
+            default_route.callbacks.reconnect(default_route.context);
+        }
+        for(int i = 0; i < app_route_count; ++i) {
+            if(app_routes[i].callbacks.reconnect) {
+                app_routes[i].callbacks.reconnect(app_routes[i].context);
+            }
         }
         return;
     }
     // Time response (special: no app id)
-    tuple = dict_find(received, HTTP_TIME_KEY);
-    if(tuple) {
-        app_received_time(tuple->value->uint32, received, context);
+    if(message.time) {
+        app_received_time(&message, context);
         return;
     }
     // Location response (special: no app id)
-    tuple = dict_find(received, HTTP_LOCATION_KEY);
-    if(tuple) {
-        app_received_location(tuple->value->uint32, received, context);
-        return;
-    }
-    // Check for the app id
-    tuple = dict_find(received, HTTP_APP_ID_KEY);
-    if(!tuple) {
+    if(message.location) {
+        app_received_location(&message, context);
         return;
     }
-    // Ignore it if it isn't ours.
-    if(tuple->value->int32 != our_app_id) return;
+    if(!app_received_route(&message)) return;
+    context = route->context;
 
     // HTTP responses
-    tuple = dict_find(received, HTTP_URL_KEY);
-    if(tuple) {
-        app_received_http_response(received, tuple->value->uint8, context);
+    if(message.url) {
+        app_received_http_response(received, &message, context);
         return;
     }
 
     // Cookie set confirmation
-    tuple = dict_find(received, HTTP_COOKIE_STORE_KEY);
-    if(tuple) {
-        app_received_cookie_set_response(tuple->value->int32, context);
+    if(message.cookie_store) {
+        app_received_cookie_set_response(message.cookie_store->value->int32, context);
         return;
     }
 
     // Cookie get response
-    tuple = dict_find(received, HTTP_COOKIE_LOAD_KEY);
-    if(tuple) {
-        app_received_cookie_get_response(tuple->value->int32, received, context);
+    if(message.cookie_load) {
+        app_received_cookie_get_response(message.cookie_load->value->int32, received, context);
         return;
     }
 
     // Save response
-    tuple = dict_find(received, HTTP_COOKIE_FSYNC_KEY);
-    if(tuple) {
-        app_received_cookie_fsync_response(tuple->value->uint8, context);
+    if(message.cookie_fsync) {
+        app_received_cookie_fsync_response(message.cookie_fsync->value->uint8, context);
         return;
     }
-    
+
     // Delete response
-    tuple = dict_find(received, HTTP_COOKIE_DELETE_KEY);
-    if(tuple) {
-        app_received_cookie_delete_response(tuple->value->int32, context);
+    if(message.cookie_delete) {
+        app_received_cookie_delete_response(message.cookie_delete->value->int32, context);
         return;
     }
 }
 
+static void app_received(DictionaryIterator* received, void* context) {
+    app_received_dispatch(received, context);
+    route = &default_route;
+    // Anything we queued while the inbound message held the outbox can go now.
+    queue_drain();
+    timer_poll();
+}
+
 static void app_dropped(void* context, AppMessageResult reason) {
-    if(!http_callbacks.failure) return;
-    http_callbacks.failure(0, 1000 + reason, context);
+    if(!default_route.callbacks.failure) return;
+    default_route.callbacks.failure(0, 1000 + reason, context);
 }
 
 // Time stuff
 HTTPResult http_time_request() {
     DictionaryIterator *iter;
-    AppMessageResult app_result = app_message_out_get(&iter);
-    if(app_result != APP_MSG_OK) {
-        return app_result;
+    HTTPResult http_result = outbox_begin(REQUEST_TIME, 0, &iter);
+    if(http_result != HTTP_OK) {
+        return http_result;
+    }
+    DictionaryResult dict_result = dict_write_uint8(iter, HTTP_TIME_KEY, 1);
+    if(dict_result != DICT_OK) {
+        outbox_abort();
+        return dict_result << 12;
+    }
+    return outbox_commit();
+}
+
+static HTTPResult time_sync_refresh() {
+    if(time_sync.refreshing) return HTTP_OK;
+    DictionaryIterator *iter;
+    HTTPResult http_result = outbox_begin(REQUEST_TIME, TIME_SYNC_REQUEST_ID, &iter);
+    if(http_result != HTTP_OK) {
+        return http_result;
     }
     DictionaryResult dict_result = dict_write_uint8(iter, HTTP_TIME_KEY, 1);
     if(dict_result != DICT_OK) {
+        outbox_abort();
         return dict_result << 12;
     }
-    app_result = app_message_out_send();
-    app_message_out_release();
-    return app_result;
+    // Set first: if the request can't be tracked, sending it clears this again.
+    time_sync.refreshing = true;
+    http_result = outbox_commit();
+    if(http_result != HTTP_OK) {
+        time_sync.refreshing = false;
+    }
+    return http_result;
+}
+
+static bool time_sync_expired(uint32_t now) {
+    // The watch's clock was set back, so we can't tell how old the data is.
+    if(now < time_sync.received_at) return true;
+    return now - time_sync.received_at >= HTTP_TIME_MAX_AGE;
+}
+
+bool http_time_get(int32_t* utc_offset_seconds, bool* is_dst, uint32_t* unixtime, const char** tz_name) {
+    uint32_t now = http_clock();
+    if(!time_sync.valid || time_sync.stale || time_sync_expired(now)) {
+        time_sync_refresh();
+    }
+    if(!time_sync.valid) return false;
+    if(utc_offset_seconds) *utc_offset_seconds = time_sync.utc_offset;
+    if(is_dst) *is_dst = time_sync.is_dst;
+    if(unixtime) *unixtime = time_sync.unixtime + (now >= time_sync.received_at ? now - time_sync.received_at : 0);
+    if(tz_name) *tz_name = time_sync.tz_name;
+    return true;
 }
 
 // Location stuff
 HTTPResult http_location_request() {
     DictionaryIterator *iter;
-    AppMessageResult app_result = app_message_out_get(&iter);
-    if(app_result != APP_MSG_OK) {
-        return app_result;
+    HTTPResult http_result = outbox_begin(REQUEST_LOCATION, 0, &iter);
+    if(http_result != HTTP_OK) {
+        return http_result;
+    }
+    DictionaryResult dict_result = dict_write_uint8(iter, HTTP_LOCATION_KEY, 1);
+    if(dict_result != DICT_OK) {
+        outbox_abort();
+        return dict_result << 12;
+    }
+    return outbox_commit();
+}
+
+static HTTPResult location_sync_refresh() {
+    if(location_sync.refreshing) return HTTP_OK;
+    DictionaryIterator *iter;
+    HTTPResult http_result = outbox_begin(REQUEST_LOCATION, LOCATION_SYNC_REQUEST_ID, &iter);
+    if(http_result != HTTP_OK) {
+        return http_result;
     }
     DictionaryResult dict_result = dict_write_uint8(iter, HTTP_LOCATION_KEY, 1);
     if(dict_result != DICT_OK) {
+        outbox_abort();
         return dict_result << 12;
     }
-    app_result = app_message_out_send();
-    app_message_out_release();
-    return app_result;
+    location_sync.refreshing = true;
+    http_result = outbox_commit();
+    if(http_result != HTTP_OK) {
+        location_sync.refreshing = false;
+    }
+    return http_result;
+}
+
+HTTPResult http_location_get(uint32_t max_age, float max_accuracy, HTTPLocationHandler handler, void* context) {
+    if(!handler) return HTTP_INVALID_ARGS;
+    uint32_t now = http_clock();
+    // A fix from before the watch's clock was set back is of unknown age.
+    if(location_sync.valid && now >= location_sync.received_at && now - location_sync.received_at <= max_age
+       && location_sync.accuracy <= max_accuracy) {
+        handler(location_sync.latitude, location_sync.longitude, location_sync.altitude, location_sync.accuracy, context);
+        return HTTP_OK;
+    }
+    if(location_sync.waiter_count == HTTP_LOCATION_WAITERS) return HTTP_BUSY;
+    HTTPResult http_result = location_sync_refresh();
+    if(http_result != HTTP_OK) {
+        return http_result;
+    }
+    location_sync.waiters[location_sync.waiter_count++] = (LocationWaiter){
+        .handler = handler,
+        .context = context,
+        .max_accuracy = max_accuracy,
+    };
+    return HTTP_OK;
 }
 
 // Cookie stuff
 void http_set_app_id(int32_t new_app_id) {
     our_app_id = new_app_id;
+    if(!route_find(new_app_id)) {
+        default_route.app_id = new_app_id;
+    }
+}
+
+bool http_register_app(int32_t app_id, HTTPCallbacks callbacks, void* context) {
+    AppRoute* app_route = route_find(app_id);
+    if(!app_route) {
+        if(app_route_count >= HTTP_MAX_APP_ROUTES) return false;
+        app_route = &app_routes[app_route_count++];
+    }
+    *app_route = (AppRoute){
+        .app_id = app_id,
+        .callbacks = callbacks,
+        .context = context,
+    };
+    // Make sure we're hearing from AppMessage even if the app itself has no callbacks.
+    if(!callbacks_registered) {
+        http_register_callbacks(default_route.callbacks, default_route.context);
+    }
+    return callbacks_registered;
+}
+
+void http_unregister_app(int32_t app_id) {
+    AppRoute* app_route = route_find(app_id);
+    if(!app_route) return;
+    *app_route = app_routes[--app_route_count];
+#ifdef HTTP_COOKIE_CACHE
+    cookie_cache_forget(app_id);
+#endif
+#ifdef HTTP_RESYNC
+    for(int i = resync_count - 1; i >= 0; --i) {
+        if(resync_entries[i].app_id == app_id) {
+            resync_entries[i] = resync_entries[--resync_count];
+        }
+    }
+#endif
+}
+
+// Read-through cache
+#ifdef HTTP_COOKIE_CACHE
+static CachedCookie* cookie_cache_find(int32_t app_id, uint32_t key) {
+    for(int i = 0; i < HTTP_COOKIE_CACHE_ENTRIES; ++i) {
+        if(cookie_cache[i].used && cookie_cache[i].app_id == app_id && cookie_cache[i].key == key) {
+            cookie_cache[i].last_used = ++cookie_cache_clock;
+            return &cookie_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void cookie_cache_remove(uint32_t key) {
+    CachedCookie* entry = cookie_cache_find(our_app_id, key);
+    if(entry) {
+        entry->used = false;
+    }
+}
+
+static void cookie_cache_clear() {
+    for(int i = 0; i < HTTP_COOKIE_CACHE_ENTRIES; ++i) {
+        cookie_cache[i].used = false;
+    }
+}
+
+static void cookie_cache_forget(int32_t app_id) {
+    for(int i = 0; i < HTTP_COOKIE_CACHE_ENTRIES; ++i) {
+        if(cookie_cache[i].app_id == app_id) {
+            cookie_cache[i].used = false;
+        }
+    }
+}
+
+static void cookie_cache_store(int32_t app_id, uint32_t key, TupleType type, const void* value, uint16_t length) {
+    CachedCookie* entry = cookie_cache_find(app_id, key);
+    if(length > HTTP_COOKIE_CACHE_VALUE_SIZE) {
+        // Too big to keep; make sure we don't answer with the old value.
+        if(entry) {
+            entry->used = false;
+        }
+        return;
+    }
+    if(!entry) {
+        // Evict the least recently used entry.
+        entry = &cookie_cache[0];
+        for(int i = 0; i < HTTP_COOKIE_CACHE_ENTRIES && entry->used; ++i) {
+            if(!cookie_cache[i].used || cookie_cache[i].last_used < entry->last_used) {
+                entry = &cookie_cache[i];
+            }
+        }
+    }
+    *entry = (CachedCookie){
+        .used = true,
+        .type = type,
+        .length = length,
+        .app_id = app_id,
+        .key = key,
+        .last_used = ++cookie_cache_clock,
+    };
+    memcpy(entry->value, value, length);
+}
+
+// Caches the user values of a cookie set message about to be sent.
+static void cookie_cache_store_message(DictionaryIterator* iter) {
+    DictionaryIterator read;
+    Tuple* tuple = dict_read_begin_from_buffer(&read, (uint8_t*)iter->dictionary, (uint8_t*)iter->cursor - (uint8_t*)iter->dictionary);
+    while(tuple) {
+        if(tuple->key < 0xF000 || tuple->key > 0xFFFF) {
+            cookie_cache_store(our_app_id, tuple->key, tuple->type, tuple->value, tuple->length);
+        }
+        tuple = dict_read_next(&read);
+    }
+}
+
+// Starts assembling the answer to a cookie get from the cache. Returns how many of
+// the keys still have to be fetched from the phone, or -1 if the cache can't be
+// used for this request.
+static int32_t cookie_cache_lookup(int32_t request_id, uint32_t* keys, int32_t length) {
+    if(!pending_get_begin(request_id)) return -1;
+    int32_t misses = 0;
+    for(int i = 0; i < length; ++i) {
+        CachedCookie* entry = cookie_cache_find(our_app_id, keys[i]);
+        if(!entry) {
+            ++misses;
+        } else if(dict_write_value(&pending_get.iter, entry->key, entry->type, entry->value, entry->length) == DICT_OK) {
+            ++pending_get.cached;
+        } else {
+            pending_get.active = false;
+            return -1;
+        }
+    }
+    cookie_cache_hits += length - misses;
+    cookie_cache_misses += misses;
+    return misses;
+}
+#endif
+
+uint32_t http_cookie_cache_hits() {
+#ifdef HTTP_COOKIE_CACHE
+    return cookie_cache_hits;
+#else
+    return 0;
+#endif
+}
+
+uint32_t http_cookie_cache_misses() {
+#ifdef HTTP_COOKIE_CACHE
+    return cookie_cache_misses;
+#else
+    return 0;
+#endif
+}
+
+// Write-back cache
+#ifdef HTTP_COOKIE_WRITE_BACK
+static void staged_remove(uint8_t index) {
+    StagedCookie removed = staged[index];
+    memmove(&staged_data[removed.offset], &staged_data[removed.offset + removed.length],
+            staged_data_used - removed.offset - removed.length);
+    staged_data_used -= removed.length;
+    memmove(&staged[index], &staged[index + 1], (staged_count - index - 1) * sizeof(StagedCookie));
+    --staged_count;
+    for(int i = 0; i < staged_count; ++i) {
+        if(staged[i].offset > removed.offset) {
+            staged[i].offset -= removed.length;
+        }
+    }
+}
+
+// Stages a value, replacing any earlier value for the same key. Returns false if it
+// doesn't fit even after flushing, in which case the caller should send it directly.
+static bool write_back_stage(int32_t request_id, uint32_t key, TupleType type, const void* value, uint16_t length) {
+    if(length > HTTP_WRITE_BACK_BUFFER_SIZE) return false;
+    // Another app's values are still on their way; this one goes directly.
+    if((staged_count > 0 || staged_id_count > 0) && staged_app_id != our_app_id) return false;
+    staged_app_id = our_app_id;
+    // Whoever wrote the value this replaces hears how the new one fares.
+    uint32_t ids = 0;
+    for(int i = 0; i < staged_count; ++i) {
+        if(staged[i].key == key) {
+            ids = staged[i].ids;
+            staged_remove(i);
+            break;
+        }
+    }
+    int id_index = staged_id_count;
+    for(int i = 0; i < staged_id_count; ++i) {
+        if(staged_ids[i] == request_id) {
+            id_index = i;
+            break;
+        }
+    }
+    bool known_id = id_index < staged_id_count;
+    // Ids are only released once a flush completes, so flushing can't make room for one.
+    if(!known_id && staged_id_count >= HTTP_WRITE_BACK_MAX_KEYS) return false;
+    if(staged_count >= HTTP_WRITE_BACK_MAX_KEYS || staged_data_used + length > HTTP_WRITE_BACK_BUFFER_SIZE) {
+        http_cookie_flush();
+        if(staged_count >= HTTP_WRITE_BACK_MAX_KEYS || staged_data_used + length > HTTP_WRITE_BACK_BUFFER_SIZE) return false;
+    }
+    if(staged_count == 0) {
+        staged_since = http_clock();
+    }
+    staged[staged_count++] = (StagedCookie){
+        .key = key,
+        .type = type,
+        .length = length,
+        .offset = staged_data_used,
+        .ids = ids | 1u << id_index,
+    };
+    memcpy(&staged_data[staged_data_used], value, length);
+    staged_data_used += length;
+#ifdef HTTP_COOKIE_CACHE
+    cookie_cache_store(our_app_id, key, type, value, length);
+#endif
+    if(!known_id) {
+        staged_ids[staged_id_count++] = request_id;
+    }
+    timer_schedule();
+    return true;
+}
+
+// The flush message a request id belongs to, or -1 if it isn't one.
+static int write_back_part(int32_t request_id) {
+    uint32_t part = (uint32_t)request_id - WRITE_BACK_REQUEST_ID;
+    return part < HTTP_WRITE_BACK_MAX_KEYS ? (int)part : -1;
+}
+
+// Called once per flush message when the bridge confirms or we give up on it, or
+// with no part when nothing was left to send.
+static void write_back_message_done(int part, bool successful) {
+    if(part >= 0) {
+        if(!(flush_parts_used & 1u << part)) return;
+        flush_parts_used &= ~(1u << part);
+        --flushing_messages;
+        if(!successful) {
+            flush_failed_ids |= flush_parts[part];
+#ifdef HTTP_COOKIE_CACHE
+            cookie_cache_clear();
+#endif
+        }
+    }
+    if(flushing_messages > 0 || staged_count > 0) return;
+    // Everything staged has been answered: report each caller's request once, by how
+    // the messages carrying its values fared.
+    uint32_t failed = flush_failed_ids;
+    uint8_t count = staged_id_count;
+    int32_t ids[HTTP_WRITE_BACK_MAX_KEYS];
+    memcpy(ids, staged_ids, count * sizeof(int32_t));
+    staged_id_count = 0;
+    flush_failed_ids = 0;
+    const AppRoute* staged_route = route_find(staged_app_id);
+    if(!staged_route) {
+        staged_route = &default_route;
+    }
+    if(!staged_route->callbacks.cookie_set) return;
+    for(int i = 0; i < count; ++i) {
+        staged_route->callbacks.cookie_set(ids[i], !(failed & 1u << i), staged_route->context);
+    }
+}
+
+static void write_back_poll(uint32_t now) {
+    if(staged_count > 0 && flushing_messages == 0 && now >= staged_since + HTTP_WRITE_BACK_DELAY) {
+        // If the queue is full this waits another delay before trying again.
+        staged_since = now;
+        http_cookie_flush();
+    }
+}
+
+static void write_back_next_deadline(uint32_t* deadline) {
+    if(staged_count > 0 && flushing_messages == 0 && staged_since + HTTP_WRITE_BACK_DELAY < *deadline) {
+        *deadline = staged_since + HTTP_WRITE_BACK_DELAY;
+    }
+}
+#endif
+
+HTTPResult http_cookie_flush() {
+#ifdef HTTP_COOKIE_WRITE_BACK
+    while(staged_count > 0) {
+        int part = 0;
+        while(part < HTTP_WRITE_BACK_MAX_KEYS && flush_parts_used & 1u << part) ++part;
+        // Every part is still out; the rest goes once they are answered.
+        if(part == HTTP_WRITE_BACK_MAX_KEYS) return HTTP_OK;
+        DictionaryIterator *iter;
+        HTTPResult http_result = outbox_begin(REQUEST_COOKIE_SET, WRITE_BACK_REQUEST_ID + part, &iter);
+        if(http_result != HTTP_OK) {
+            // The rest goes out as soon as an earlier message is acknowledged.
+            return flushing_messages > 0 ? HTTP_OK : http_result;
+        }
+        DictionaryResult dict_result = dict_write_int32(iter, HTTP_COOKIE_STORE_KEY, WRITE_BACK_REQUEST_ID + part);
+        if(dict_result == DICT_OK) {
+            dict_result = dict_write_int32(iter, HTTP_APP_ID_KEY, staged_app_id);
+        }
+        if(dict_result != DICT_OK) {
+            outbox_abort();
+            return dict_result << 12;
+        }
+        uint8_t written = 0;
+        uint32_t ids = 0;
+        while(written < staged_count) {
+            StagedCookie* cookie = &staged[written];
+            if(dict_write_value(iter, cookie->key, cookie->type, &staged_data[cookie->offset], cookie->length) != DICT_OK) break;
+            ids |= cookie->ids;
+            ++written;
+        }
+        if(written == 0) {
+            // Too big for any message; drop it rather than block everything behind it.
+            outbox_abort();
+            flush_failed_ids |= staged[0].ids;
+            staged_remove(0);
+            continue;
+        }
+        http_result = outbox_commit();
+        for(int i = 0; i < written; ++i) {
+            staged_remove(0);
+        }
+        flush_parts[part] = ids;
+        flush_parts_used |= 1u << part;
+        ++flushing_messages;
+        if(http_result != HTTP_OK) {
+            write_back_message_done(part, false);
+        }
+    }
+    if(flushing_messages == 0 && staged_id_count > 0) {
+        // Nothing left to wait for (every value was dropped); report now.
+        write_back_message_done(-1, false);
+    }
+#endif
+    return HTTP_OK;
 }
 
 HTTPResult http_cookie_set_start(int32_t request_id, DictionaryIterator **iter_out) {
-    AppMessageResult app_result = app_message_out_get(iter_out);
-    if(app_result != APP_MSG_OK) {
-        return app_result;
+    // Staged values must reach the phone before anything written here.
+    http_cookie_flush();
+    HTTPResult http_result = outbox_begin(REQUEST_COOKIE_SET, request_id, iter_out);
+    if(http_result != HTTP_OK) {
+        return http_result;
     }
     DictionaryResult dict_result = dict_write_int32(*iter_out, HTTP_COOKIE_STORE_KEY, request_id);
-    if(dict_result != DICT_OK) {
-        return dict_result << 12;
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_int32(*iter_out, HTTP_APP_ID_KEY, our_app_id);
     }
-    dict_result = dict_write_int32(*iter_out, HTTP_APP_ID_KEY, our_app_id);
     if(dict_result != DICT_OK) {
+        outbox_abort();
         return dict_result << 12;
     }
     return HTTP_OK;
 }
 
 HTTPResult http_cookie_set_end() {
-    AppMessageResult result = app_message_out_send();
-    app_message_out_release(); // We don't care if it's already released.
-    return result;
+#ifdef HTTP_COOKIE_CACHE
+    if(outbox_state != OUTBOX_IDLE) {
+        cookie_cache_store_message(outbox_iter);
+    }
+#endif
+    return outbox_commit();
 }
 
-HTTPResult http_cookie_get_multiple(int32_t request_id, uint32_t* keys, int32_t length) {
+static bool cookie_key_skipped(uint32_t key, bool skip_cached) {
+#ifdef HTTP_COOKIE_CACHE
+    return skip_cached && cookie_cache_find(our_app_id, key);
+#else
+    (void)key;
+    (void)skip_cached;
+    return false;
+#endif
+}
+
+// How many queue-slot-sized messages it takes to list `count` keys.
+static int32_t cookie_keys_chunks(int32_t count) {
+    int32_t per_chunk = (HTTP_QUEUE_BUFFER_SIZE - dict_calc_buffer_size(2, sizeof(int32_t), sizeof(int32_t)))
+                        / (dict_calc_buffer_size(1, sizeof(uint8_t)) - dict_calc_buffer_size(0));
+    if(per_chunk < 1) return INT32_MAX;
+    return count <= per_chunk ? 1 : (count + per_chunk - 1) / per_chunk;
+}
+
+// Writes one message listing `keys` from `*next` on, as many as fit, and advances `*next`
+// past them.
+static HTTPResult cookie_keys_send(RequestType type, int32_t app_id, int32_t request_id, const uint32_t* keys, int32_t length, bool skip_cached, int32_t* next) {
     // Basic setup
     DictionaryIterator *iter;
-    AppMessageResult app_result = app_message_out_get(&iter);
-    if(app_result != APP_MSG_OK) {
-        return app_result;
+    HTTPResult http_result = outbox_begin(type, request_id, &iter);
+    if(http_result != HTTP_OK) {
+        return http_result;
     }
-    DictionaryResult dict_result = dict_write_int32(iter, HTTP_COOKIE_LOAD_KEY, request_id);
-    if(dict_result != DICT_OK) {
-        app_message_out_release();
-        return dict_result << 12;
+    uint32_t request_key = type == REQUEST_COOKIE_GET ? HTTP_COOKIE_LOAD_KEY : HTTP_COOKIE_DELETE_KEY;
+    DictionaryResult dict_result = dict_write_int32(iter, request_key, request_id);
+    if(dict_result == DICT_OK) {
+        dict_result = dict_write_int32(iter, HTTP_APP_ID_KEY, app_id);
+    }
+    // Add as many keys as fit
+    int32_t i = *next;
+    bool written = false;
+    while(dict_result == DICT_OK && i < length) {
+        if(cookie_key_skipped(keys[i], skip_cached)) {
+            ++i;
+            continue;
+        }
+        dict_result = dict_write_uint8(iter, keys[i], 1);
+        if(dict_result == DICT_OK) {
+            written = true;
+            ++i;
+        } else if(dict_result == DICT_NOT_ENOUGH_STORAGE && written) {
+            dict_result = DICT_OK;
+            break;
+        }
     }
-    dict_result = dict_write_int32(iter, HTTP_APP_ID_KEY, our_app_id);
     if(dict_result != DICT_OK) {
-        app_message_out_release();
+        outbox_abort();
         return dict_result << 12;
     }
-    // Add the keys
-    for(int i = 0; i < length; ++i) {
-        dict_result = dict_write_uint8(iter, keys[i], 1);
-        if(dict_result != DICT_OK) {
-            app_message_out_release();
-            return dict_result << 12;
+    *next = i;
+    // Send it.
+    return outbox_commit();
+}
+
+// Called once every message of a split get or delete has been sent, or given up on.
+static void cookie_keys_sent(RequestType type, int32_t app_id) {
+    const AppRoute* outer = route_enter(app_id);
+    if(type == REQUEST_COOKIE_GET) {
+        pending_get.building = false;
+        // Every reply is in already, or every part failed before it left the watch.
+        if(pending_get.active && pending_get.replies == 0) {
+            pending_get_reply(route->context);
+        }
+    } else {
+        pending_delete.building = false;
+        if(pending_delete.active && pending_delete.replies == 0) {
+            pending_delete_reply(route->context);
         }
     }
-    // Send it.
-    app_result = app_message_out_send();
-    app_message_out_release();
-    return app_result;
+    route = outer;
 }
 
-HTTPResult http_cookie_delete_multiple(int32_t request_id, uint32_t* keys, int32_t length) {
-    // Basic setup
-    DictionaryIterator *iter;
-    AppMessageResult app_result = app_message_out_get(&iter);
-    if(app_result != APP_MSG_OK) {
-        return app_result;
+// Sends what is left of a split get or delete, a message at a time, until the queue
+// is full; the rest goes out as earlier messages are acknowledged. A part that can't
+// be sent fails the request through the failure callback, and nothing more is sent.
+static void cookie_keys_continue() {
+    while(pending_keys.active) {
+        RequestType type = pending_keys.type;
+        int32_t next = pending_keys.next;
+        HTTPResult http_result = HTTP_OK;
+        bool failed = type == REQUEST_COOKIE_GET ? pending_get.failed : pending_delete.failed;
+        if(!failed) {
+            http_result = cookie_keys_send(type, pending_keys.app_id, pending_keys.request_id, pending_keys.keys,
+                                           pending_keys.count, false, &next);
+            if(http_result == HTTP_BUSY) return;
+            ++*(type == REQUEST_COOKIE_GET ? &pending_get.replies : &pending_delete.replies);
+        }
+        pending_keys.next = next;
+        if(http_result != HTTP_OK) {
+            report_failure(pending_keys.app_id, type, pending_keys.request_id, 1000 + http_result);
+        }
+        if(failed || http_result != HTTP_OK || pending_keys.next == pending_keys.count) {
+            pending_keys.active = false;
+            cookie_keys_sent(type, pending_keys.app_id);
+        }
     }
-    DictionaryResult dict_result = dict_write_int32(iter, HTTP_COOKIE_DELETE_KEY, request_id);
-    if(dict_result != DICT_OK) {
-        app_message_out_release();
-        return dict_result << 12;
+}
+
+// Builds cookie get or delete messages listing `keys`. Keys that fit in one message
+// are sent at once; longer lists are copied and sent a message at a time, with their
+// replies merged by the caller's pending get or delete.
+static HTTPResult cookie_keys_request(RequestType type, int32_t request_id, uint32_t* keys, int32_t length, bool skip_cached, bool merge) {
+    int32_t count = 0;
+    for(int i = 0; i < length; ++i) {
+        if(!cookie_key_skipped(keys[i], skip_cached)) ++count;
     }
-    dict_result = dict_write_int32(iter, HTTP_APP_ID_KEY, our_app_id);
-    if(dict_result != DICT_OK) {
-        app_message_out_release();
-        return dict_result << 12;
+    if(cookie_keys_chunks(count) <= 1) {
+        int32_t next = 0;
+        HTTPResult http_result = cookie_keys_send(type, our_app_id, request_id, keys, length, skip_cached, &next);
+        if(http_result == HTTP_OK && merge) {
+            ++*(type == REQUEST_COOKIE_GET ? &pending_get.replies : &pending_delete.replies);
+            cookie_keys_sent(type, our_app_id);
+        }
+        return http_result;
     }
-    // Add the keys
+    if(count > HTTP_COOKIE_PENDING_KEYS) return HTTP_NOT_ENOUGH_STORAGE;
+    if(pending_keys.active || outbox_state != OUTBOX_IDLE) return HTTP_BUSY;
+    pending_keys = (PendingKeys){
+        .active = true,
+        .type = type,
+        .app_id = our_app_id,
+        .request_id = request_id,
+    };
     for(int i = 0; i < length; ++i) {
-        dict_result = dict_write_uint8(iter, keys[i], 1);
-        if(dict_result != DICT_OK) {
-            app_message_out_release();
-            return dict_result << 12;
+        if(!cookie_key_skipped(keys[i], skip_cached)) {
+            pending_keys.keys[pending_keys.count++] = keys[i];
         }
     }
-    // Send it.
-    app_result = app_message_out_send();
-    app_message_out_release();
-    return app_result;
+    cookie_keys_continue();
+    return HTTP_OK;
+}
+
+HTTPResult http_cookie_get_multiple(int32_t request_id, uint32_t* keys, int32_t length) {
+    int32_t count = length;
+    bool skip_cached = false;
+#ifdef HTTP_COOKIE_CACHE
+    int32_t misses = cookie_cache_lookup(request_id, keys, length);
+    if(misses == 0) {
+        const AppRoute* outer = route_enter(our_app_id);
+        pending_get_finish(route->context);
+        route = outer;
+        return HTTP_OK;
+    }
+    if(misses > 0) {
+        count = misses;
+        skip_cached = true;
+    }
+#endif
+    http_cookie_flush();
+    // Replies only need merging if the cache contributed or the keys need several messages.
+    bool merge = pending_get.active && pending_get.request_id == request_id;
+    if(!merge && cookie_keys_chunks(count) > 1) {
+        if(!pending_get_begin(request_id)) return HTTP_BUSY;
+        merge = true;
+    }
+    if(!merge) {
+        return cookie_keys_request(REQUEST_COOKIE_GET, request_id, keys, length, skip_cached, false);
+    }
+    pending_get.building = true;
+    HTTPResult http_result = cookie_keys_request(REQUEST_COOKIE_GET, request_id, keys, length, skip_cached, true);
+    if(http_result != HTTP_OK) {
+        pending_get.active = false;
+    }
+    return http_result;
+}
+
+HTTPResult http_cookie_delete_multiple(int32_t request_id, uint32_t* keys, int32_t length) {
+    http_cookie_flush();
+#ifdef HTTP_COOKIE_CACHE
+    for(int i = 0; i < length; ++i) {
+        cookie_cache_remove(keys[i]);
+    }
+#endif
+    if(cookie_keys_chunks(length) <= 1) {
+        return cookie_keys_request(REQUEST_COOKIE_DELETE, request_id, keys, length, false, false);
+    }
+    if(pending_delete.active) return HTTP_BUSY;
+    pending_delete = (PendingDelete){
+        .active = true,
+        .building = true,
+        .request_id = request_id,
+    };
+    HTTPResult http_result = cookie_keys_request(REQUEST_COOKIE_DELETE, request_id, keys, length, false, true);
+    if(http_result != HTTP_OK) {
+        pending_delete.active = false;
+    }
+    return http_result;
 }
 
 HTTPResult http_cookie_fsync() {
+    http_cookie_flush();
     DictionaryIterator *iter;
-    AppMessageResult app_result = app_message_out_get(&iter);
-    if(app_result != APP_MSG_OK) {
-        return app_result;
+    HTTPResult http_result = outbox_begin(REQUEST_COOKIE_FSYNC, 0, &iter);
+    if(http_result != HTTP_OK) {
+        return http_result;
     }
     DictionaryResult dict_result = dict_write_int32(iter, HTTP_APP_ID_KEY, our_app_id);
     if(dict_result != DICT_OK) {
+        outbox_abort();
         return dict_result << 12;
     }
-    app_result = app_message_out_send();
-    app_message_out_release();
-    return app_result;
+    return outbox_commit();
 }
 
 HTTPResult http_cookie_set_int(uint32_t request_id, uint32_t key, const void* integer, uint8_t width_bytes, bool is_signed) {
+#ifdef HTTP_COOKIE_WRITE_BACK
+    if((width_bytes == 1 || width_bytes == 2 || width_bytes == 4)
+       && write_back_stage(request_id, key, is_signed ? TUPLE_INT : TUPLE_UINT, integer, width_bytes)) {
+        return HTTP_OK;
+    }
+#endif
     DictionaryIterator *iter;
     HTTPResult http_result = http_cookie_set_start(request_id, &iter);
     if(http_result != HTTP_OK) {
@@ -428,13 +3894,18 @@ HTTPResult http_cookie_set_int(uint32_t request_id, uint32_t key, const void* in
     }
     DictionaryResult dict_result = dict_write_int(iter, key, integer, width_bytes, is_signed);
     if(dict_result != DICT_OK) {
-        app_message_out_release();
+        outbox_abort();
         return dict_result << 12;
     }
     return http_cookie_set_end();
 }
 
 HTTPResult http_cookie_set_cstring(uint32_t request_id, uint32_t key, const char* value) {
+#ifdef HTTP_COOKIE_WRITE_BACK
+    if(write_back_stage(request_id, key, TUPLE_CSTRING, value, strlen(value) + 1)) {
+        return HTTP_OK;
+    }
+#endif
     DictionaryIterator *iter;
     HTTPResult http_result = http_cookie_set_start(request_id, &iter);
     if(http_result != HTTP_OK) {
@@ -442,13 +3913,18 @@ HTTPResult http_cookie_set_cstring(uint32_t request_id, uint32_t key, const char
     }
     DictionaryResult dict_result = dict_write_cstring(iter, key, value);
     if(dict_result != DICT_OK) {
-        app_message_out_release();
+        outbox_abort();
         return dict_result << 12;
     }
     return http_cookie_set_end();
 }
 
 HTTPResult http_cookie_set_data(uint32_t request_id, uint32_t key, const uint8_t* const value, int length) {
+#ifdef HTTP_COOKIE_WRITE_BACK
+    if(length >= 0 && write_back_stage(request_id, key, TUPLE_BYTE_ARRAY, value, length)) {
+        return HTTP_OK;
+    }
+#endif
     DictionaryIterator *iter;
     HTTPResult http_result = http_cookie_set_start(request_id, &iter);
     if(http_result != HTTP_OK) {
@@ -456,7 +3932,7 @@ HTTPResult http_cookie_set_data(uint32_t request_id, uint32_t key, const uint8_t
     }
     DictionaryResult dict_result = dict_write_data(iter, key, value, length);
     if(dict_result != DICT_OK) {
-        app_message_out_release();
+        outbox_abort();
         return dict_result << 12;
     }
     return http_cookie_set_end();
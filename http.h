@@ -23,6 +23,8 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stddef.h>
+
 #define HTTP_UUID { 0x91, 0x41, 0xB6, 0x28, 0xBC, 0x89, 0x49, 0x8E, 0xB1, 0x47, 0x04, 0x9F, 0x49, 0xC0, 0x99, 0xAD }
 
 // Shared values.
@@ -44,10 +46,86 @@ typedef enum {
     HTTP_INVALID_BRIDGE_RESPONSE        = 1 << 17
 } HTTPResult;
 
+typedef enum {
+    HTTP_PRIORITY_INTERACTIVE,
+    HTTP_PRIORITY_NORMAL,
+    HTTP_PRIORITY_BACKGROUND
+} HTTPPriority;
+
+// Response decoding
+typedef enum {
+    HTTP_FIELD_INT,
+    HTTP_FIELD_UINT,
+    HTTP_FIELD_CSTRING,
+    HTTP_FIELD_DATA
+} HTTPFieldType;
+
+typedef struct {
+    uint32_t key;
+    uint16_t offset;
+    uint8_t type;
+    uint8_t width;
+} HTTPField;
+
+// For use with an X-macro listing (key, type, struct, member) for each field.
+#define HTTP_FIELD(key, type, struct_type, member) \
+    { (key), offsetof(struct_type, member), (type), sizeof(((struct_type*)0)->member) },
+
+// Instrumentation (only collected if http.c is compiled with HTTP_STATS)
+typedef enum {
+    HTTP_STATS_HTTP,
+    HTTP_STATS_COOKIE,
+    HTTP_STATS_TIME,
+    HTTP_STATS_LOCATION,
+    HTTP_STATS_TYPES
+} HTTPStatsType;
+
+// Histogram buckets cover 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63 and 64 or more seconds.
+#define HTTP_STATS_BUCKETS 8
+
+typedef struct {
+    uint16_t sent;
+    uint16_t answered;
+    uint16_t failed;
+    uint16_t retried;
+    uint16_t busy;
+    uint16_t timeouts;
+    uint16_t invalid_responses;
+    uint16_t wait[HTTP_STATS_BUCKETS];
+    uint16_t latency[HTTP_STATS_BUCKETS];
+} HTTPStats;
+
+typedef enum {
+    HTTP_TRACE_BUSY,
+    HTTP_TRACE_QUEUED,
+    HTTP_TRACE_SENT,
+    HTTP_TRACE_ANSWERED,
+    HTTP_TRACE_FAILED,
+    HTTP_TRACE_RETRIED,
+    HTTP_TRACE_JOURNALED
+} HTTPTraceKind;
+
+typedef struct {
+    uint32_t time;
+    int32_t request_id;
+    int32_t status;
+    uint8_t kind;
+    uint8_t type;
+} HTTPTraceEvent;
+
+// Resync on reconnect (only if http.c is compiled with HTTP_RESYNC)
+typedef enum {
+    HTTP_RESYNC_TIME,
+    HTTP_RESYNC_LOCATION,
+    HTTP_RESYNC_COOKIES,
+    HTTP_RESYNC_REQUEST
+} HTTPResyncType;
+
 // HTTP Request callbacks
 typedef void(*HTTPRequestFailedHandler)(int32_t request_id, int http_status, void* context);
 typedef void(*HTTPRequestSucceededHandler)(int32_t request_id, int http_status, DictionaryIterator* sent, void* context);
 typedef void(*HTTPReconnectedHandler)(void* context);
+typedef void(*HTTPResponseFragmentHandler)(int32_t request_id, int http_status, uint16_t index, uint16_t count, DictionaryIterator* fragment, void* context);
 // Local cookie callbacks
 typedef void(*HTTPPhoneCookieBatchGetHandler)(int32_t request_id, DictionaryIterator* result, void* context);
 typedef void(*HTTPPhoneCookieGetHandler)(int32_t request_id, Tuple* result, void* context);
@@ -58,6 +136,10 @@ typedef void(*HTTPPhoneCookieDeleteHandler)(int32_t request_id, bool success, vo
 typedef void(*HTTPTimeHandler)(int32_t utc_offset_seconds, bool is_dst, uint32_t unixtime, const char* tz_name, void* context);
 // Location callback
 typedef void(*HTTPLocationHandler)(float latitude, float longitude, float altitude, float accuracy, void* context);
+// The accuracy http_location_get's handler is given when no location could be had.
+#define HTTP_LOCATION_FAILED -1.0f
+// Resync callback
+typedef HTTPResult(*HTTPResyncHandler)(int32_t request_id, void* context);
 
 // HTTP stuff
 typedef struct {
@@ -71,18 +153,53 @@ typedef struct {
     HTTPPhoneCookieDeleteHandler cookie_delete;
     HTTPTimeHandler time;
     HTTPLocationHandler location;
+    HTTPResponseFragmentHandler fragment;
 } HTTPCallbacks;
 
 // HTTP requests
 HTTPResult http_out_get(const char* url, int32_t request_id, DictionaryIterator **iter_out);
 HTTPResult http_out_send();
+HTTPResult http_out_prepare(DictionaryIterator* iter, uint8_t* buffer, uint16_t size, const char* url, int32_t request_id);
+HTTPResult http_out_send_prepared(const uint8_t* buffer, uint16_t size);
+HTTPResult http_out_stream(uint8_t* buffer, uint16_t size);
+void http_validators_clear();
+uint32_t http_decode(DictionaryIterator* response, const HTTPField* fields, uint8_t count, void* out);
 bool http_register_callbacks(HTTPCallbacks callbacks, void* context);
+bool http_register_app(int32_t app_id, HTTPCallbacks callbacks, void* context);
+void http_unregister_app(int32_t app_id);
+
+// Outbound queue
+uint8_t http_queue_depth();
+uint32_t http_queue_overflows();
+void http_set_priority(HTTPPriority priority);
+uint16_t http_journal_count();
+
+// Instrumentation
+bool http_stats_get(HTTPStatsType type, HTTPStats* stats);
+void http_stats_reset();
+uint8_t http_trace_read(HTTPTraceEvent* events, uint8_t max);
+HTTPResult http_trace_save(int32_t request_id, uint32_t key);
+
+// Resync on reconnect
+HTTPResult http_resync_register(HTTPResyncType type, int32_t request_id, uint32_t max_age, HTTPResyncHandler handler, void* context);
+void http_resync_unregister(HTTPResyncType type, int32_t request_id);
+uint8_t http_resync_pending();
+
+// Batching
+HTTPResult http_batch_begin();
+HTTPResult http_batch_end();
+
+// Timers (request timeouts and other deferred work)
+void http_set_app_context(AppContextRef app_ctx);
+bool http_timer_handler(AppContextRef app_ctx, AppTimerHandle handle, uint32_t cookie);
 
 // Time information
 HTTPResult http_time_request();
+bool http_time_get(int32_t* utc_offset_seconds, bool* is_dst, uint32_t* unixtime, const char** tz_name);
 
 // Location information
 HTTPResult http_location_request();
+HTTPResult http_location_get(uint32_t max_age, float max_accuracy, HTTPLocationHandler handler, void* context);
 
 // Local cookies
 // Basic API
@@ -92,6 +209,9 @@ HTTPResult http_cookie_set_end();
 HTTPResult http_cookie_get_multiple(int32_t request_id, uint32_t* keys, int32_t length);
 HTTPResult http_cookie_delete_multiple(int32_t request_id, uint32_t* keys, int32_t length);
 HTTPResult http_cookie_fsync();
+HTTPResult http_cookie_flush();
+uint32_t http_cookie_cache_hits();
+uint32_t http_cookie_cache_misses();
 // Convenience methods
 HTTPResult http_cookie_set_int(uint32_t request_id, uint32_t key, const void* integer, uint8_t width_bytes, bool is_signed);
 HTTPResult http_cookie_set_cstring(uint32_t request_id, uint32_t key, const char* value);
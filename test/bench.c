@@ -0,0 +1,490 @@
+/*
+ * Benchmarks for http.c on the host, against the fake SDK. Throughput is measured
+ * in the fake's clock, so it reflects the protocol (acknowledgement latency, drops,
+ * retries) rather than the host; dispatch cost is measured in host time, and is
+ * only useful for comparing one build of http.c with another.
+ * RAM is reported by `make bench`, which runs size(1) on the library's object files.
+ * The library is built with memcpy and memmove routed through this file, so that
+ * the bytes it moves can be counted.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "fake_pebble.h"
+#include "http.h"
+
+#define APP_ID 7
+
+#define KEY_URL 0xFFFF
+#define KEY_STATUS 0xFFFE
+#define KEY_COOKIE 0xFFFC
+#define KEY_CONNECT 0xFFFB
+#define KEY_APP_ID 0xFFF2
+#define KEY_COOKIE_LOAD 0xFFF1
+#define KEY_TIME 0xFFF5
+#define KEY_UTC_OFFSET 0xFFF6
+#define KEY_IS_DST 0xFFF7
+#define KEY_TZ_NAME 0xFFF8
+#define KEY_LOCATION 0xFFE0
+#define KEY_LATITUDE 0xFFE1
+#define KEY_LONGITUDE 0xFFE2
+#define KEY_ALTITUDE 0xFFE3
+
+typedef enum {
+    FLOW_HTTP,
+    FLOW_COOKIE,
+    FLOW_TIME,
+    FLOW_LOCATION,
+    FLOW_COUNT
+} Flow;
+
+static const char* flow_names[FLOW_COUNT] = { "http", "cookie", "time", "location" };
+
+static uint32_t completed;
+static uint32_t failed;
+
+// Bytes http.c has moved with memcpy or memmove.
+static uint64_t bytes_moved;
+
+void* bench_memcpy(void* dest, const void* src, size_t n) {
+    bytes_moved += n;
+    return memcpy(dest, src, n);
+}
+
+void* bench_memmove(void* dest, const void* src, size_t n) {
+    bytes_moved += n;
+    return memmove(dest, src, n);
+}
+
+static uint64_t host_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Callbacks only count; they touch the values so the work isn't optimised away.
+static volatile int32_t sink;
+
+static void on_success(int32_t request_id, int http_status, DictionaryIterator* received, void* context) {
+    (void)request_id;
+    (void)context;
+    Tuple* value = dict_find(received, 1);
+    sink = value ? value->value->int32 : http_status;
+    ++completed;
+}
+
+static void on_failure(int32_t request_id, int http_status, void* context) {
+    (void)request_id;
+    (void)http_status;
+    (void)context;
+    ++failed;
+}
+
+static void on_cookie_get(int32_t request_id, Tuple* result, void* context) {
+    (void)request_id;
+    (void)context;
+    sink = result ? result->value->int32 : 0;
+    ++completed;
+}
+
+static void on_time(int32_t utc_offset_seconds, bool is_dst, uint32_t unixtime, const char* tz_name, void* context) {
+    (void)utc_offset_seconds;
+    (void)is_dst;
+    (void)tz_name;
+    (void)context;
+    sink = unixtime;
+    ++completed;
+}
+
+static void on_location(float latitude, float longitude, float altitude, float accuracy, void* context) {
+    (void)longitude;
+    (void)altitude;
+    (void)accuracy;
+    (void)context;
+    sink = (int32_t)latitude;
+    ++completed;
+}
+
+static void begin() {
+    HTTPCallbacks callbacks = {
+        .success = on_success,
+        .failure = on_failure,
+        .cookie_get = on_cookie_get,
+        .time = on_time,
+        .location = on_location,
+    };
+    http_register_callbacks(callbacks, NULL);
+    http_set_app_id(APP_ID);
+    http_set_app_context((AppContextRef)1);
+    completed = 0;
+    failed = 0;
+}
+
+static void write_float(DictionaryIterator* iter, uint32_t key, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    dict_write_uint32(iter, key, bits);
+}
+
+// Writes what the bridge answers to a message from the watch.
+static bool write_answer(DictionaryIterator* sent, DictionaryIterator* answer) {
+    Tuple* tuple;
+    if((tuple = dict_find(sent, KEY_URL))) {
+        Tuple* cookie = dict_find(sent, KEY_COOKIE);
+        dict_write_uint8(answer, KEY_URL, 1);
+        dict_write_int16(answer, KEY_STATUS, 200);
+        dict_write_int32(answer, KEY_COOKIE, cookie ? cookie->value->int32 : 0);
+        dict_write_int32(answer, KEY_APP_ID, APP_ID);
+        dict_write_int32(answer, 1, 42);
+        dict_write_cstring(answer, 2, "a typical short string");
+        return true;
+    }
+    if((tuple = dict_find(sent, KEY_COOKIE_LOAD))) {
+        dict_write_int32(answer, KEY_COOKIE_LOAD, tuple->value->int32);
+        dict_write_int32(answer, KEY_APP_ID, APP_ID);
+        dict_write_int32(answer, 1, 42);
+        return true;
+    }
+    if(dict_find(sent, KEY_TIME)) {
+        dict_write_uint32(answer, KEY_TIME, 1700000000);
+        dict_write_int32(answer, KEY_UTC_OFFSET, 3600);
+        dict_write_uint8(answer, KEY_IS_DST, 0);
+        dict_write_cstring(answer, KEY_TZ_NAME, "Europe/London");
+        return true;
+    }
+    if(dict_find(sent, KEY_LOCATION)) {
+        write_float(answer, KEY_LOCATION, 10);
+        write_float(answer, KEY_LATITUDE, 51.5f);
+        write_float(answer, KEY_LONGITUDE, -0.12f);
+        write_float(answer, KEY_ALTITUDE, 20);
+        return true;
+    }
+    return false;
+}
+
+static void bridge(DictionaryIterator* sent) {
+    if(write_answer(sent, fake_reply_begin())) {
+        fake_reply_send();
+    }
+}
+
+static HTTPResult start(Flow flow, int32_t request_id) {
+    DictionaryIterator* iter;
+    HTTPResult result;
+    switch(flow) {
+    case FLOW_HTTP:
+        result = http_out_get("http://example.com/weather", request_id, &iter);
+        if(result != HTTP_OK) return result;
+        dict_write_int32(iter, 1, request_id);
+        return http_out_send();
+    case FLOW_COOKIE:
+        return http_cookie_get(request_id, 1);
+    case FLOW_TIME:
+        return http_time_request();
+    case FLOW_LOCATION:
+        return http_location_request();
+    default:
+        return HTTP_INVALID_ARGS;
+    }
+}
+
+// Keeps the library as busy as it will let us for a minute of the fake's time, with
+// every message acknowledged after the configured latency and answered by the bridge.
+static void throughput(Flow flow, uint32_t latency_ms, uint16_t drop_per_mille) {
+    fake_config.auto_ack = true;
+    fake_config.ack_latency_ms = latency_ms;
+    fake_config.drop_per_mille = drop_per_mille;
+    fake_bridge = bridge;
+    begin();
+    const uint32_t duration_ms = 60000;
+    uint64_t started = host_ns();
+    int32_t request_id = 1;
+    for(uint32_t elapsed = 0; elapsed < duration_ms; elapsed += 10) {
+        // Some calls are answered locally or join one already on its way, so there
+        // has to be a limit besides HTTP_BUSY.
+        for(int i = 0; i < 8 && start(flow, request_id) == HTTP_OK; ++i) ++request_id;
+        fake_advance(10);
+    }
+    fake_advance(60000);
+    uint64_t spent = host_ns() - started;
+    printf("  %-8s %4lu ms ack, %2u%% dropped: %6.1f answers/s, %4lu failed, %6.0f ns host time per answer\n",
+        flow_names[flow], (unsigned long)latency_ms, drop_per_mille / 10, completed * 1000.0 / duration_ms,
+        (unsigned long)failed, completed ? (double)spent / completed : 0.0);
+    fake_bridge = NULL;
+    fake_config.auto_ack = false;
+}
+
+// Host time to take one answer from the inbox to the app's callback.
+static void dispatch(Flow flow) {
+    begin();
+    static uint8_t sent_buffer[256];
+    DictionaryIterator sent;
+    dict_write_begin(&sent, sent_buffer, sizeof(sent_buffer));
+    switch(flow) {
+    case FLOW_HTTP: dict_write_cstring(&sent, KEY_URL, "http://example.com/"); dict_write_int32(&sent, KEY_COOKIE, 1); break;
+    case FLOW_COOKIE: dict_write_int32(&sent, KEY_COOKIE_LOAD, 1); break;
+    case FLOW_TIME: dict_write_uint8(&sent, KEY_TIME, 1); break;
+    case FLOW_LOCATION: dict_write_uint8(&sent, KEY_LOCATION, 1); break;
+    default: break;
+    }
+    dict_read_begin_from_buffer(&sent, sent_buffer, dict_write_end(&sent));
+    static uint8_t answer_buffer[256];
+    DictionaryIterator answer;
+    dict_write_begin(&answer, answer_buffer, sizeof(answer_buffer));
+    write_answer(&sent, &answer);
+    uint16_t size = dict_write_end(&answer);
+    const uint32_t rounds = 200000;
+    uint64_t tuples_before = fake_tuples_read;
+    uint64_t started = host_ns();
+    for(uint32_t i = 0; i < rounds; ++i) {
+        fake_inject(answer_buffer, size);
+    }
+    uint64_t spent = host_ns() - started;
+    printf("  %-8s %3u bytes: %6.1f ns per message, %4.1f tuples read%s\n", flow_names[flow], size,
+        (double)spent / rounds, (double)(fake_tuples_read - tuples_before) / rounds,
+        completed == rounds ? "" : " (not all delivered)");
+}
+
+// What app_received used to do with an HTTP response before it classified messages
+// in one pass: a dict_find per reserved key it might carry, then the status and
+// cookie, then the app's own lookup.
+static void chain_dispatch(DictionaryIterator* received) {
+    if(dict_find(received, KEY_CONNECT) || dict_find(received, KEY_TIME) || dict_find(received, KEY_LOCATION)) return;
+    Tuple* app_id = dict_find(received, KEY_APP_ID);
+    if(!app_id || app_id->value->int32 != APP_ID || !dict_find(received, KEY_URL)) return;
+    Tuple* status = dict_find(received, KEY_STATUS);
+    Tuple* cookie = dict_find(received, KEY_COOKIE);
+    if(!status || !cookie) return;
+    on_success(cookie->value->int32, status->value->int16, received, NULL);
+}
+
+// Host time to dispatch an HTTP response carrying `values` of the app's own values
+// ahead of the reserved ones, through the library and through the old dict_find chain.
+// The library's time includes the bookkeeping done for every inbound message, which the
+// chain leaves out, so it is behind on the smallest messages.
+static void dispatch_size(uint8_t values) {
+    begin();
+    static uint8_t buffer[1024];
+    DictionaryIterator answer;
+    dict_write_begin(&answer, buffer, sizeof(buffer));
+    for(uint8_t i = 0; i < values; ++i) {
+        dict_write_int32(&answer, 100 + i, i);
+    }
+    dict_write_int32(&answer, 1, 42);
+    dict_write_uint8(&answer, KEY_URL, 1);
+    dict_write_int16(&answer, KEY_STATUS, 200);
+    dict_write_int32(&answer, KEY_COOKIE, 1);
+    dict_write_int32(&answer, KEY_APP_ID, APP_ID);
+    uint16_t size = dict_write_end(&answer);
+    fake_config.inbox_size = sizeof(buffer);
+    const uint32_t rounds = 100000;
+    uint64_t tuples_before = fake_tuples_read;
+    uint64_t started = host_ns();
+    for(uint32_t i = 0; i < rounds; ++i) {
+        fake_inject(buffer, size);
+    }
+    uint64_t spent = host_ns() - started;
+    double tuples = (double)(fake_tuples_read - tuples_before) / rounds;
+    bool delivered = completed == rounds;
+    tuples_before = fake_tuples_read;
+    started = host_ns();
+    for(uint32_t i = 0; i < rounds; ++i) {
+        DictionaryIterator received;
+        dict_read_begin_from_buffer(&received, buffer, size);
+        chain_dispatch(&received);
+    }
+    uint64_t chain_spent = host_ns() - started;
+    printf("  %3u values, %4u bytes: %7.1f ns, %5.1f tuples read; dict_find chain %7.1f ns, %5.1f tuples read%s\n",
+        values + 1, size, (double)spent / rounds, tuples, (double)chain_spent / rounds,
+        (double)(fake_tuples_read - tuples_before) / rounds, delivered ? "" : " (not all delivered)");
+    fake_config.inbox_size = 256;
+}
+
+typedef enum {
+    COPY_DIRECT,
+    COPY_QUEUED,
+    COPY_RETRIED,
+    COPY_PREPARED,
+    COPY_PREPARED_QUEUED,
+    COPY_COUNT
+} CopyPath;
+
+static const char* copy_names[COPY_COUNT] = { "direct", "queued", "retried", "prepared", "prepared, queued" };
+
+static void send_request(int32_t request_id) {
+    DictionaryIterator* iter;
+    if(http_out_get("http://example.com/weather", request_id, &iter) != HTTP_OK) return;
+    dict_write_int32(iter, 1, request_id);
+    dict_write_cstring(iter, 2, "a typical short string");
+    http_out_send();
+}
+
+// What the library used to do each time it moved a message: write it out again
+// tuple by tuple.
+static void rebuild(const uint8_t* message, uint16_t size) {
+    static uint8_t buffer[256];
+    DictionaryIterator source, copy;
+    dict_write_begin(&copy, buffer, sizeof(buffer));
+    for(Tuple* tuple = dict_read_begin_from_buffer(&source, message, size); tuple; tuple = dict_read_next(&source)) {
+        switch(tuple->type) {
+        case TUPLE_BYTE_ARRAY: dict_write_data(&copy, tuple->key, tuple->value->data, tuple->length); break;
+        case TUPLE_CSTRING: dict_write_cstring(&copy, tuple->key, tuple->value->cstring); break;
+        default: dict_write_int(&copy, tuple->key, tuple->value, tuple->length, tuple->type == TUPLE_INT); break;
+        }
+    }
+}
+
+// Bytes written while counting: serialized tuple by tuple, and moved whole.
+static uint64_t serialized_total;
+static uint64_t moved_total;
+static uint64_t serialized_at;
+static uint64_t moved_at;
+
+static void count_begin() {
+    serialized_at = fake_bytes_serialized;
+    moved_at = bytes_moved;
+}
+
+static void count_end() {
+    serialized_total += fake_bytes_serialized - serialized_at;
+    moved_total += bytes_moved - moved_at;
+}
+
+static uint16_t prepare_request(uint8_t* buffer, uint16_t size) {
+    DictionaryIterator iter;
+    http_out_prepare(&iter, buffer, size, "http://example.com/weather", 1);
+    dict_write_int32(&iter, 1, 1);
+    dict_write_cstring(&iter, 2, "a typical short string");
+    return dict_write_end(&iter);
+}
+
+static void answer_last_sent() {
+    uint16_t size;
+    const uint8_t* sent = fake_last_sent(&size);
+    DictionaryIterator iter;
+    dict_read_begin_from_buffer(&iter, sent, size);
+    if(write_answer(&iter, fake_reply_begin())) {
+        fake_reply_send();
+    }
+}
+
+// Bytes written for a request from the app's first write until it leaves the outbox.
+// Before is the same path with each move done as a rebuild, as the library used to,
+// and with a prepared request built afresh for every send.
+static void copies(CopyPath path) {
+    begin();
+    const uint16_t sends = path == COPY_PREPARED ? 10 : 1;
+    uint16_t moves = 0;
+    uint32_t expected_sends = sends;
+    uint32_t sent_before = fake_sent_count;
+    serialized_total = 0;
+    moved_total = 0;
+    switch(path) {
+    case COPY_DIRECT:
+        count_begin();
+        send_request(1);
+        count_end();
+        break;
+    case COPY_QUEUED:
+        // Something already on its way, so the request waits in the queue.
+        send_request(100);
+        count_begin();
+        send_request(1);
+        fake_ack();
+        count_end();
+        expected_sends = 2;
+        moves = 1;
+        break;
+    case COPY_RETRIED:
+        count_begin();
+        send_request(1);
+        fake_nack(APP_MSG_SEND_TIMEOUT);
+        fake_advance(10000);
+        count_end();
+        // Into a queue slot, then into the outbox.
+        expected_sends = 2;
+        moves = 2;
+        break;
+    case COPY_PREPARED: {
+        static uint8_t buffer[128];
+        count_begin();
+        uint16_t size = prepare_request(buffer, sizeof(buffer));
+        count_end();
+        for(uint16_t i = 0; i < sends; ++i) {
+            count_begin();
+            http_out_send_prepared(buffer, size);
+            count_end();
+            fake_ack();
+            answer_last_sent();
+        }
+        break;
+    }
+    case COPY_PREPARED_QUEUED: {
+        // Copied into a queue slot, then into the outbox; the rebuild would build it
+        // in the slot and rebuild it in the outbox.
+        static uint8_t buffer[128];
+        send_request(100);
+        count_begin();
+        http_out_send_prepared(buffer, prepare_request(buffer, sizeof(buffer)));
+        fake_ack();
+        count_end();
+        expected_sends = 2;
+        moves = 1;
+        break;
+    }
+    default:
+        break;
+    }
+    bool complete = fake_sent_count - sent_before == expected_sends;
+    uint16_t size;
+    const uint8_t* sent = fake_last_sent(&size);
+    uint64_t serialized = serialized_total;
+    uint64_t moved = moved_total;
+    uint64_t before_start = fake_bytes_serialized;
+    for(uint16_t i = 0; i < moves; ++i) {
+        rebuild(sent, size);
+    }
+    uint64_t before = serialized + fake_bytes_serialized - before_start;
+    if(path == COPY_PREPARED) {
+        serialized_total = 0;
+        moved_total = 0;
+        for(uint16_t i = 0; i < sends; ++i) {
+            count_begin();
+            send_request(1);
+            count_end();
+            fake_ack();
+            answer_last_sent();
+        }
+        before = serialized_total + moved_total;
+    }
+    printf("  %-16s %3u-byte request: %4.0f serialized + %4.0f moved, before %4.0f%s\n",
+        copy_names[path], size, (double)serialized / sends, (double)moved / sends, (double)before / sends,
+        complete ? "" : " (not all sent)");
+    fake_ack();
+    fake_advance(60000);
+}
+
+int main() {
+    printf("Throughput (fake clock):\n");
+    for(Flow flow = 0; flow < FLOW_COUNT; ++flow) {
+        throughput(flow, 50, 0);
+    }
+    throughput(FLOW_HTTP, 200, 0);
+    throughput(FLOW_HTTP, 50, 50);
+    printf("Dispatch (host clock):\n");
+    for(Flow flow = 0; flow < FLOW_COUNT; ++flow) {
+        dispatch(flow);
+    }
+    printf("Dispatch by size (host clock):\n");
+    static const uint8_t sizes[] = { 0, 4, 16, 64 };
+    for(size_t i = 0; i < sizeof(sizes); ++i) {
+        dispatch_size(sizes[i]);
+    }
+    printf("Bytes written per send:\n");
+    for(CopyPath path = 0; path < COPY_COUNT; ++path) {
+        copies(path);
+    }
+    return 0;
+}
@@ -0,0 +1,379 @@
+/*
+ * In-process fake of the Pebble SDK's Dictionary, AppMessage, clock and timer APIs.
+ * Dictionaries use the firmware's wire layout: a count byte followed by packed tuples.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "fake_pebble.h"
+#include "http.h"
+
+FakeConfig fake_config = {
+    .outbox_size = 256,
+    .inbox_size = 256,
+    .ack_latency_ms = 50,
+    .seed = 1,
+};
+
+void (*fake_bridge)(DictionaryIterator* sent);
+uint64_t fake_now_ms = 1000000000ULL;
+int64_t fake_clock_offset_ms;
+uint32_t fake_sent_count;
+uint32_t fake_dropped_count;
+uint64_t fake_tuples_read;
+uint64_t fake_bytes_serialized;
+
+// Dictionary
+DictionaryResult dict_write_begin(DictionaryIterator* iter, uint8_t* const buffer, const uint16_t size) {
+    if(!iter || !buffer || size < 1) return DICT_INVALID_ARGS;
+    iter->dictionary = (Dictionary*)buffer;
+    iter->end = buffer + size;
+    iter->cursor = (Tuple*)(buffer + 1);
+    buffer[0] = 0;
+    return DICT_OK;
+}
+
+static DictionaryResult dict_put(DictionaryIterator* iter, uint32_t key, TupleType type, const void* data, uint16_t length) {
+    uint8_t* at = (uint8_t*)iter->cursor;
+    if(at + sizeof(Tuple) + length > (const uint8_t*)iter->end) return DICT_NOT_ENOUGH_STORAGE;
+    Tuple* tuple = (Tuple*)at;
+    tuple->key = key;
+    tuple->type = type;
+    tuple->length = length;
+    memcpy(tuple->value->data, data, length);
+    iter->cursor = (Tuple*)(at + sizeof(Tuple) + length);
+    ++*(uint8_t*)iter->dictionary;
+    fake_bytes_serialized += sizeof(Tuple) + length;
+    return DICT_OK;
+}
+
+DictionaryResult dict_write_data(DictionaryIterator* iter, const uint32_t key, const uint8_t* const data, const uint16_t size) {
+    return dict_put(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult dict_write_cstring(DictionaryIterator* iter, const uint32_t key, const char* const cstring) {
+    return dict_put(iter, key, TUPLE_CSTRING, cstring, strlen(cstring) + 1);
+}
+
+DictionaryResult dict_write_int(DictionaryIterator* iter, const uint32_t key, const void* integer, const uint8_t width_bytes, const bool is_signed) {
+    if(width_bytes != 1 && width_bytes != 2 && width_bytes != 4) return DICT_INVALID_ARGS;
+    return dict_put(iter, key, is_signed ? TUPLE_INT : TUPLE_UINT, integer, width_bytes);
+}
+
+DictionaryResult dict_write_uint8(DictionaryIterator* iter, const uint32_t key, const uint8_t value) {
+    return dict_write_int(iter, key, &value, 1, false);
+}
+DictionaryResult dict_write_uint16(DictionaryIterator* iter, const uint32_t key, const uint16_t value) {
+    return dict_write_int(iter, key, &value, 2, false);
+}
+DictionaryResult dict_write_uint32(DictionaryIterator* iter, const uint32_t key, const uint32_t value) {
+    return dict_write_int(iter, key, &value, 4, false);
+}
+DictionaryResult dict_write_int8(DictionaryIterator* iter, const uint32_t key, const int8_t value) {
+    return dict_write_int(iter, key, &value, 1, true);
+}
+DictionaryResult dict_write_int16(DictionaryIterator* iter, const uint32_t key, const int16_t value) {
+    return dict_write_int(iter, key, &value, 2, true);
+}
+DictionaryResult dict_write_int32(DictionaryIterator* iter, const uint32_t key, const int32_t value) {
+    return dict_write_int(iter, key, &value, 4, true);
+}
+
+uint32_t dict_write_end(DictionaryIterator* iter) {
+    iter->end = iter->cursor;
+    return (uint8_t*)iter->cursor - (uint8_t*)iter->dictionary;
+}
+
+// Like the firmware, reading stops at a tuple whose header doesn't fit; the value's
+// length is the reader's business.
+static Tuple* dict_read_at(DictionaryIterator* iter, uint8_t* at) {
+    iter->cursor = (Tuple*)at;
+    if(at + sizeof(Tuple) > (const uint8_t*)iter->end) return NULL;
+    ++fake_tuples_read;
+    return iter->cursor;
+}
+
+Tuple* dict_read_first(DictionaryIterator* iter) {
+    uint8_t* start = (uint8_t*)iter->dictionary;
+    if((const uint8_t*)iter->end <= start || start[0] == 0) {
+        iter->cursor = (Tuple*)(start + 1);
+        return NULL;
+    }
+    return dict_read_at(iter, start + 1);
+}
+
+Tuple* dict_read_next(DictionaryIterator* iter) {
+    uint8_t* at = (uint8_t*)iter->cursor;
+    if(at + sizeof(Tuple) > (const uint8_t*)iter->end) return NULL;
+    return dict_read_at(iter, at + sizeof(Tuple) + iter->cursor->length);
+}
+
+Tuple* dict_read_begin_from_buffer(DictionaryIterator* iter, const uint8_t* const buffer, const uint16_t size) {
+    iter->dictionary = (Dictionary*)buffer;
+    iter->end = buffer + size;
+    return dict_read_first(iter);
+}
+
+Tuple* dict_find(const DictionaryIterator* iter, const uint32_t key) {
+    DictionaryIterator copy = *iter;
+    for(Tuple* tuple = dict_read_first(&copy); tuple; tuple = dict_read_next(&copy)) {
+        if(tuple->key == key) return tuple;
+    }
+    return NULL;
+}
+
+uint32_t dict_calc_buffer_size(const uint8_t tuple_count, ...) {
+    va_list sizes;
+    va_start(sizes, tuple_count);
+    uint32_t total = 1 + tuple_count * sizeof(Tuple);
+    for(int i = 0; i < tuple_count; ++i) {
+        total += va_arg(sizes, uint32_t);
+    }
+    va_end(sizes);
+    return total;
+}
+
+// AppMessage. There is one outbox; a sent message stays in flight until it is
+// acknowledged, by hand or after ack_latency_ms with auto_ack.
+static AppMessageCallbacksNode* callbacks;
+static uint8_t outbox[1024];
+static DictionaryIterator outbox_iter;
+static bool outbox_taken;
+static bool in_flight;
+static uint64_t ack_due_ms;
+static bool ack_drops;
+static uint8_t last_sent[1024];
+static uint16_t last_sent_size;
+static uint32_t drop_seed;
+
+AppMessageResult app_message_register_callbacks(AppMessageCallbacksNode* callbacks_node) {
+    if(callbacks) return APP_MSG_CALLBACK_ALREADY_REGISTERED;
+    callbacks = callbacks_node;
+    return APP_MSG_OK;
+}
+
+AppMessageResult app_message_deregister_callbacks(AppMessageCallbacksNode* callbacks_node) {
+    if(callbacks != callbacks_node) return APP_MSG_CALLBACK_NOT_REGISTERED;
+    callbacks = NULL;
+    return APP_MSG_OK;
+}
+
+AppMessageResult app_message_out_get(DictionaryIterator** iter_out) {
+    if(outbox_taken || in_flight) return APP_MSG_BUSY;
+    uint16_t size = fake_config.outbox_size < sizeof(outbox) ? fake_config.outbox_size : sizeof(outbox);
+    dict_write_begin(&outbox_iter, outbox, size);
+    outbox_taken = true;
+    *iter_out = &outbox_iter;
+    return APP_MSG_OK;
+}
+
+static bool drop_next() {
+    if(drop_seed == 0) {
+        drop_seed = fake_config.seed ? fake_config.seed : 1;
+    }
+    drop_seed = drop_seed * 1103515245 + 12345;
+    return (drop_seed >> 16) % 1000 < fake_config.drop_per_mille;
+}
+
+AppMessageResult app_message_out_send(void) {
+    if(!outbox_taken || in_flight) return APP_MSG_BUSY;
+    last_sent_size = dict_write_end(&outbox_iter);
+    memcpy(last_sent, outbox, last_sent_size);
+    in_flight = true;
+    ++fake_sent_count;
+    if(fake_config.auto_ack) {
+        ack_due_ms = fake_now_ms + fake_config.ack_latency_ms;
+        ack_drops = drop_next();
+    }
+    return APP_MSG_OK;
+}
+
+AppMessageResult app_message_out_release(void) {
+    if(!outbox_taken) return APP_MSG_ALREADY_RELEASED;
+    outbox_taken = false;
+    return APP_MSG_OK;
+}
+
+bool fake_in_flight() {
+    return in_flight;
+}
+
+void fake_ack() {
+    if(!in_flight) return;
+    in_flight = false;
+    // The library may send something else from its callback, so the bridge sees a copy.
+    uint8_t copy[sizeof(last_sent)];
+    uint16_t size = last_sent_size;
+    memcpy(copy, last_sent, size);
+    DictionaryIterator sent;
+    dict_read_begin_from_buffer(&sent, last_sent, last_sent_size);
+    if(callbacks && callbacks->callbacks.out_sent) {
+        callbacks->callbacks.out_sent(&sent, callbacks->context);
+    }
+    if(fake_bridge) {
+        dict_read_begin_from_buffer(&sent, copy, size);
+        fake_bridge(&sent);
+    }
+}
+
+void fake_nack(AppMessageResult reason) {
+    if(!in_flight) return;
+    in_flight = false;
+    DictionaryIterator failed;
+    dict_read_begin_from_buffer(&failed, last_sent, last_sent_size);
+    if(callbacks && callbacks->callbacks.out_failed) {
+        callbacks->callbacks.out_failed(&failed, reason, callbacks->context);
+    }
+}
+
+const uint8_t* fake_last_sent(uint16_t* size) {
+    if(size) *size = last_sent_size;
+    return last_sent;
+}
+
+Tuple* fake_sent_find(uint32_t key) {
+    DictionaryIterator sent;
+    dict_read_begin_from_buffer(&sent, last_sent, last_sent_size);
+    return dict_find(&sent, key);
+}
+
+uint8_t fake_sent_tuples() {
+    return last_sent_size ? last_sent[0] : 0;
+}
+
+static uint8_t reply[1024];
+static DictionaryIterator reply_iter;
+
+DictionaryIterator* fake_reply_begin() {
+    dict_write_begin(&reply_iter, reply, sizeof(reply));
+    return &reply_iter;
+}
+
+void fake_reply_send() {
+    uint16_t size = dict_write_end(&reply_iter);
+    // Delivered from a copy, so a handler may start the next reply.
+    uint8_t copy[sizeof(reply)];
+    memcpy(copy, reply, size);
+    fake_inject(copy, size);
+}
+
+void fake_inject(const uint8_t* buffer, uint16_t size) {
+    if(!callbacks) return;
+    if(size > fake_config.inbox_size) {
+        ++fake_dropped_count;
+        if(callbacks->callbacks.in_dropped) {
+            callbacks->callbacks.in_dropped(callbacks->context, APP_MSG_BUFFER_OVERFLOW);
+        }
+        return;
+    }
+    DictionaryIterator received;
+    dict_read_begin_from_buffer(&received, buffer, size);
+    if(callbacks->callbacks.in_received) {
+        callbacks->callbacks.in_received(&received, callbacks->context);
+    }
+}
+
+void fake_reconnect() {
+    dict_write_uint8(fake_reply_begin(), 0xFFFB, 1);
+    fake_reply_send();
+}
+
+// Time and timers
+void get_time(PblTm* time) {
+    uint32_t seconds = (fake_now_ms + fake_clock_offset_ms) / 1000;
+    uint32_t days = seconds / 86400;
+    memset(time, 0, sizeof(*time));
+    time->tm_sec = seconds % 60;
+    time->tm_min = seconds / 60 % 60;
+    time->tm_hour = seconds / 3600 % 24;
+    time->tm_wday = (days + 4) % 7;
+    int year = 1970;
+    for(;;) {
+        uint32_t length = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0) ? 366 : 365;
+        if(days < length) break;
+        days -= length;
+        ++year;
+    }
+    time->tm_year = year - 1900;
+    time->tm_yday = days;
+}
+
+#define FAKE_TIMERS 8
+
+typedef struct {
+    AppTimerHandle handle;
+    uint64_t due_ms;
+    uint32_t cookie;
+    AppContextRef context;
+} FakeTimer;
+
+static FakeTimer timers[FAKE_TIMERS];
+static AppTimerHandle next_handle;
+
+AppTimerHandle app_timer_send_event(AppContextRef app_ctx, uint32_t timeout_ms, uint32_t cookie) {
+    for(int i = 0; i < FAKE_TIMERS; ++i) {
+        if(timers[i].handle) continue;
+        timers[i] = (FakeTimer){
+            .handle = ++next_handle,
+            .due_ms = fake_now_ms + timeout_ms,
+            .cookie = cookie,
+            .context = app_ctx,
+        };
+        return timers[i].handle;
+    }
+    return 0;
+}
+
+bool app_timer_cancel_event(AppContextRef app_ctx_ref, AppTimerHandle handle) {
+    (void)app_ctx_ref;
+    for(int i = 0; i < FAKE_TIMERS; ++i) {
+        if(handle && timers[i].handle == handle) {
+            timers[i].handle = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fires the earliest timer that is due, as the app's timer handler would pass it on.
+static bool fire_timer() {
+    FakeTimer* due = NULL;
+    for(int i = 0; i < FAKE_TIMERS; ++i) {
+        if(timers[i].handle && timers[i].due_ms <= fake_now_ms && (!due || timers[i].due_ms < due->due_ms)) {
+            due = &timers[i];
+        }
+    }
+    if(!due) return false;
+    FakeTimer timer = *due;
+    due->handle = 0;
+    http_timer_handler(timer.context, timer.handle, timer.cookie);
+    return true;
+}
+
+void fake_advance(uint32_t ms) {
+    uint64_t until = fake_now_ms + ms;
+    do {
+        // Step to the next thing that happens, so events keep their order.
+        uint64_t next = until;
+        if(in_flight && fake_config.auto_ack && ack_due_ms < next) {
+            next = ack_due_ms;
+        }
+        for(int i = 0; i < FAKE_TIMERS; ++i) {
+            if(timers[i].handle && timers[i].due_ms < next) {
+                next = timers[i].due_ms;
+            }
+        }
+        if(next > fake_now_ms) {
+            fake_now_ms = next;
+        }
+        if(in_flight && fake_config.auto_ack && ack_due_ms <= fake_now_ms) {
+            if(ack_drops) {
+                fake_nack(APP_MSG_SEND_TIMEOUT);
+            } else {
+                fake_ack();
+            }
+        }
+        while(fire_timer()) {}
+    } while(fake_now_ms < until);
+}
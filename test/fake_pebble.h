@@ -0,0 +1,61 @@
+/*
+ * Controls for the in-process fake of the Pebble SDK that http.c is linked against
+ * on the host. The watch's clock, the phone's acknowledgements and the bridge's
+ * replies are all driven from here.
+ */
+
+#ifndef FAKE_PEBBLE_H
+#define FAKE_PEBBLE_H
+
+#include "pebble_os.h"
+
+typedef struct {
+    uint16_t outbox_size;    // Bytes app_message_out_get hands out.
+    uint16_t inbox_size;     // Larger inbound messages are dropped with APP_MSG_BUFFER_OVERFLOW.
+    bool auto_ack;           // Acknowledge (or drop) each send after ack_latency_ms on its own.
+    uint32_t ack_latency_ms;
+    uint16_t drop_per_mille; // With auto_ack, the share of sends that time out instead.
+    uint32_t seed;           // For the drop decisions, so runs are repeatable.
+} FakeConfig;
+
+// Change before the first send; the defaults are 256-byte boxes and manual acks.
+extern FakeConfig fake_config;
+
+// Called with every message the phone acknowledges, after the library has been told.
+// A model of the bridge can answer it from here with fake_reply_begin/fake_reply_send.
+extern void (*fake_bridge)(DictionaryIterator* sent);
+
+// The watch's clock, in milliseconds. get_time reports whole seconds of it.
+extern uint64_t fake_now_ms;
+
+// Added to what get_time reports, as when the watch's time or time zone is changed.
+// Timers and acknowledgements keep to fake_now_ms.
+extern int64_t fake_clock_offset_ms;
+
+// Moves the clock on, delivering acknowledgements and timer events that fall due.
+void fake_advance(uint32_t ms);
+
+// Manual acknowledgement of the message in flight, for tests without auto_ack.
+bool fake_in_flight();
+void fake_ack();
+void fake_nack(AppMessageResult reason);
+
+// What has been sent.
+extern uint32_t fake_sent_count;
+const uint8_t* fake_last_sent(uint16_t* size);
+Tuple* fake_sent_find(uint32_t key);
+uint8_t fake_sent_tuples();
+
+// Inbound messages. fake_reply_begin returns an iterator over a scratch buffer to
+// write the message into; fake_reply_send delivers it as if from the phone.
+DictionaryIterator* fake_reply_begin();
+void fake_reply_send();
+void fake_inject(const uint8_t* buffer, uint16_t size);
+void fake_reconnect();
+extern uint32_t fake_dropped_count;
+
+// Work done through the Dictionary API, for benchmarks.
+extern uint64_t fake_tuples_read;
+extern uint64_t fake_bytes_serialized;
+
+#endif
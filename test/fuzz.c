@@ -0,0 +1,147 @@
+/*
+ * Feeds http.c random inbound messages: any mix of reserved keys, of any type and
+ * width, often cut off at a random point. Each message is delivered from a heap block
+ * of exactly its size, so that under ASan any read past its end is caught. The
+ * callbacks walk everything they are given, as an app would.
+ *
+ *   build/fuzz [messages] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fake_pebble.h"
+#include "http.h"
+
+#define APP_ID 7
+
+static volatile uint8_t sink;
+
+static void walk(DictionaryIterator* received) {
+    for(Tuple* tuple = dict_read_first(received); tuple; tuple = dict_read_next(received)) {
+        if(tuple->length) sink = tuple->value->data[tuple->length - 1];
+    }
+}
+
+static void on_success(int32_t request_id, int http_status, DictionaryIterator* received, void* context) {
+    (void)request_id;
+    (void)http_status;
+    (void)context;
+    walk(received);
+}
+
+static void on_failure(int32_t request_id, int http_status, void* context) {
+    (void)request_id;
+    (void)http_status;
+    (void)context;
+}
+
+static void on_cookie_get(int32_t request_id, Tuple* result, void* context) {
+    (void)request_id;
+    (void)context;
+    if(result && result->length) sink = result->value->data[result->length - 1];
+}
+
+static void on_cookie_batch_get(int32_t request_id, DictionaryIterator* result, void* context) {
+    (void)request_id;
+    (void)context;
+    walk(result);
+}
+
+static void on_time(int32_t utc_offset_seconds, bool is_dst, uint32_t unixtime, const char* tz_name, void* context) {
+    (void)utc_offset_seconds;
+    (void)is_dst;
+    (void)unixtime;
+    (void)context;
+    sink = strlen(tz_name);
+}
+
+static void on_fragment(int32_t request_id, int http_status, uint16_t index, uint16_t count, DictionaryIterator* received, void* context) {
+    (void)request_id;
+    (void)http_status;
+    (void)index;
+    (void)count;
+    (void)context;
+    walk(received);
+}
+
+// Every reserved key the library reads, and two of the app's own.
+static const uint32_t keys[] = {
+    0xFFFF, 0xFFFE, 0xFFFC, 0xFFFB, 0xFFF0, 0xFFF1, 0xFFF2, 0xFFF3, 0xFFF4, 0xFFF5, 0xFFF6, 0xFFF7, 0xFFF8,
+    0xFFE0, 0xFFE1, 0xFFE2, 0xFFE3, 0xFFD0, 0xFFD1, 0xFFD2, 0xFFD3, 0xFFD4, 0xFFD5, 0xFFD6, 0xFFC0, 0xFFC1,
+    1, 2,
+};
+
+static void write_random_value(DictionaryIterator* iter) {
+    uint32_t key = keys[rand() % (sizeof(keys) / sizeof(keys[0]))];
+    // Mostly the right app id, so messages get past routing.
+    if(key == 0xFFF2 && rand() % 4) {
+        dict_write_int32(iter, key, APP_ID);
+        return;
+    }
+    uint8_t data[24];
+    for(size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = rand();
+    }
+    switch(rand() % 4) {
+    case 0:
+        dict_write_data(iter, key, data, rand() % sizeof(data));
+        break;
+    case 1:
+        data[rand() % (sizeof(data) - 1)] = 0;
+        data[sizeof(data) - 1] = 0;
+        dict_write_cstring(iter, key, (const char*)data);
+        break;
+    default:
+        dict_write_int(iter, key, data, 1 << (rand() % 3), rand() % 2);
+        break;
+    }
+}
+
+int main(int argc, char** argv) {
+    long messages = argc > 1 ? atol(argv[1]) : 100000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    HTTPCallbacks callbacks = {
+        .success = on_success,
+        .failure = on_failure,
+        .cookie_get = on_cookie_get,
+        .cookie_batch_get = on_cookie_batch_get,
+        .time = on_time,
+        .fragment = on_fragment,
+    };
+    http_register_callbacks(callbacks, NULL);
+    http_set_app_id(APP_ID);
+    http_set_app_context((AppContextRef)1);
+    clock_t started = clock();
+    for(long i = 0; i < messages; ++i) {
+        uint8_t buffer[256];
+        DictionaryIterator iter;
+        dict_write_begin(&iter, buffer, sizeof(buffer));
+        int count = rand() % 8;
+        for(int j = 0; j < count; ++j) {
+            write_random_value(&iter);
+        }
+        uint16_t size = dict_write_end(&iter);
+        if(rand() % 3 == 0 && size > 1) {
+            size = 1 + rand() % (size - 1);
+        }
+        uint8_t* exact = malloc(size);
+        memcpy(exact, buffer, size);
+        fake_inject(exact, size);
+        free(exact);
+        // Keep some requests in flight for the responses to answer.
+        if(i % 16 == 0) {
+            DictionaryIterator* out;
+            if(http_out_get("http://example.com/", i % 64, &out) == HTTP_OK) {
+                http_out_send();
+            }
+            fake_ack();
+            fake_advance(1000);
+        }
+    }
+    double seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+    printf("%ld messages, %.0f messages/s\n", messages, messages / seconds);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Host stand-in for the parts of the Pebble SDK 1.x headers that http.c uses.
+ * The implementations, and the knobs for driving them, are in fake_pebble.c.
+ */
+
+#ifndef PEBBLE_OS_H
+#define PEBBLE_OS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Dictionary
+typedef enum {
+    TUPLE_BYTE_ARRAY = 0,
+    TUPLE_CSTRING = 1,
+    TUPLE_UINT = 2,
+    TUPLE_INT = 3,
+} TupleType;
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t key;
+    TupleType type:8;
+    uint16_t length;
+    union {
+        uint8_t data[0];
+        char cstring[0];
+        uint8_t uint8;
+        uint16_t uint16;
+        uint32_t uint32;
+        int8_t int8;
+        int16_t int16;
+        int32_t int32;
+    } value[];
+} Tuple;
+
+struct Dictionary;
+typedef struct Dictionary Dictionary;
+
+typedef struct {
+    Dictionary* dictionary;
+    const void* end;
+    Tuple* cursor;
+} DictionaryIterator;
+
+typedef enum {
+    DICT_OK = 0,
+    DICT_NOT_ENOUGH_STORAGE = 1 << 1,
+    DICT_INVALID_ARGS = 1 << 2,
+    DICT_INTERNAL_INCONSISTENCY = 1 << 3,
+} DictionaryResult;
+
+DictionaryResult dict_write_begin(DictionaryIterator* iter, uint8_t* const buffer, const uint16_t size);
+DictionaryResult dict_write_data(DictionaryIterator* iter, const uint32_t key, const uint8_t* const data, const uint16_t size);
+DictionaryResult dict_write_cstring(DictionaryIterator* iter, const uint32_t key, const char* const cstring);
+DictionaryResult dict_write_int(DictionaryIterator* iter, const uint32_t key, const void* integer, const uint8_t width_bytes, const bool is_signed);
+DictionaryResult dict_write_uint8(DictionaryIterator* iter, const uint32_t key, const uint8_t value);
+DictionaryResult dict_write_uint16(DictionaryIterator* iter, const uint32_t key, const uint16_t value);
+DictionaryResult dict_write_uint32(DictionaryIterator* iter, const uint32_t key, const uint32_t value);
+DictionaryResult dict_write_int8(DictionaryIterator* iter, const uint32_t key, const int8_t value);
+DictionaryResult dict_write_int16(DictionaryIterator* iter, const uint32_t key, const int16_t value);
+DictionaryResult dict_write_int32(DictionaryIterator* iter, const uint32_t key, const int32_t value);
+uint32_t dict_write_end(DictionaryIterator* iter);
+Tuple* dict_read_begin_from_buffer(DictionaryIterator* iter, const uint8_t* const buffer, const uint16_t size);
+Tuple* dict_read_first(DictionaryIterator* iter);
+Tuple* dict_read_next(DictionaryIterator* iter);
+Tuple* dict_find(const DictionaryIterator* iter, const uint32_t key);
+uint32_t dict_calc_buffer_size(const uint8_t tuple_count, ...);
+
+// AppMessage
+typedef enum {
+    APP_MSG_OK = 0,
+    APP_MSG_SEND_TIMEOUT = 1 << 1,
+    APP_MSG_SEND_REJECTED = 1 << 2,
+    APP_MSG_NOT_CONNECTED = 1 << 3,
+    APP_MSG_APP_NOT_RUNNING = 1 << 4,
+    APP_MSG_INVALID_ARGS = 1 << 5,
+    APP_MSG_BUSY = 1 << 6,
+    APP_MSG_BUFFER_OVERFLOW = 1 << 7,
+    APP_MSG_ALREADY_RELEASED = 1 << 9,
+    APP_MSG_CALLBACK_ALREADY_REGISTERED = 1 << 10,
+    APP_MSG_CALLBACK_NOT_REGISTERED = 1 << 11,
+} AppMessageResult;
+
+typedef void (*AppMessageOutboundSent)(DictionaryIterator* sent, void* context);
+typedef void (*AppMessageOutboundFailed)(DictionaryIterator* failed, AppMessageResult reason, void* context);
+typedef void (*AppMessageInboundReceived)(DictionaryIterator* received, void* context);
+typedef void (*AppMessageInboundDropped)(void* context, AppMessageResult reason);
+
+typedef struct {
+    AppMessageOutboundSent out_sent;
+    AppMessageOutboundFailed out_failed;
+    AppMessageInboundReceived in_received;
+    AppMessageInboundDropped in_dropped;
+} AppMessageCallbacks;
+
+typedef struct AppMessageCallbacksNode {
+    struct AppMessageCallbacksNode* next;
+    void* context;
+    AppMessageCallbacks callbacks;
+} AppMessageCallbacksNode;
+
+AppMessageResult app_message_register_callbacks(AppMessageCallbacksNode* callbacks_node);
+AppMessageResult app_message_deregister_callbacks(AppMessageCallbacksNode* callbacks_node);
+AppMessageResult app_message_out_get(DictionaryIterator** iter_out);
+AppMessageResult app_message_out_send(void);
+AppMessageResult app_message_out_release(void);
+
+// Time and timers
+typedef struct {
+    int tm_sec;
+    int tm_min;
+    int tm_hour;
+    int tm_mday;
+    int tm_mon;
+    int tm_year;
+    int tm_wday;
+    int tm_yday;
+    int tm_isdst;
+} PblTm;
+
+void get_time(PblTm* time);
+
+typedef void* AppContextRef;
+typedef uint32_t AppTimerHandle;
+
+AppTimerHandle app_timer_send_event(AppContextRef app_ctx, uint32_t timeout_ms, uint32_t cookie);
+bool app_timer_cancel_event(AppContextRef app_ctx_ref, AppTimerHandle handle);
+
+#endif
@@ -0,0 +1,238 @@
+#include <stdarg.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test.h"
+
+static int tests_run;
+static int tests_failed;
+
+void test_run(const char* name, void (*test)(void)) {
+    ++tests_run;
+    fflush(NULL);
+    pid_t pid = fork();
+    if(pid == 0) {
+        test();
+        exit(0);
+    }
+    int status = 0;
+    if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        ++tests_failed;
+        if(pid > 0 && WIFSIGNALED(status)) {
+            fprintf(stderr, "%s: killed by signal %d\n", name, WTERMSIG(status));
+        }
+        fprintf(stderr, "FAIL %s\n", name);
+    }
+}
+
+int test_report() {
+    printf("%d tests, %d failed\n", tests_run, tests_failed);
+    return tests_failed ? 1 : 0;
+}
+
+// Callback log
+static char log_buffer[4096];
+static size_t log_used;
+
+void test_logf(const char* format, ...) {
+    if(log_used > 0 && log_used + 2 < sizeof(log_buffer)) {
+        log_used += snprintf(&log_buffer[log_used], sizeof(log_buffer) - log_used, "; ");
+    }
+    va_list args;
+    va_start(args, format);
+    if(log_used < sizeof(log_buffer)) {
+        log_used += vsnprintf(&log_buffer[log_used], sizeof(log_buffer) - log_used, format, args);
+    }
+    va_end(args);
+    if(log_used >= sizeof(log_buffer)) {
+        log_used = sizeof(log_buffer) - 1;
+    }
+}
+
+const char* test_log_take() {
+    static char taken[sizeof(log_buffer)];
+    memcpy(taken, log_buffer, log_used);
+    taken[log_used] = '\0';
+    log_used = 0;
+    return taken;
+}
+
+static uint8_t user_values(DictionaryIterator* iter) {
+    uint8_t count = 0;
+    for(Tuple* tuple = dict_read_first(iter); tuple; tuple = dict_read_next(iter)) {
+        if(tuple->key < 0xF000 || tuple->key > 0xFFFF) ++count;
+    }
+    return count;
+}
+
+static void on_failure(int32_t request_id, int http_status, void* context) {
+    (void)context;
+    test_logf("failure %d %d", (int)request_id, http_status);
+}
+
+static void on_success(int32_t request_id, int http_status, DictionaryIterator* received, void* context) {
+    (void)context;
+    Tuple* value = dict_find(received, 1);
+    if(value && (value->type == TUPLE_INT || value->type == TUPLE_UINT) && value->length == 4) {
+        test_logf("success %d %d 1=%d", (int)request_id, http_status, (int)value->value->int32);
+    } else {
+        test_logf("success %d %d", (int)request_id, http_status);
+    }
+}
+
+static void on_reconnect(void* context) {
+    (void)context;
+    test_logf("reconnect");
+}
+
+static void on_cookie_get(int32_t request_id, Tuple* result, void* context) {
+    (void)context;
+    if(result->type == TUPLE_CSTRING) {
+        test_logf("cookie_get %d %u=%s", (int)request_id, (unsigned)result->key, result->value->cstring);
+    } else {
+        test_logf("cookie_get %d %u=%d", (int)request_id, (unsigned)result->key, result->length == 4 ? (int)result->value->int32 : result->value->uint8);
+    }
+}
+
+static void on_cookie_batch_get(int32_t request_id, DictionaryIterator* result, void* context) {
+    (void)context;
+    test_logf("cookie_batch_get %d %d", (int)request_id, user_values(result));
+}
+
+static void on_cookie_set(int32_t request_id, bool successful, void* context) {
+    (void)context;
+    test_logf("cookie_set %d %d", (int)request_id, successful);
+}
+
+static void on_cookie_fsync(bool successful, void* context) {
+    (void)context;
+    test_logf("cookie_fsync %d", successful);
+}
+
+static void on_cookie_delete(int32_t request_id, bool successful, void* context) {
+    (void)context;
+    test_logf("cookie_delete %d %d", (int)request_id, successful);
+}
+
+static void on_time(int32_t utc_offset_seconds, bool is_dst, uint32_t unixtime, const char* tz_name, void* context) {
+    (void)context;
+    test_logf("time %d %d %u %s", (int)utc_offset_seconds, is_dst, (unsigned)unixtime, tz_name);
+}
+
+static void on_location(float latitude, float longitude, float altitude, float accuracy, void* context) {
+    (void)context;
+    test_logf("location %g %g %g %g", latitude, longitude, altitude, accuracy);
+}
+
+static void on_fragment(int32_t request_id, int http_status, uint16_t index, uint16_t count, DictionaryIterator* fragment, void* context) {
+    (void)http_status;
+    (void)fragment;
+    (void)context;
+    test_logf("fragment %d %d/%d", (int)request_id, index, count);
+}
+
+HTTPCallbacks test_callbacks = {
+    .failure = on_failure,
+    .success = on_success,
+    .reconnect = on_reconnect,
+    .cookie_get = on_cookie_get,
+    .cookie_batch_get = on_cookie_batch_get,
+    .cookie_set = on_cookie_set,
+    .cookie_fsync = on_cookie_fsync,
+    .cookie_delete = on_cookie_delete,
+    .time = on_time,
+    .location = on_location,
+    .fragment = on_fragment,
+};
+
+void test_begin() {
+    CHECK(http_register_callbacks(test_callbacks, NULL));
+    http_set_app_id(TEST_APP_ID);
+    http_set_app_context((AppContextRef)1);
+}
+
+// Replies
+DictionaryIterator* reply_http_begin(int32_t app_id, int32_t request_id, bool success, int16_t status) {
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_uint8(reply, KEY_URL, success);
+    dict_write_int16(reply, KEY_STATUS, status);
+    dict_write_int32(reply, KEY_COOKIE, request_id);
+    dict_write_int32(reply, KEY_APP_ID, app_id);
+    return reply;
+}
+
+void reply_http(int32_t request_id, int16_t status) {
+    reply_http_begin(TEST_APP_ID, request_id, true, status);
+    fake_reply_send();
+}
+
+DictionaryIterator* reply_cookie_begin(uint32_t reserved_key, int32_t request_id) {
+    DictionaryIterator* reply = fake_reply_begin();
+    if(reserved_key == KEY_COOKIE_FSYNC) {
+        dict_write_uint8(reply, reserved_key, request_id);
+    } else {
+        dict_write_int32(reply, reserved_key, request_id);
+    }
+    dict_write_int32(reply, KEY_APP_ID, TEST_APP_ID);
+    return reply;
+}
+
+void reply_cookie(uint32_t reserved_key, int32_t request_id) {
+    reply_cookie_begin(reserved_key, request_id);
+    fake_reply_send();
+}
+
+void reply_time(uint32_t unixtime, int32_t utc_offset, bool is_dst, const char* tz_name) {
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_uint32(reply, KEY_TIME, unixtime);
+    dict_write_int32(reply, KEY_UTC_OFFSET, utc_offset);
+    dict_write_uint8(reply, KEY_IS_DST, is_dst);
+    dict_write_cstring(reply, KEY_TZ_NAME, tz_name);
+    fake_reply_send();
+}
+
+static uint32_t float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+void reply_location(float accuracy, float latitude, float longitude, float altitude) {
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_uint32(reply, KEY_LOCATION, float_bits(accuracy));
+    dict_write_uint32(reply, KEY_LATITUDE, float_bits(latitude));
+    dict_write_uint32(reply, KEY_LONGITUDE, float_bits(longitude));
+    dict_write_uint32(reply, KEY_ALTITUDE, float_bits(altitude));
+    fake_reply_send();
+}
+
+// What was sent
+bool sent_has(uint32_t key) {
+    return fake_sent_find(key) != NULL;
+}
+
+int32_t sent_int(uint32_t key) {
+    Tuple* tuple = fake_sent_find(key);
+    CHECK(tuple != NULL);
+    switch(tuple->length) {
+    case 1: return tuple->type == TUPLE_INT ? tuple->value->int8 : tuple->value->uint8;
+    case 2: return tuple->type == TUPLE_INT ? tuple->value->int16 : tuple->value->uint16;
+    default: return tuple->value->int32;
+    }
+}
+
+uint8_t sent_user_values() {
+    uint16_t size;
+    const uint8_t* sent = fake_last_sent(&size);
+    DictionaryIterator iter;
+    dict_read_begin_from_buffer(&iter, sent, size);
+    return user_values(&iter);
+}
+
+uint32_t ack_all() {
+    uint32_t acked = 0;
+    for(; fake_in_flight(); ++acked) {
+        fake_ack();
+    }
+    return acked;
+}
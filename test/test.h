@@ -0,0 +1,102 @@
+/*
+ * Minimal test support. Each test runs in a child process of its own, so it starts
+ * from http.c's initial state; a failed check ends only that test.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fake_pebble.h"
+#include "http.h"
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while(0)
+
+#define CHECK_EQ(actual, expected) do { \
+    long long actual_value = (long long)(actual); \
+    long long expected_value = (long long)(expected); \
+    if(actual_value != expected_value) { \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_value, expected_value); \
+        exit(1); \
+    } \
+} while(0)
+
+// Checks, and clears, what the callbacks have reported since the last check.
+#define CHECK_LOG(expected) do { \
+    const char* logged = test_log_take(); \
+    if(strcmp(logged, (expected)) != 0) { \
+        fprintf(stderr, "%s:%d: callbacks were \"%s\", expected \"%s\"\n", __FILE__, __LINE__, logged, (expected)); \
+        exit(1); \
+    } \
+} while(0)
+
+#define RUN(test) test_run(#test, test)
+
+void test_run(const char* name, void (*test)(void));
+int test_report();
+
+// The app id tests use, unless they set another.
+#define TEST_APP_ID 7
+
+// Reserved keys of the bridge protocol.
+#define KEY_URL 0xFFFF
+#define KEY_STATUS 0xFFFE
+#define KEY_COOKIE 0xFFFC
+#define KEY_CONNECT 0xFFFB
+#define KEY_APP_ID 0xFFF2
+#define KEY_COOKIE_STORE 0xFFF0
+#define KEY_COOKIE_LOAD 0xFFF1
+#define KEY_COOKIE_FSYNC 0xFFF3
+#define KEY_COOKIE_DELETE 0xFFF4
+#define KEY_TIME 0xFFF5
+#define KEY_UTC_OFFSET 0xFFF6
+#define KEY_IS_DST 0xFFF7
+#define KEY_TZ_NAME 0xFFF8
+#define KEY_LOCATION 0xFFE0
+#define KEY_LATITUDE 0xFFE1
+#define KEY_LONGITUDE 0xFFE2
+#define KEY_ALTITUDE 0xFFE3
+#define KEY_STREAM 0xFFD0
+#define KEY_FRAGMENT 0xFFD1
+#define KEY_FRAGMENT_COUNT 0xFFD2
+#define KEY_BATCH 0xFFD3
+#define KEY_VALIDATOR 0xFFD4
+#define KEY_PACKED 0xFFD5
+#define KEY_COMPRESSED 0xFFD6
+#define KEY_BATCH_PART 0xFFC0
+
+// Callbacks that log each call as e.g. "success 1 200", separated by "; ".
+extern HTTPCallbacks test_callbacks;
+void test_logf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+const char* test_log_take();
+
+// Registers test_callbacks for TEST_APP_ID, with timers enabled.
+void test_begin();
+
+// Replies from the bridge. The _begin forms return the message for more values to
+// be added before fake_reply_send.
+DictionaryIterator* reply_http_begin(int32_t app_id, int32_t request_id, bool success, int16_t status);
+void reply_http(int32_t request_id, int16_t status);
+DictionaryIterator* reply_cookie_begin(uint32_t reserved_key, int32_t request_id);
+void reply_cookie(uint32_t reserved_key, int32_t request_id);
+void reply_time(uint32_t unixtime, int32_t utc_offset, bool is_dst, const char* tz_name);
+void reply_location(float accuracy, float latitude, float longitude, float altitude);
+
+// What the last message sent said.
+bool sent_has(uint32_t key);
+int32_t sent_int(uint32_t key);
+// The number of values below the reserved range.
+uint8_t sent_user_values();
+
+// Acknowledges messages until nothing more goes out; returns how many were acknowledged.
+uint32_t ack_all();
+
+#endif
@@ -0,0 +1,124 @@
+#include "test.h"
+
+static void send_request(int32_t request_id) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    dict_write_int32(iter, 1, request_id);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static uint16_t write_part(uint8_t* buffer, uint16_t size, int32_t request_id, int32_t value) {
+    DictionaryIterator part;
+    dict_write_begin(&part, buffer, size);
+    dict_write_uint8(&part, KEY_URL, 1);
+    dict_write_int16(&part, KEY_STATUS, 200);
+    dict_write_int32(&part, KEY_COOKIE, request_id);
+    dict_write_int32(&part, KEY_APP_ID, TEST_APP_ID);
+    dict_write_int32(&part, 1, value);
+    return dict_write_end(&part);
+}
+
+static void batch_goes_out_as_one_message() {
+    test_begin();
+    CHECK_EQ(http_batch_begin(), HTTP_OK);
+    send_request(1);
+    DictionaryIterator* iter;
+    CHECK_EQ(http_cookie_set_start(2, &iter), HTTP_OK);
+    dict_write_int32(iter, 10, 5);
+    CHECK_EQ(http_cookie_set_end(), HTTP_OK);
+    send_request(3);
+    CHECK_EQ(fake_sent_count, 0);
+    CHECK_EQ(http_batch_end(), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK_EQ(sent_int(KEY_BATCH), 3);
+    CHECK(sent_has(KEY_BATCH_PART + 2));
+    CHECK(!sent_has(KEY_BATCH_PART + 3));
+    fake_ack();
+    CHECK_LOG("");
+}
+
+static void batched_replies_are_unpacked() {
+    test_begin();
+    http_batch_begin();
+    send_request(1);
+    send_request(3);
+    http_batch_end();
+    fake_ack();
+    uint8_t first[64], second[64];
+    uint16_t first_size = write_part(first, sizeof(first), 1, 11);
+    uint16_t second_size = write_part(second, sizeof(second), 3, 33);
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_uint8(reply, KEY_BATCH, 2);
+    dict_write_data(reply, KEY_BATCH_PART, first, first_size);
+    dict_write_data(reply, KEY_BATCH_PART + 1, second, second_size);
+    fake_reply_send();
+    CHECK_LOG("success 1 200 1=11; success 3 200 1=33");
+}
+
+static void parts_may_be_answered_alone() {
+    test_begin();
+    http_batch_begin();
+    send_request(1);
+    DictionaryIterator* iter;
+    http_cookie_set_start(2, &iter);
+    dict_write_int32(iter, 10, 5);
+    http_cookie_set_end();
+    http_batch_end();
+    fake_ack();
+    reply_cookie(KEY_COOKIE_STORE, 2);
+    reply_http(1, 404);
+    CHECK_LOG("cookie_set 2 1; success 1 404");
+}
+
+static void single_request_goes_out_plain() {
+    test_begin();
+    http_batch_begin();
+    send_request(4);
+    http_batch_end();
+    CHECK(!sent_has(KEY_BATCH));
+    CHECK(sent_has(KEY_URL));
+    CHECK_EQ(sent_int(KEY_COOKIE), 4);
+}
+
+static void failed_batch_fails_every_part() {
+    test_begin();
+    http_batch_begin();
+    send_request(5);
+    send_request(6);
+    http_batch_end();
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("failure 5 1004; failure 6 1004");
+}
+
+static void parts_are_limited_to_free_slots() {
+    test_begin();
+    fake_advance(31000);
+    test_log_take();
+    for(int i = 0; i < 5; ++i) {
+        send_request(20 + i);
+        fake_ack();
+    }
+    http_batch_begin();
+    send_request(25);
+    send_request(26);
+    // With the batch's own entry, the in-flight table is full.
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", 27, &iter), HTTP_BUSY);
+    CHECK_EQ(http_batch_end(), HTTP_OK);
+    CHECK_EQ(sent_int(KEY_BATCH), 2);
+    fake_ack();
+    // Every part was tracked, so each times out.
+    fake_advance(31000);
+    CHECK_LOG("failure 20 1002; failure 21 1002; failure 22 1002; failure 23 1002; failure 24 1002; "
+              "failure 25 1002; failure 26 1002");
+}
+
+int main() {
+    RUN(batch_goes_out_as_one_message);
+    RUN(batched_replies_are_unpacked);
+    RUN(parts_may_be_answered_alone);
+    RUN(single_request_goes_out_plain);
+    RUN(failed_batch_fails_every_part);
+    RUN(parts_are_limited_to_free_slots);
+    return test_report();
+}
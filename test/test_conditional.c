@@ -0,0 +1,154 @@
+#include "test.h"
+
+static void send_request(int32_t request_id, const char* url, int32_t value) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get(url, request_id, &iter), HTTP_OK);
+    dict_write_int32(iter, 1, value);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static void reply_with_validator(int32_t request_id, int16_t status, uint32_t validator) {
+    DictionaryIterator* reply = reply_http_begin(TEST_APP_ID, request_id, true, status);
+    dict_write_uint32(reply, KEY_VALIDATOR, validator);
+    fake_reply_send();
+}
+
+static void validator_goes_with_identical_requests() {
+    test_begin();
+    send_request(1, "http://a/", 1);
+    CHECK(!sent_has(KEY_VALIDATOR));
+    fake_ack();
+    reply_with_validator(1, 200, 0xabc);
+    send_request(1, "http://a/", 1);
+    CHECK_EQ(sent_int(KEY_VALIDATOR), 0xabc);
+    fake_ack();
+    reply_http(1, 304);
+    CHECK_LOG("success 1 200; success 1 304");
+}
+
+static void different_requests_have_their_own() {
+    test_begin();
+    send_request(1, "http://a/", 1);
+    fake_ack();
+    reply_with_validator(1, 200, 0xabc);
+    send_request(2, "http://a/", 2);
+    CHECK(!sent_has(KEY_VALIDATOR));
+    fake_ack();
+    reply_with_validator(2, 200, 0xdef);
+    send_request(1, "http://a/", 1);
+    CHECK_EQ(sent_int(KEY_VALIDATOR), 0xabc);
+    fake_ack();
+    send_request(2, "http://a/", 2);
+    CHECK_EQ(sent_int(KEY_VALIDATOR), 0xdef);
+    fake_ack();
+    reply_http(1, 304);
+    reply_http(2, 304);
+    test_log_take();
+}
+
+static void least_recently_used_is_forgotten() {
+    test_begin();
+    send_request(1, "http://a/", 1);
+    fake_ack();
+    reply_with_validator(1, 200, 0xabc);
+    char url[24];
+    for(int i = 0; i < 4; ++i) {
+        snprintf(url, sizeof(url), "http://b%d/", i);
+        send_request(10 + i, url, 0);
+        fake_ack();
+        reply_with_validator(10 + i, 200, i + 1);
+    }
+    send_request(1, "http://a/", 1);
+    CHECK(!sent_has(KEY_VALIDATOR));
+    fake_ack();
+    send_request(13, "http://b3/", 0);
+    CHECK_EQ(sent_int(KEY_VALIDATOR), 4);
+    fake_ack();
+    reply_http(1, 200);
+    reply_http(13, 304);
+    test_log_take();
+}
+
+static void shared_requests_keep_the_validator() {
+    test_begin();
+    send_request(1, "http://a/", 1);
+    fake_ack();
+    send_request(2, "http://a/", 1);
+    CHECK_EQ(fake_sent_count, 1);
+    reply_with_validator(1, 200, 0xabc);
+    CHECK_LOG("success 1 200; success 2 200");
+    send_request(2, "http://a/", 1);
+    CHECK_EQ(sent_int(KEY_VALIDATOR), 0xabc);
+    fake_ack();
+    send_request(1, "http://a/", 1);
+    CHECK_EQ(fake_sent_count, 2);
+    reply_http(2, 304);
+    CHECK_LOG("success 2 304; success 1 304");
+}
+
+static void validators_can_be_cleared() {
+    test_begin();
+    send_request(1, "http://a/", 1);
+    fake_ack();
+    reply_with_validator(1, 200, 0xabc);
+    http_validators_clear();
+    send_request(1, "http://a/", 1);
+    CHECK(!sent_has(KEY_VALIDATOR));
+    fake_ack();
+    reply_http(1, 200);
+    test_log_take();
+}
+
+static void other_callers_get_the_body() {
+    test_begin();
+    http_validators_clear();
+    send_request(1, "http://a/", 1);
+    fake_ack();
+    reply_with_validator(1, 200, 0xabc);
+    // A second widget asking for the same thing has nothing a 304 could refer to.
+    send_request(2, "http://a/", 1);
+    CHECK(!sent_has(KEY_VALIDATOR));
+    fake_ack();
+    reply_with_validator(2, 200, 0xabc);
+    CHECK_LOG("success 1 200; success 2 200");
+    send_request(2, "http://a/", 1);
+    CHECK_EQ(sent_int(KEY_VALIDATOR), 0xabc);
+    fake_ack();
+    reply_http(2, 304);
+    test_log_take();
+}
+
+static void conditional_requests_are_not_shared_with_others() {
+    test_begin();
+    http_validators_clear();
+    send_request(1, "http://a/", 1);
+    fake_ack();
+    reply_with_validator(1, 200, 0xabc);
+    send_request(1, "http://a/", 1);
+    CHECK_EQ(sent_int(KEY_VALIDATOR), 0xabc);
+    fake_ack();
+    send_request(2, "http://a/", 1);
+    CHECK_EQ(fake_sent_count, 3);
+    CHECK(!sent_has(KEY_VALIDATOR));
+    fake_ack();
+    reply_http(1, 304);
+    reply_with_validator(2, 200, 0xdef);
+    CHECK_LOG("success 1 200; success 1 304; success 2 200");
+    // A new body retires the validator its old owners were given.
+    send_request(1, "http://a/", 1);
+    CHECK(!sent_has(KEY_VALIDATOR));
+    fake_ack();
+    reply_http(1, 200);
+    test_log_take();
+}
+
+int main() {
+    RUN(validator_goes_with_identical_requests);
+    RUN(different_requests_have_their_own);
+    RUN(least_recently_used_is_forgotten);
+    RUN(shared_requests_keep_the_validator);
+    RUN(validators_can_be_cleared);
+    RUN(other_callers_get_the_body);
+    RUN(conditional_requests_are_not_shared_with_others);
+    return test_report();
+}
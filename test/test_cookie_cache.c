@@ -0,0 +1,106 @@
+#include "test.h"
+
+static void set_and_confirm(int32_t request_id, uint32_t key, int32_t value) {
+    CHECK_EQ(http_cookie_set_int32(request_id, key, value), HTTP_OK);
+    fake_ack();
+    reply_cookie(KEY_COOKIE_STORE, request_id);
+}
+
+static void values_written_are_read_back_locally() {
+    test_begin();
+    set_and_confirm(1, 10, 100);
+    set_and_confirm(2, 11, 110);
+    CHECK_LOG("cookie_set 1 1; cookie_set 2 1");
+    uint32_t keys[] = {10, 11};
+    CHECK_EQ(http_cookie_get_multiple(5, keys, 2), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK_LOG("cookie_batch_get 5 2; cookie_get 5 10=100; cookie_get 5 11=110");
+    CHECK_EQ(http_cookie_cache_hits(), 2);
+    CHECK_EQ(http_cookie_cache_misses(), 0);
+}
+
+static void only_misses_are_fetched() {
+    test_begin();
+    set_and_confirm(1, 10, 100);
+    set_and_confirm(2, 11, 110);
+    test_log_take();
+    uint32_t keys[] = {10, 12, 11};
+    CHECK_EQ(http_cookie_get_multiple(6, keys, 3), HTTP_OK);
+    CHECK(sent_has(12));
+    CHECK(!sent_has(10) && !sent_has(11));
+    fake_ack();
+    DictionaryIterator* reply = reply_cookie_begin(KEY_COOKIE_LOAD, 6);
+    dict_write_int32(reply, 12, 120);
+    fake_reply_send();
+    CHECK_LOG("cookie_get 6 12=120; cookie_batch_get 6 3; cookie_get 6 10=100; cookie_get 6 11=110");
+    CHECK_EQ(http_cookie_cache_hits(), 2);
+    CHECK_EQ(http_cookie_cache_misses(), 1);
+    // What came back is cached too.
+    CHECK_EQ(http_cookie_get(7, 12), HTTP_OK);
+    CHECK_LOG("cookie_batch_get 7 1; cookie_get 7 12=120");
+}
+
+static void deleted_values_are_forgotten() {
+    test_begin();
+    set_and_confirm(1, 10, 100);
+    CHECK_EQ(http_cookie_delete(2, 10), HTTP_OK);
+    fake_ack();
+    uint32_t sent = fake_sent_count;
+    CHECK_EQ(http_cookie_get(3, 10), HTTP_OK);
+    CHECK_EQ(fake_sent_count, sent + 1);
+}
+
+static void failed_sets_clear_the_cache() {
+    test_begin();
+    set_and_confirm(1, 10, 100);
+    CHECK_EQ(http_cookie_set_int32(2, 11, 110), HTTP_OK);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    uint32_t sent = fake_sent_count;
+    CHECK_EQ(http_cookie_get(3, 10), HTTP_OK);
+    CHECK_EQ(fake_sent_count, sent + 1);
+}
+
+static void large_values_are_not_cached() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_cstring(1, 10, "longer than a cache entry"), HTTP_OK);
+    fake_ack();
+    uint32_t sent = fake_sent_count;
+    CHECK_EQ(http_cookie_get(2, 10), HTTP_OK);
+    CHECK_EQ(fake_sent_count, sent + 1);
+}
+
+static void each_app_id_has_its_own_values() {
+    test_begin();
+    while(fake_in_flight()) fake_ack();
+    set_and_confirm(1, 10, 100);
+    test_log_take();
+    http_set_app_id(99);
+    uint32_t sent = fake_sent_count;
+    CHECK_EQ(http_cookie_get(2, 10), HTTP_OK);
+    CHECK_EQ(fake_sent_count, sent + 1);
+    fake_ack();
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_int32(reply, KEY_COOKIE_LOAD, 2);
+    dict_write_int32(reply, KEY_APP_ID, 99);
+    dict_write_int32(reply, 10, 990);
+    fake_reply_send();
+    CHECK_LOG("cookie_get 2 10=990; cookie_batch_get 2 1");
+    // Switching back doesn't lose either app's values.
+    http_set_app_id(TEST_APP_ID);
+    CHECK_EQ(http_cookie_get(3, 10), HTTP_OK);
+    http_set_app_id(99);
+    CHECK_EQ(http_cookie_get(4, 10), HTTP_OK);
+    CHECK_EQ(fake_sent_count, sent + 1);
+    CHECK_LOG("cookie_batch_get 3 1; cookie_get 3 10=100; cookie_batch_get 4 1; cookie_get 4 10=990");
+    http_set_app_id(TEST_APP_ID);
+}
+
+int main() {
+    RUN(values_written_are_read_back_locally);
+    RUN(only_misses_are_fetched);
+    RUN(deleted_values_are_forgotten);
+    RUN(failed_sets_clear_the_cache);
+    RUN(each_app_id_has_its_own_values);
+    RUN(large_values_are_not_cached);
+    return test_report();
+}
@@ -0,0 +1,171 @@
+#include "test.h"
+
+// Answers the cookie get or delete in flight, giving each requested key twice its number.
+static void answer_keys() {
+    bool load = sent_has(KEY_COOKIE_LOAD);
+    int32_t request_id = sent_int(load ? KEY_COOKIE_LOAD : KEY_COOKIE_DELETE);
+    uint16_t size;
+    uint8_t sent[256];
+    memcpy(sent, fake_last_sent(&size), sizeof(sent));
+    fake_ack();
+    DictionaryIterator* reply = reply_cookie_begin(load ? KEY_COOKIE_LOAD : KEY_COOKIE_DELETE, request_id);
+    DictionaryIterator keys;
+    for(Tuple* tuple = dict_read_begin_from_buffer(&keys, sent, size); tuple; tuple = dict_read_next(&keys)) {
+        if(load && tuple->key < 0xF000) {
+            dict_write_int32(reply, tuple->key, tuple->key * 2);
+        }
+    }
+    fake_reply_send();
+}
+
+static void set_is_confirmed() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_int32(3, 10, 100), HTTP_OK);
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), 3);
+    CHECK_EQ(sent_int(KEY_APP_ID), TEST_APP_ID);
+    CHECK_EQ(sent_int(10), 100);
+    fake_ack();
+    reply_cookie(KEY_COOKIE_STORE, 3);
+    CHECK_LOG("cookie_set 3 1");
+}
+
+static void set_keeps_the_value_type() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_cstring(1, 10, "hi"), HTTP_OK);
+    Tuple* value = fake_sent_find(10);
+    CHECK(value && value->type == TUPLE_CSTRING && value->length == 3);
+    fake_ack();
+    CHECK_EQ(http_cookie_set_int16(2, 11, -2), HTTP_OK);
+    value = fake_sent_find(11);
+    CHECK(value && value->type == TUPLE_INT && value->length == 2);
+}
+
+static void get_reports_each_value_and_the_batch() {
+    test_begin();
+    uint32_t keys[] = {10, 11};
+    CHECK_EQ(http_cookie_get_multiple(4, keys, 2), HTTP_OK);
+    CHECK_EQ(sent_int(KEY_COOKIE_LOAD), 4);
+    CHECK(sent_has(10) && sent_has(11));
+    answer_keys();
+    CHECK_LOG("cookie_batch_get 4 2; cookie_get 4 10=20; cookie_get 4 11=22");
+}
+
+static void delete_and_fsync_are_confirmed() {
+    test_begin();
+    CHECK_EQ(http_cookie_delete(5, 10), HTTP_OK);
+    CHECK_EQ(sent_int(KEY_COOKIE_DELETE), 5);
+    fake_ack();
+    reply_cookie(KEY_COOKIE_DELETE, 5);
+    CHECK_EQ(http_cookie_fsync(), HTTP_OK);
+    fake_ack();
+    reply_cookie(KEY_COOKIE_FSYNC, 1);
+    CHECK_LOG("cookie_delete 5 1; cookie_fsync 1");
+}
+
+static void long_key_lists_are_split_and_merged() {
+    test_begin();
+    fake_config.outbox_size = 128;
+    uint32_t keys[20];
+    for(int i = 0; i < 20; ++i) {
+        keys[i] = i + 1;
+    }
+    CHECK_EQ(http_cookie_get_multiple(3, keys, 20), HTTP_OK);
+    CHECK(sent_user_values() < 20);
+    while(fake_in_flight()) {
+        answer_keys();
+    }
+    CHECK_EQ(fake_sent_count, 2);
+    // Each value as it arrives, then the whole set at once.
+    const char* log = test_log_take();
+    CHECK(strncmp(log, "cookie_get 3 1=2; ", 18) == 0);
+    CHECK(strstr(log, "cookie_get 3 20=40; cookie_batch_get 3 20") != NULL);
+    CHECK(strstr(log, "cookie_batch_get") == strrchr(log, ';') + 2);
+}
+
+static void split_delete_is_confirmed_once() {
+    test_begin();
+    uint32_t keys[40];
+    for(int i = 0; i < 40; ++i) {
+        keys[i] = i + 1;
+    }
+    fake_config.outbox_size = 128;
+    CHECK_EQ(http_cookie_delete_multiple(4, keys, 40), HTTP_OK);
+    while(fake_in_flight()) {
+        answer_keys();
+    }
+    CHECK_LOG("cookie_delete 4 1");
+}
+
+static void split_get_fails_once() {
+    test_begin();
+    uint32_t keys[40];
+    for(int i = 0; i < 40; ++i) {
+        keys[i] = i + 1;
+    }
+    fake_config.outbox_size = 128;
+    CHECK_EQ(http_cookie_get_multiple(3, keys, 40), HTTP_OK);
+    answer_keys();
+    test_log_take();
+    fake_nack(APP_MSG_SEND_REJECTED);
+    while(fake_in_flight()) {
+        answer_keys();
+    }
+    // The app hears of the failure once, and never gets a partial set.
+    const char* log = test_log_take();
+    const char* failure = strstr(log, "failure 3 1004");
+    CHECK(failure != NULL);
+    CHECK(strstr(failure + 1, "failure") == NULL);
+    CHECK(strstr(log, "cookie_batch_get") == NULL);
+}
+
+static void key_lists_that_cannot_fit_are_refused() {
+    test_begin();
+    uint32_t keys[300];
+    for(int i = 0; i < 300; ++i) {
+        keys[i] = i;
+    }
+    CHECK_EQ(http_cookie_get_multiple(5, keys, 300), HTTP_NOT_ENOUGH_STORAGE);
+    CHECK_EQ(fake_sent_count, 0);
+}
+
+static void split_requests_wait_for_the_queue() {
+    test_begin();
+    fake_config.outbox_size = 128;
+    uint32_t keys[200];
+    for(int i = 0; i < 200; ++i) {
+        keys[i] = i + 1;
+    }
+    // More messages than the queue has slots.
+    CHECK_EQ(http_cookie_delete_multiple(6, keys, 200), HTTP_OK);
+    CHECK_EQ(http_queue_depth(), 4);
+    while(fake_in_flight()) {
+        answer_keys();
+    }
+    CHECK(fake_sent_count > 5);
+    CHECK_LOG("cookie_delete 6 1");
+    // Fewer messages than slots, but some are taken.
+    for(int i = 0; i < 4; ++i) {
+        CHECK_EQ(http_cookie_get(7, 1), HTTP_OK);
+    }
+    CHECK_EQ(http_queue_depth(), 3);
+    CHECK_EQ(http_cookie_get_multiple(8, keys, 20), HTTP_OK);
+    while(fake_in_flight()) {
+        answer_keys();
+    }
+    const char* log = test_log_take();
+    CHECK(strstr(log, "cookie_batch_get 8 20") != NULL);
+    CHECK(strstr(log, "failure") == NULL);
+}
+
+int main() {
+    RUN(set_is_confirmed);
+    RUN(set_keeps_the_value_type);
+    RUN(get_reports_each_value_and_the_batch);
+    RUN(delete_and_fsync_are_confirmed);
+    RUN(long_key_lists_are_split_and_merged);
+    RUN(split_delete_is_confirmed_once);
+    RUN(split_get_fails_once);
+    RUN(key_lists_that_cannot_fit_are_refused);
+    RUN(split_requests_wait_for_the_queue);
+    return test_report();
+}
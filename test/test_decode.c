@@ -0,0 +1,116 @@
+#include "test.h"
+
+typedef struct {
+    int16_t temperature;
+    uint8_t humidity;
+    char summary[8];
+    uint32_t time;
+    uint8_t icon[4];
+    int32_t pressure;
+} Weather;
+
+#define WEATHER_FIELDS(X) \
+    X(1, HTTP_FIELD_INT, Weather, temperature) \
+    X(2, HTTP_FIELD_UINT, Weather, humidity) \
+    X(3, HTTP_FIELD_CSTRING, Weather, summary) \
+    X(4, HTTP_FIELD_UINT, Weather, time) \
+    X(5, HTTP_FIELD_DATA, Weather, icon) \
+    X(6, HTTP_FIELD_INT, Weather, pressure)
+
+static const HTTPField weather_fields[] = { WEATHER_FIELDS(HTTP_FIELD) };
+#define WEATHER_FIELD_COUNT (sizeof(weather_fields) / sizeof(weather_fields[0]))
+
+static uint8_t buffer[128];
+static DictionaryIterator response;
+
+static DictionaryIterator* response_begin() {
+    dict_write_begin(&response, buffer, sizeof(buffer));
+    return &response;
+}
+
+static uint32_t decode(Weather* weather) {
+    uint32_t size = dict_write_end(&response);
+    dict_read_begin_from_buffer(&response, buffer, size);
+    return http_decode(&response, weather_fields, WEATHER_FIELD_COUNT, weather);
+}
+
+static void every_field_is_decoded() {
+    DictionaryIterator* iter = response_begin();
+    dict_write_int32(iter, 1, -12);
+    dict_write_uint8(iter, 2, 80);
+    dict_write_cstring(iter, 3, "Sunny");
+    dict_write_uint32(iter, 4, 4000000000u);
+    const uint8_t icon[3] = { 1, 2, 3 };
+    dict_write_data(iter, 5, icon, sizeof(icon));
+    dict_write_int16(iter, 6, 1013);
+    Weather weather = { 0 };
+    CHECK_EQ(decode(&weather), 0);
+    CHECK_EQ(weather.temperature, -12);
+    CHECK_EQ(weather.humidity, 80);
+    CHECK(strcmp(weather.summary, "Sunny") == 0);
+    CHECK_EQ(weather.time, 4000000000u);
+    CHECK_EQ(weather.icon[2], 3);
+    CHECK_EQ(weather.pressure, 1013);
+}
+
+static void missing_fields_are_reported() {
+    DictionaryIterator* iter = response_begin();
+    dict_write_int32(iter, 1, 20);
+    dict_write_int32(iter, 99, 0);
+    Weather weather = { .pressure = 5 };
+    CHECK_EQ(decode(&weather), 0x3e);
+    CHECK_EQ(weather.temperature, 20);
+    CHECK_EQ(weather.pressure, 5);
+}
+
+static void values_that_do_not_fit_are_reported() {
+    DictionaryIterator* iter = response_begin();
+    dict_write_int32(iter, 1, 40000);
+    dict_write_int32(iter, 2, 300);
+    dict_write_int8(iter, 4, -1);
+    const uint8_t icon[5] = { 0 };
+    dict_write_data(iter, 5, icon, sizeof(icon));
+    dict_write_cstring(iter, 6, "1013");
+    Weather weather = { .temperature = 1, .humidity = 2, .time = 3, .pressure = 6 };
+    CHECK_EQ(decode(&weather), 0x3f);
+    CHECK_EQ(weather.temperature, 1);
+    CHECK_EQ(weather.humidity, 2);
+    CHECK_EQ(weather.time, 3);
+    CHECK_EQ(weather.pressure, 6);
+}
+
+static void long_strings_are_cut_short() {
+    DictionaryIterator* iter = response_begin();
+    dict_write_cstring(iter, 3, "Overcast skies");
+    Weather weather = { 0 };
+    CHECK_EQ(decode(&weather) & 4, 4);
+    CHECK(strcmp(weather.summary, "Overcas") == 0);
+}
+
+// A string tuple holding exactly these bytes, which need not be terminated.
+static void write_raw_string(DictionaryIterator* iter, uint32_t key, const char* bytes, uint16_t length) {
+    Tuple* tuple = iter->cursor;
+    dict_write_data(iter, key, (const uint8_t*)bytes, length);
+    tuple->type = TUPLE_CSTRING;
+}
+
+static void malformed_strings_are_reported() {
+    DictionaryIterator* iter = response_begin();
+    write_raw_string(iter, 3, "", 0);
+    Weather weather = { .summary = "old" };
+    CHECK_EQ(decode(&weather) & 4, 4);
+    CHECK(strcmp(weather.summary, "old") == 0);
+    iter = response_begin();
+    write_raw_string(iter, 3, "abc", 3);
+    CHECK_EQ(decode(&weather) & 4, 4);
+    CHECK(strcmp(weather.summary, "old") == 0);
+}
+
+int main() {
+    RUN(every_field_is_decoded);
+    RUN(missing_fields_are_reported);
+    RUN(values_that_do_not_fit_are_reported);
+    RUN(long_strings_are_cut_short);
+    RUN(malformed_strings_are_reported);
+    return test_report();
+}
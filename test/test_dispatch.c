@@ -0,0 +1,144 @@
+#include "test.h"
+
+static void send_request(int32_t request_id) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+    fake_ack();
+}
+
+static void http_response_goes_to_success() {
+    test_begin();
+    send_request(9);
+    DictionaryIterator* reply = reply_http_begin(TEST_APP_ID, 9, true, 200);
+    dict_write_int32(reply, 1, 55);
+    fake_reply_send();
+    CHECK_LOG("success 9 200 1=55");
+}
+
+static void http_error_goes_to_failure() {
+    test_begin();
+    send_request(9);
+    reply_http_begin(TEST_APP_ID, 9, false, 404);
+    fake_reply_send();
+    CHECK_LOG("failure 9 404");
+}
+
+static void response_without_status_is_invalid() {
+    test_begin();
+    send_request(9);
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_uint8(reply, KEY_URL, 1);
+    dict_write_int32(reply, KEY_COOKIE, 9);
+    dict_write_int32(reply, KEY_APP_ID, TEST_APP_ID);
+    fake_reply_send();
+    CHECK_LOG("failure 9 132072");
+}
+
+static void messages_for_other_apps_are_ignored() {
+    test_begin();
+    send_request(9);
+    reply_http_begin(TEST_APP_ID + 1, 9, true, 200);
+    fake_reply_send();
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_uint8(reply, KEY_URL, 1);
+    dict_write_int16(reply, KEY_STATUS, 200);
+    dict_write_int32(reply, KEY_COOKIE, 9);
+    fake_reply_send();
+    CHECK_LOG("");
+}
+
+static void time_location_and_reconnect_need_no_app_id() {
+    test_begin();
+    reply_time(12345, -3600, true, "Europe/X");
+    reply_location(2.5f, 51.5f, -0.25f, 10.f);
+    fake_reconnect();
+    CHECK_LOG("time -3600 1 12345 Europe/X; location 51.5 -0.25 10 2.5; reconnect");
+}
+
+static void reserved_values_of_the_wrong_shape_are_ignored() {
+    test_begin();
+    send_request(9);
+    // A one-byte status and a string cookie don't count; the request is still open.
+    DictionaryIterator* reply = fake_reply_begin();
+    dict_write_uint8(reply, KEY_URL, 1);
+    dict_write_uint8(reply, KEY_STATUS, 200);
+    dict_write_cstring(reply, KEY_COOKIE, "9");
+    dict_write_int32(reply, KEY_APP_ID, TEST_APP_ID);
+    fake_reply_send();
+    CHECK_LOG("failure 0 132072");
+    reply_http(9, 200);
+    CHECK_LOG("success 9 200");
+    // A time zone that isn't a terminated string leaves time information alone.
+    reply = fake_reply_begin();
+    dict_write_uint32(reply, KEY_TIME, 1);
+    dict_write_int32(reply, KEY_UTC_OFFSET, 0);
+    dict_write_uint8(reply, KEY_IS_DST, 0);
+    dict_write_data(reply, KEY_TZ_NAME, (const uint8_t*)"UTC", 3);
+    fake_reply_send();
+    CHECK_LOG("");
+    CHECK(!http_time_get(NULL, NULL, NULL, NULL));
+}
+
+static void truncated_response_fails_its_request() {
+    test_begin();
+    send_request(9);
+    DictionaryIterator* reply = reply_http_begin(TEST_APP_ID, 9, true, 200);
+    dict_write_cstring(reply, 1, "a value the message is cut off in");
+    uint16_t size = dict_write_end(reply);
+    uint8_t message[256];
+    memcpy(message, reply->dictionary, size);
+    fake_inject(message, size - 5);
+    CHECK_LOG("failure 9 132072");
+    // It is finished with, so a late answer is just passed on.
+    reply_http(9, 200);
+    CHECK_LOG("success 9 200");
+}
+
+static void truncated_time_and_location_are_ignored() {
+    test_begin();
+    const float location[] = { 10, 51.5f, -0.25f };
+    DictionaryIterator* reply = fake_reply_begin();
+    for(int i = 0; i < 3; ++i) {
+        uint32_t bits;
+        memcpy(&bits, &location[i], sizeof(bits));
+        dict_write_uint32(reply, KEY_LOCATION + i, bits);
+    }
+    uint16_t size = dict_write_end(reply);
+    uint8_t message[256];
+    memcpy(message, reply->dictionary, size);
+    fake_inject(message, size - 2);
+    reply = fake_reply_begin();
+    dict_write_uint32(reply, KEY_TIME, 1700000000);
+    dict_write_int32(reply, KEY_UTC_OFFSET, 0);
+    dict_write_uint8(reply, KEY_IS_DST, 0);
+    dict_write_cstring(reply, KEY_TZ_NAME, "Europe/London");
+    size = dict_write_end(reply);
+    memcpy(message, reply->dictionary, size);
+    fake_inject(message, size - 4);
+    CHECK_LOG("");
+    CHECK(!http_time_get(NULL, NULL, NULL, NULL));
+}
+
+static void dropped_messages_are_reported() {
+    test_begin();
+    fake_config.inbox_size = 32;
+    DictionaryIterator* reply = reply_http_begin(TEST_APP_ID, 9, true, 200);
+    dict_write_cstring(reply, 1, "more than the inbox can take");
+    fake_reply_send();
+    CHECK_EQ(fake_dropped_count, 1);
+    CHECK_LOG("failure 0 1128");
+}
+
+int main() {
+    RUN(http_response_goes_to_success);
+    RUN(http_error_goes_to_failure);
+    RUN(response_without_status_is_invalid);
+    RUN(messages_for_other_apps_are_ignored);
+    RUN(time_location_and_reconnect_need_no_app_id);
+    RUN(reserved_values_of_the_wrong_shape_are_ignored);
+    RUN(truncated_response_fails_its_request);
+    RUN(truncated_time_and_location_are_ignored);
+    RUN(dropped_messages_are_reported);
+    return test_report();
+}
@@ -0,0 +1,86 @@
+#include "test.h"
+
+static void send_request(int32_t request_id, int32_t value) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    dict_write_int32(iter, 1, value);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static void set_cookies(int32_t request_id, int32_t value, uint8_t count) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_cookie_set_start(request_id, &iter), HTTP_OK);
+    for(int i = 0; i < count; ++i) {
+        dict_write_int32(iter, 10 + i, value);
+    }
+    CHECK_EQ(http_cookie_set_end(), HTTP_OK);
+}
+
+static void offline_requests_are_replayed_on_reconnect() {
+    test_begin();
+    send_request(1, 5);
+    fake_nack(APP_MSG_NOT_CONNECTED);
+    CHECK_EQ(http_journal_count(), 1);
+    CHECK_EQ(http_queue_depth(), 0);
+    CHECK_LOG("");
+    fake_reconnect();
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK_EQ(sent_int(KEY_COOKIE), 1);
+    CHECK_EQ(sent_int(1), 5);
+    CHECK_EQ(http_journal_count(), 0);
+    fake_ack();
+    reply_http(1, 200);
+    CHECK_LOG("reconnect; success 1 200");
+}
+
+static void later_cookie_sets_supersede_journaled_ones() {
+    test_begin();
+    set_cookies(2, 1, 2);
+    fake_nack(APP_MSG_APP_NOT_RUNNING);
+    set_cookies(3, 2, 1);
+    fake_nack(APP_MSG_NOT_CONNECTED);
+    CHECK_EQ(http_journal_count(), 2);
+    fake_reconnect();
+    // Key 10 was set again, so only key 11 is left of the first set.
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), 2);
+    CHECK_EQ(sent_user_values(), 1);
+    CHECK_EQ(sent_int(11), 1);
+    fake_ack();
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), 3);
+    CHECK_EQ(sent_int(10), 2);
+}
+
+static void replay_is_rate_limited() {
+    test_begin();
+    for(int i = 1; i <= 4; ++i) {
+        send_request(i, i);
+        fake_nack(APP_MSG_NOT_CONNECTED);
+    }
+    CHECK_EQ(http_journal_count(), 4);
+    fake_reconnect();
+    CHECK_EQ(ack_all(), 2);
+    CHECK_EQ(http_journal_count(), 2);
+    fake_advance(1000);
+    CHECK_EQ(ack_all(), 2);
+    CHECK_EQ(sent_int(KEY_COOKIE), 4);
+    CHECK_EQ(http_journal_count(), 0);
+}
+
+static void oldest_entries_make_way_and_fail() {
+    test_begin();
+    for(int i = 1; i <= 20; ++i) {
+        send_request(i, i);
+        fake_nack(APP_MSG_NOT_CONNECTED);
+    }
+    const char* log = test_log_take();
+    CHECK(strncmp(log, "failure 1 1008; failure 2 1008", 30) == 0);
+    CHECK(http_journal_count() > 0 && http_journal_count() < 20);
+}
+
+int main() {
+    RUN(offline_requests_are_replayed_on_reconnect);
+    RUN(later_cookie_sets_supersede_journaled_ones);
+    RUN(replay_is_rate_limited);
+    RUN(oldest_entries_make_way_and_fail);
+    return test_report();
+}
@@ -0,0 +1,149 @@
+#include "test.h"
+
+static void waiter(float latitude, float longitude, float altitude, float accuracy, void* context) {
+    (void)longitude;
+    (void)altitude;
+    test_logf("waiter %s %g %g", (const char*)context, latitude, accuracy);
+}
+
+static void waiters_share_one_request() {
+    test_begin();
+    CHECK_EQ(http_location_get(60, 100, waiter, "a"), HTTP_OK);
+    CHECK_EQ(http_location_get(60, 100, waiter, "b"), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK(sent_has(KEY_LOCATION));
+    fake_ack();
+    reply_location(50, 51.5f, -0.25f, 0);
+    CHECK_LOG("waiter a 51.5 50; waiter b 51.5 50; location 51.5 -0.25 0 50");
+}
+
+static void fresh_enough_fixes_are_answered_locally() {
+    test_begin();
+    http_location_get(60, 100, waiter, "a");
+    fake_ack();
+    reply_location(50, 51.5f, -0.25f, 0);
+    test_log_take();
+    fake_advance(30000);
+    CHECK_EQ(http_location_get(60, 100, waiter, "c"), HTTP_OK);
+    CHECK_LOG("waiter c 51.5 50");
+    CHECK_EQ(fake_sent_count, 1);
+}
+
+static void old_or_rough_fixes_are_refreshed() {
+    test_begin();
+    http_location_get(60, 100, waiter, "a");
+    fake_ack();
+    reply_location(50, 51.5f, -0.25f, 0);
+    test_log_take();
+    CHECK_EQ(http_location_get(60, 10, waiter, "d"), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 2);
+    fake_ack();
+    reply_location(5, 52, 0, 0);
+    CHECK_LOG("waiter d 52 5; location 52 0 0 5");
+    fake_advance(61000);
+    CHECK_EQ(http_location_get(60, 1000, waiter, "e"), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 3);
+    CHECK_LOG("");
+}
+
+static void waiters_are_limited() {
+    test_begin();
+    for(int i = 0; i < 4; ++i) {
+        CHECK_EQ(http_location_get(60, 100, waiter, "w"), HTTP_OK);
+    }
+    CHECK_EQ(http_location_get(60, 100, waiter, "x"), HTTP_BUSY);
+    CHECK_EQ(http_location_get(60, 100, NULL, NULL), HTTP_INVALID_ARGS);
+}
+
+static void asks_again(float latitude, float longitude, float altitude, float accuracy, void* context) {
+    (void)longitude;
+    (void)altitude;
+    (void)context;
+    test_logf("asker %g %g", latitude, accuracy);
+    CHECK_EQ(http_location_get(60, 10, waiter, "again"), HTTP_OK);
+}
+
+static void waiters_may_ask_again_from_their_handler() {
+    test_begin();
+    http_location_get(60, 100, asks_again, NULL);
+    uint32_t sent = fake_sent_count;
+    fake_ack();
+    reply_location(50, 1, 2, 3);
+    // Too rough for the second ask, so it waits for the next fix.
+    CHECK_EQ(fake_sent_count, sent + 1);
+    fake_ack();
+    reply_location(5, 1, 2, 3);
+    CHECK_LOG("asker 1 50; location 1 2 3 50; waiter again 1 5; location 1 2 3 5");
+}
+
+static void waiters_hear_about_failures() {
+    test_begin();
+    CHECK_EQ(http_location_get(60, 100, waiter, "a"), HTTP_OK);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("waiter a 0 -1; failure 0 1004");
+    // The next caller asks again.
+    CHECK_EQ(http_location_get(60, 100, waiter, "b"), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 2);
+    fake_ack();
+    reply_location(50, 1, 2, 3);
+    CHECK_LOG("waiter b 1 50; location 1 2 3 50");
+}
+
+static void untracked_refreshes_dont_block_later_ones() {
+    test_begin();
+    // Fill the in-flight table with requests that are never answered.
+    http_set_priority(HTTP_PRIORITY_INTERACTIVE);
+    for(int i = 0; i < 8; ++i) {
+        DictionaryIterator* iter;
+        CHECK_EQ(http_out_get("http://example.com/", 100 + i, &iter), HTTP_OK);
+        CHECK_EQ(http_out_send(), HTTP_OK);
+        fake_ack();
+    }
+    http_set_priority(HTTP_PRIORITY_NORMAL);
+    uint32_t sent = fake_sent_count;
+    CHECK_EQ(http_location_get(60, 100, waiter, "a"), HTTP_OK);
+    CHECK_EQ(fake_sent_count, sent + 1);
+    // Nothing would time it out, so the waiter isn't kept waiting on it.
+    fake_ack();
+    CHECK_LOG("waiter a 0 -1");
+    CHECK_EQ(http_location_get(60, 100, waiter, "b"), HTTP_OK);
+    CHECK_EQ(fake_sent_count, sent + 2);
+    fake_ack();
+    CHECK_LOG("waiter b 0 -1");
+    reply_location(50, 1, 2, 3);
+    CHECK_LOG("location 1 2 3 50");
+    fake_advance(31000);
+    test_log_take();
+}
+
+static void each_waiter_gets_the_accuracy_it_asked_for() {
+    test_begin();
+    fake_advance(61000);
+    CHECK_EQ(http_location_get(60, 10, waiter, "fine"), HTTP_OK);
+    CHECK_EQ(http_location_get(60, 100, waiter, "rough"), HTTP_OK);
+    uint32_t sent = fake_sent_count;
+    fake_ack();
+    reply_location(50, 1, 2, 3);
+    CHECK_LOG("waiter rough 1 50; location 1 2 3 50");
+    CHECK_EQ(fake_sent_count, sent + 1);
+    fake_ack();
+    reply_location(20, 1, 2, 3);
+    CHECK_EQ(fake_sent_count, sent + 2);
+    fake_ack();
+    // Three fixes and none good enough: give up.
+    reply_location(30, 1, 2, 3);
+    CHECK_LOG("location 1 2 3 20; waiter fine 0 -1; location 1 2 3 30");
+    CHECK_EQ(fake_sent_count, sent + 2);
+}
+
+int main() {
+    RUN(waiters_share_one_request);
+    RUN(fresh_enough_fixes_are_answered_locally);
+    RUN(old_or_rough_fixes_are_refreshed);
+    RUN(waiters_are_limited);
+    RUN(waiters_may_ask_again_from_their_handler);
+    RUN(waiters_hear_about_failures);
+    RUN(untracked_refreshes_dont_block_later_ones);
+    RUN(each_waiter_gets_the_accuracy_it_asked_for);
+    return test_report();
+}
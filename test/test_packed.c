@@ -0,0 +1,117 @@
+#include "test.h"
+
+// Logs the values the app is given, as key=value.
+static void values_success(int32_t request_id, int http_status, DictionaryIterator* received, void* context) {
+    (void)context;
+    char values[128] = "";
+    size_t used = 0;
+    for(Tuple* tuple = dict_read_first(received); tuple; tuple = dict_read_next(received)) {
+        if(tuple->key >= 0xFF00) continue;
+        long value = 0;
+        switch(tuple->type) {
+        case TUPLE_INT:
+            value = tuple->length == 1 ? tuple->value->int8 : tuple->length == 2 ? tuple->value->int16 : tuple->value->int32;
+            break;
+        case TUPLE_UINT:
+            value = tuple->length == 1 ? tuple->value->uint8 : tuple->length == 2 ? tuple->value->uint16 : tuple->value->uint32;
+            break;
+        default:
+            value = tuple->length;
+            break;
+        }
+        if(tuple->type == TUPLE_CSTRING) {
+            used += snprintf(values + used, sizeof(values) - used, " %lu=%s", (unsigned long)tuple->key, tuple->value->cstring);
+        } else {
+            used += snprintf(values + used, sizeof(values) - used, " %lu=%ld", (unsigned long)tuple->key, value);
+        }
+    }
+    test_logf("success %ld %d%s", (long)request_id, http_status, values);
+}
+
+static void begin() {
+    test_begin();
+    HTTPCallbacks callbacks = test_callbacks;
+    callbacks.success = values_success;
+    http_register_callbacks(callbacks, NULL);
+}
+
+static void send_request(int32_t request_id) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    dict_write_int32(iter, 1, -5);
+    dict_write_uint8(iter, 2, 200);
+    dict_write_cstring(iter, 3, "hi");
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static void reply_packed(int32_t request_id, uint32_t key, const uint8_t* values, uint16_t size) {
+    DictionaryIterator* reply = reply_http_begin(TEST_APP_ID, request_id, true, 200);
+    dict_write_cstring(reply, 5, "plain");
+    dict_write_data(reply, key, values, size);
+    fake_reply_send();
+}
+
+static void request_integers_are_packed() {
+    begin();
+    send_request(1);
+    CHECK(!sent_has(1));
+    CHECK(!sent_has(2));
+    CHECK(sent_has(3));
+    Tuple* packed = fake_sent_find(KEY_PACKED);
+    CHECK(packed);
+    const uint8_t expected[] = { 2, 3 | (4 << 2), 9, 2, 2 | (1 << 2), 0xc8, 0x01 };
+    CHECK_EQ(packed->length, sizeof(expected));
+    CHECK(memcmp(packed->value->data, expected, sizeof(expected)) == 0);
+}
+
+static void packed_responses_are_unpacked() {
+    begin();
+    send_request(1);
+    fake_ack();
+    const uint8_t values[] = {
+        2, 3 | (1 << 2), 9,
+        2, 2 | (1 << 2), 0xc8, 0x01,
+        4, 1 | (3 << 2), 'y', 'o', 0,
+        1, 0 | (2 << 2), 9, 8,
+    };
+    reply_packed(1, KEY_PACKED, values, sizeof(values));
+    CHECK_LOG("success 1 200 5=plain 1=-5 2=200 4=yo 3=2");
+}
+
+static void compressed_responses_are_expanded() {
+    begin();
+    send_request(1);
+    fake_ack();
+    // "abc", then six bytes copied from three back: "abcabcabc".
+    const uint8_t compressed[] = { 4, 2, 1 | (10 << 2), 'a', 'b', 'c', 0x80 | 3, 3, 0, 0 };
+    reply_packed(1, KEY_COMPRESSED, compressed, sizeof(compressed));
+    CHECK_LOG("success 1 200 5=plain 1=abcabcabc");
+}
+
+static void malformed_values_fail_the_request() {
+    begin();
+    send_request(1);
+    fake_ack();
+    const uint8_t values[] = { 2, 1 | (5 << 2), 'x' };
+    reply_packed(1, KEY_PACKED, values, sizeof(values));
+    CHECK_LOG("failure 1 132072");
+}
+
+static void oversized_values_fail_the_request() {
+    begin();
+    send_request(1);
+    fake_ack();
+    // A 200 byte string, "aaa...", which with the rest of the response won't fit once unpacked.
+    const uint8_t compressed[] = { 3, 2, 0xa1, 0x06, 'a', 0x80 | 127, 1, 0x80 | 65, 1, 0, 0 };
+    reply_packed(1, KEY_COMPRESSED, compressed, sizeof(compressed));
+    CHECK_LOG("failure 1 1128");
+}
+
+int main() {
+    RUN(request_integers_are_packed);
+    RUN(packed_responses_are_unpacked);
+    RUN(compressed_responses_are_expanded);
+    RUN(malformed_values_fail_the_request);
+    RUN(oversized_values_fail_the_request);
+    return test_report();
+}
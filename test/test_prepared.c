@@ -0,0 +1,69 @@
+#include "test.h"
+
+static uint8_t prepared[64];
+
+static uint16_t prepare(int32_t request_id) {
+    DictionaryIterator iter;
+    CHECK_EQ(http_out_prepare(&iter, prepared, sizeof(prepared), "http://example.com/", request_id), HTTP_OK);
+    dict_write_int32(&iter, 1, 42);
+    dict_write_cstring(&iter, 2, "hi");
+    return dict_write_end(&iter);
+}
+
+static void prepared_requests_go_out_as_built() {
+    test_begin();
+    uint16_t size = prepare(5);
+    CHECK_EQ(fake_sent_count, 0);
+    CHECK_EQ(http_out_send_prepared(prepared, size), HTTP_OK);
+    uint16_t sent_size;
+    const uint8_t* sent = fake_last_sent(&sent_size);
+    CHECK_EQ(sent_size, size);
+    CHECK(memcmp(sent, prepared, size) == 0);
+    CHECK_EQ(sent_int(KEY_COOKIE), 5);
+    CHECK_EQ(sent_int(KEY_APP_ID), TEST_APP_ID);
+    fake_ack();
+    reply_http(5, 200);
+    CHECK_LOG("success 5 200");
+}
+
+static void prepared_requests_can_be_sent_again() {
+    test_begin();
+    uint16_t size = prepare(5);
+    CHECK_EQ(http_out_send_prepared(prepared, size), HTTP_OK);
+    CHECK_EQ(http_out_send_prepared(prepared, size), HTTP_OK);
+    CHECK_EQ(http_queue_depth(), 1);
+    memset(prepared, 0, sizeof(prepared));
+    fake_ack();
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK_EQ(sent_int(KEY_COOKIE), 5);
+    CHECK_EQ(sent_int(1), 42);
+}
+
+static void failures_are_reported_as_usual() {
+    test_begin();
+    uint16_t size = prepare(5);
+    CHECK_EQ(http_out_send_prepared(prepared, size), HTTP_OK);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("failure 5 1004");
+}
+
+static void buffers_are_checked() {
+    test_begin();
+    uint16_t size = prepare(5);
+    http_set_app_id(8);
+    CHECK_EQ(http_out_send_prepared(prepared, size), HTTP_INVALID_ARGS);
+    http_set_app_id(TEST_APP_ID);
+    const uint8_t empty[1] = { 0 };
+    CHECK_EQ(http_out_send_prepared(empty, sizeof(empty)), HTTP_INVALID_ARGS);
+    DictionaryIterator iter;
+    CHECK_EQ(http_out_prepare(&iter, prepared, 16, "http://example.com/", 5), HTTP_NOT_ENOUGH_STORAGE);
+    CHECK_EQ(fake_sent_count, 0);
+}
+
+int main() {
+    RUN(prepared_requests_go_out_as_built);
+    RUN(prepared_requests_can_be_sent_again);
+    RUN(failures_are_reported_as_usual);
+    RUN(buffers_are_checked);
+    return test_report();
+}
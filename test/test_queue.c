@@ -0,0 +1,134 @@
+#include "test.h"
+
+static HTTPResult request(int32_t request_id) {
+    DictionaryIterator* iter;
+    HTTPResult result = http_out_get("http://example.com/", request_id, &iter);
+    if(result != HTTP_OK) return result;
+    dict_write_int32(iter, 1, request_id);
+    return http_out_send();
+}
+
+static HTTPResult request_at(int32_t request_id, HTTPPriority priority) {
+    http_set_priority(priority);
+    return request(request_id);
+}
+
+static void sends_straight_away_when_idle() {
+    test_begin();
+    CHECK_EQ(request(1), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK_EQ(http_queue_depth(), 0);
+    CHECK_EQ(sent_int(KEY_COOKIE), 1);
+    CHECK_EQ(sent_int(KEY_APP_ID), TEST_APP_ID);
+    CHECK_EQ(sent_int(1), 1);
+    CHECK_EQ(sent_user_values(), 1);
+}
+
+static void queues_while_the_outbox_is_busy() {
+    test_begin();
+    for(int i = 1; i <= 4; ++i) {
+        CHECK_EQ(request(i), HTTP_OK);
+    }
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK_EQ(http_queue_depth(), 3);
+    for(int i = 2; i <= 4; ++i) {
+        fake_ack();
+        CHECK_EQ(sent_int(KEY_COOKIE), i);
+        CHECK_EQ(sent_int(1), i);
+    }
+    CHECK_EQ(http_queue_depth(), 0);
+    CHECK_LOG("");
+}
+
+static void full_queue_reports_busy() {
+    test_begin();
+    for(int i = 1; i <= 5; ++i) {
+        CHECK_EQ(request(i), HTTP_OK);
+    }
+    CHECK_EQ(request(6), HTTP_BUSY);
+    CHECK_EQ(http_queue_overflows(), 1);
+    fake_ack();
+    CHECK_EQ(request(6), HTTP_OK);
+    CHECK_EQ(ack_all(), 5);
+    CHECK_EQ(sent_int(KEY_COOKIE), 6);
+}
+
+static void only_one_message_is_built_at_a_time() {
+    test_begin();
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", 1, &iter), HTTP_OK);
+    CHECK_EQ(http_out_get("http://example.com/", 2, &iter), HTTP_BUSY);
+    CHECK_EQ(http_cookie_get(3, 1), HTTP_BUSY);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+    CHECK_EQ(http_cookie_get(3, 1), HTTP_OK);
+}
+
+static void higher_classes_go_first() {
+    test_begin();
+    request_at(1, HTTP_PRIORITY_NORMAL);
+    request_at(2, HTTP_PRIORITY_BACKGROUND);
+    request_at(3, HTTP_PRIORITY_NORMAL);
+    request_at(4, HTTP_PRIORITY_INTERACTIVE);
+    int32_t order[] = {4, 3, 2};
+    for(int i = 0; i < 3; ++i) {
+        fake_ack();
+        CHECK_EQ(sent_int(KEY_COOKIE), order[i]);
+    }
+}
+
+static void passed_over_messages_age_into_a_higher_class() {
+    test_begin();
+    request_at(1, HTTP_PRIORITY_INTERACTIVE);
+    request_at(2, HTTP_PRIORITY_NORMAL);
+    // Interactive requests keep overtaking until request 2 has aged enough.
+    int32_t next = 10;
+    request_at(next++, HTTP_PRIORITY_INTERACTIVE);
+    bool sent = false;
+    for(int i = 0; i < 8 && !sent; ++i) {
+        fake_ack();
+        sent = sent_int(KEY_COOKIE) == 2;
+        request_at(next++, HTTP_PRIORITY_INTERACTIVE);
+        reply_http(sent_int(KEY_COOKIE), 200);
+    }
+    CHECK(sent);
+}
+
+static void background_requests_are_limited_in_flight() {
+    test_begin();
+    for(int i = 1; i <= 3; ++i) {
+        request_at(i, HTTP_PRIORITY_BACKGROUND);
+        fake_ack();
+    }
+    // Two are awaiting their answers, so the third waits.
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK_EQ(http_queue_depth(), 1);
+    reply_http(1, 200);
+    CHECK_EQ(fake_sent_count, 3);
+    CHECK_EQ(sent_int(KEY_COOKIE), 3);
+    CHECK_LOG("success 1 200");
+}
+
+static void cookie_operations_keep_their_order() {
+    test_begin();
+    request_at(1, HTTP_PRIORITY_NORMAL);
+    http_set_priority(HTTP_PRIORITY_BACKGROUND);
+    CHECK_EQ(http_cookie_set_int32(2, 5, 50), HTTP_OK);
+    http_set_priority(HTTP_PRIORITY_INTERACTIVE);
+    CHECK_EQ(http_cookie_get(3, 5), HTTP_OK);
+    fake_ack();
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), 2);
+    fake_ack();
+    CHECK_EQ(sent_int(KEY_COOKIE_LOAD), 3);
+}
+
+int main() {
+    RUN(sends_straight_away_when_idle);
+    RUN(queues_while_the_outbox_is_busy);
+    RUN(full_queue_reports_busy);
+    RUN(only_one_message_is_built_at_a_time);
+    RUN(higher_classes_go_first);
+    RUN(passed_over_messages_age_into_a_higher_class);
+    RUN(background_requests_are_limited_in_flight);
+    RUN(cookie_operations_keep_their_order);
+    return test_report();
+}
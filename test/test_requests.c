@@ -0,0 +1,97 @@
+#include "test.h"
+
+static void send_request(int32_t request_id) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static void unanswered_requests_time_out() {
+    test_begin();
+    send_request(1);
+    fake_ack();
+    send_request(2);
+    fake_ack();
+    reply_http(2, 200);
+    CHECK_LOG("success 2 200");
+    fake_advance(29000);
+    CHECK_LOG("");
+    fake_advance(2000);
+    CHECK_LOG("failure 1 1002");
+    // Nothing is left to wait for.
+    fake_advance(60000);
+    CHECK_LOG("");
+}
+
+static void each_request_has_its_own_deadline() {
+    test_begin();
+    send_request(1);
+    fake_ack();
+    fake_advance(10000);
+    send_request(2);
+    fake_ack();
+    fake_advance(21000);
+    CHECK_LOG("failure 1 1002");
+    fake_advance(10000);
+    CHECK_LOG("failure 2 1002");
+}
+
+static void rejected_sends_fail_straight_away() {
+    test_begin();
+    send_request(1);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("failure 1 1004");
+    // And are not also timed out later.
+    fake_advance(60000);
+    CHECK_LOG("");
+}
+
+static void timed_out_sends_fail_straight_away() {
+    test_begin();
+    // The bridge may have got it, so it isn't sent again unless HTTP_RETRY_TIMEOUTS is defined.
+    send_request(1);
+    fake_nack(APP_MSG_SEND_TIMEOUT);
+    CHECK_LOG("failure 1 1002");
+    CHECK_EQ(http_queue_depth(), 0);
+    // Busy phones are still retried.
+    send_request(2);
+    fake_nack(APP_MSG_BUSY);
+    CHECK_LOG("");
+    CHECK_EQ(http_queue_depth(), 1);
+    fake_advance(8000);
+    fake_ack();
+    reply_http(2, 200);
+    CHECK_LOG("success 2 200");
+}
+
+static void cookie_requests_are_tracked_too() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_int32(3, 1, 10), HTTP_OK);
+    fake_ack();
+    CHECK_EQ(http_cookie_get(4, 1), HTTP_OK);
+    fake_ack();
+    reply_cookie(KEY_COOKIE_STORE, 3);
+    CHECK_LOG("cookie_set 3 1");
+    fake_advance(31000);
+    CHECK_LOG("failure 4 1002");
+}
+
+static void late_answers_are_still_passed_on() {
+    test_begin();
+    send_request(1);
+    fake_ack();
+    fake_advance(31000);
+    CHECK_LOG("failure 1 1002");
+    reply_http(1, 200);
+    CHECK_LOG("success 1 200");
+}
+
+int main() {
+    RUN(unanswered_requests_time_out);
+    RUN(each_request_has_its_own_deadline);
+    RUN(rejected_sends_fail_straight_away);
+    RUN(timed_out_sends_fail_straight_away);
+    RUN(cookie_requests_are_tracked_too);
+    RUN(late_answers_are_still_passed_on);
+    return test_report();
+}
@@ -0,0 +1,106 @@
+#include "test.h"
+
+static HTTPResult request_again(int32_t request_id, void* context) {
+    (void)context;
+    test_logf("resync %ld", (long)request_id);
+    DictionaryIterator* iter;
+    HTTPResult result = http_out_get("http://example.com/", request_id, &iter);
+    if(result != HTTP_OK) return result;
+    return http_out_send();
+}
+
+static HTTPResult cookies_again(int32_t request_id, void* context) {
+    (void)context;
+    test_logf("resync %ld", (long)request_id);
+    return http_cookie_get(request_id, 5);
+}
+
+static void answer_request(int32_t request_id) {
+    fake_ack();
+    reply_http(request_id, 200);
+}
+
+static void stale_items_are_sent_on_reconnect() {
+    test_begin();
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 1, 60, request_again, NULL), HTTP_OK);
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_COOKIES, 2, 60, cookies_again, NULL), HTTP_OK);
+    request_again(1, NULL);
+    answer_request(1);
+    test_log_take();
+    fake_advance(30000);
+    fake_reconnect();
+    // The request is fresh; the cookies were never loaded.
+    CHECK_LOG("resync 2; reconnect");
+    CHECK_EQ(sent_int(KEY_COOKIE_LOAD), 2);
+    CHECK_EQ(http_resync_pending(), 0);
+}
+
+static void items_are_paced() {
+    test_begin();
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 1, 60, request_again, NULL), HTTP_OK);
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 2, 60, request_again, NULL), HTTP_OK);
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 3, 60, request_again, NULL), HTTP_OK);
+    fake_reconnect();
+    // The second waits in the queue; the third waits for it to leave.
+    CHECK_LOG("resync 1; reconnect; resync 2");
+    CHECK_EQ(http_resync_pending(), 1);
+    answer_request(1);
+    CHECK_LOG("success 1 200");
+    answer_request(2);
+    CHECK_LOG("success 2 200");
+    // No more than two a second.
+    fake_advance(1000);
+    CHECK_LOG("resync 3");
+    CHECK_EQ(http_resync_pending(), 0);
+}
+
+static void time_and_location_are_refreshed() {
+    test_begin();
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_TIME, 0, 60, NULL, NULL), HTTP_OK);
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_LOCATION, 0, 3600, NULL, NULL), HTTP_OK);
+    fake_reconnect();
+    CHECK(sent_has(KEY_TIME));
+    fake_ack();
+    reply_time(1700000000, 0, false, "UTC");
+    CHECK(sent_has(KEY_LOCATION));
+    fake_ack();
+    reply_location(10, 1, 2, 3);
+    CHECK_LOG("reconnect; time 0 0 1700000000 UTC; location 1 2 3 10");
+    fake_advance(100000);
+    fake_reconnect();
+    // Only the time is older than allowed.
+    CHECK(sent_has(KEY_TIME));
+    CHECK_EQ(ack_all(), 1);
+}
+
+static void requests_already_waiting_are_skipped() {
+    test_begin();
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 1, 60, request_again, NULL), HTTP_OK);
+    request_again(1, NULL);
+    test_log_take();
+    fake_reconnect();
+    CHECK_LOG("reconnect");
+    CHECK_EQ(fake_sent_count, 1);
+}
+
+static void registrations_are_checked() {
+    test_begin();
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 3, 60, NULL, NULL), HTTP_INVALID_ARGS);
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 1, 60, request_again, NULL), HTTP_OK);
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 1, 600, request_again, NULL), HTTP_OK);
+    for(int32_t id = 2; id <= 8; ++id) {
+        CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, id, 60, request_again, NULL), HTTP_OK);
+    }
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 9, 60, request_again, NULL), HTTP_NOT_ENOUGH_STORAGE);
+    http_resync_unregister(HTTP_RESYNC_REQUEST, 8);
+    CHECK_EQ(http_resync_register(HTTP_RESYNC_REQUEST, 9, 60, request_again, NULL), HTTP_OK);
+}
+
+int main() {
+    RUN(stale_items_are_sent_on_reconnect);
+    RUN(items_are_paced);
+    RUN(time_and_location_are_refreshed);
+    RUN(requests_already_waiting_are_skipped);
+    RUN(registrations_are_checked);
+    return test_report();
+}
@@ -0,0 +1,81 @@
+#include "test.h"
+
+static void send_request(int32_t request_id) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    dict_write_int32(iter, 1, 42);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static void busy_sends_are_retried_with_backoff() {
+    test_begin();
+    send_request(1);
+    fake_nack(APP_MSG_BUSY);
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK_EQ(http_queue_depth(), 1);
+    // The first retry waits one to two seconds.
+    fake_advance(999);
+    CHECK_EQ(fake_sent_count, 1);
+    fake_advance(1001);
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK_EQ(sent_int(KEY_COOKIE), 1);
+    CHECK_EQ(sent_int(1), 42);
+    CHECK_LOG("");
+}
+
+static void retries_give_up_after_the_limit() {
+    test_begin();
+    send_request(1);
+    for(int attempt = 0; attempt < 3; ++attempt) {
+        fake_nack(APP_MSG_SEND_TIMEOUT);
+        fake_advance(8000);
+        CHECK_EQ(fake_sent_count, attempt + 2);
+    }
+    CHECK_LOG("");
+    fake_nack(APP_MSG_SEND_TIMEOUT);
+    CHECK_LOG("failure 1 1002");
+    CHECK_EQ(http_queue_depth(), 0);
+}
+
+static void retries_wait_for_the_phone_to_come_back() {
+    test_begin();
+    send_request(1);
+    fake_nack(APP_MSG_NOT_CONNECTED);
+    fake_advance(100000);
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK_LOG("");
+    fake_reconnect();
+    CHECK_EQ(fake_sent_count, 2);
+    fake_ack();
+    reply_http(1, 200);
+    CHECK_LOG("reconnect; success 1 200");
+}
+
+static void rejected_sends_are_not_retried() {
+    test_begin();
+    send_request(1);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("failure 1 1004");
+    CHECK_EQ(http_queue_depth(), 0);
+}
+
+static void retries_keep_their_place_behind_new_work() {
+    test_begin();
+    send_request(1);
+    fake_nack(APP_MSG_SEND_TIMEOUT);
+    // The backing-off retry doesn't hold up a new request.
+    send_request(2);
+    CHECK_EQ(sent_int(KEY_COOKIE), 2);
+    fake_ack();
+    fake_advance(2000);
+    CHECK_EQ(sent_int(KEY_COOKIE), 1);
+}
+
+int main() {
+    RUN(busy_sends_are_retried_with_backoff);
+    RUN(retries_give_up_after_the_limit);
+    RUN(retries_wait_for_the_phone_to_come_back);
+    RUN(rejected_sends_are_not_retried);
+    RUN(retries_keep_their_place_behind_new_work);
+    return test_report();
+}
@@ -0,0 +1,136 @@
+#include "test.h"
+
+static void module_success(int32_t request_id, int32_t http_status, DictionaryIterator* received, void* context) {
+    (void)received;
+    test_logf("%s success %ld %ld", (const char*)context, (long)request_id, (long)http_status);
+}
+
+static void module_failure(int32_t request_id, int32_t http_status, void* context) {
+    test_logf("%s failure %ld %ld", (const char*)context, (long)request_id, (long)http_status);
+}
+
+static void module_reconnect(void* context) {
+    test_logf("%s reconnect", (const char*)context);
+}
+
+static void module_time(int32_t utc_offset_seconds, bool is_dst, uint32_t unixtime, const char* tz_name, void* context) {
+    (void)utc_offset_seconds;
+    (void)is_dst;
+    (void)tz_name;
+    test_logf("%s time %lu", (const char*)context, (unsigned long)unixtime);
+}
+
+static void module_location(float latitude, float longitude, float altitude, float accuracy, void* context) {
+    (void)latitude;
+    (void)longitude;
+    (void)altitude;
+    test_logf("%s location %d", (const char*)context, (int)accuracy);
+}
+
+static const HTTPCallbacks module_callbacks = {
+    .success = module_success,
+    .failure = module_failure,
+    .reconnect = module_reconnect,
+    .time = module_time,
+    .location = module_location,
+};
+
+static void send_request(int32_t app_id, int32_t request_id) {
+    http_set_app_id(app_id);
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+    fake_ack();
+}
+
+static void begin_with_modules() {
+    test_begin();
+    CHECK(http_register_app(20, module_callbacks, "a"));
+    CHECK(http_register_app(30, module_callbacks, "b"));
+}
+
+static void responses_go_to_their_app() {
+    begin_with_modules();
+    send_request(TEST_APP_ID, 1);
+    send_request(20, 2);
+    send_request(30, 3);
+    http_set_app_id(TEST_APP_ID);
+    reply_http_begin(20, 2, true, 200);
+    fake_reply_send();
+    reply_http_begin(30, 3, true, 201);
+    fake_reply_send();
+    reply_http(1, 202);
+    reply_http_begin(40, 4, true, 200);
+    fake_reply_send();
+    CHECK_LOG("a success 2 200; b success 3 201; success 1 202");
+}
+
+static void failures_go_to_the_app_that_sent() {
+    begin_with_modules();
+    send_request(20, 1);
+    send_request(30, 2);
+    http_set_app_id(TEST_APP_ID);
+    fake_advance(31000);
+    CHECK_LOG("a failure 1 1002; b failure 2 1002");
+    http_set_app_id(30);
+    DictionaryIterator* iter;
+    http_out_get("http://example.com/", 3, &iter);
+    http_out_send();
+    http_set_app_id(TEST_APP_ID);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("b failure 3 1004");
+}
+
+static void reconnect_is_reported_to_everyone() {
+    begin_with_modules();
+    fake_reconnect();
+    CHECK_LOG("reconnect; a reconnect; b reconnect");
+}
+
+static void time_and_location_are_reported_to_everyone() {
+    begin_with_modules();
+    http_set_app_id(20);
+    CHECK_EQ(http_time_request(), HTTP_OK);
+    fake_ack();
+    http_set_app_id(TEST_APP_ID);
+    reply_time(1000, 3600, false, "Europe/London");
+    CHECK_LOG("time 3600 0 1000 Europe/London; a time 1000; b time 1000");
+    http_set_app_id(30);
+    CHECK_EQ(http_location_request(), HTTP_OK);
+    fake_ack();
+    http_set_app_id(TEST_APP_ID);
+    reply_location(25.f, 1.f, 2.f, 3.f);
+    CHECK_LOG("location 1 2 3 25; a location 25; b location 25");
+}
+
+static void unregistered_apps_are_ignored() {
+    begin_with_modules();
+    http_unregister_app(20);
+    reply_http_begin(20, 1, true, 200);
+    fake_reply_send();
+    CHECK_LOG("");
+    // Unless the main callbacks take that id over.
+    http_set_app_id(20);
+    reply_http_begin(20, 1, true, 200);
+    fake_reply_send();
+    CHECK_LOG("success 1 200");
+}
+
+static void routes_are_limited() {
+    test_begin();
+    for(int32_t app_id = 1; app_id <= 4; ++app_id) {
+        CHECK(http_register_app(100 + app_id, module_callbacks, "x"));
+    }
+    CHECK(http_register_app(101, module_callbacks, "y"));
+    CHECK(!http_register_app(200, module_callbacks, "z"));
+}
+
+int main() {
+    RUN(responses_go_to_their_app);
+    RUN(failures_go_to_the_app_that_sent);
+    RUN(reconnect_is_reported_to_everyone);
+    RUN(time_and_location_are_reported_to_everyone);
+    RUN(unregistered_apps_are_ignored);
+    RUN(routes_are_limited);
+    return test_report();
+}
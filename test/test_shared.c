@@ -0,0 +1,89 @@
+#include "test.h"
+
+static void send_request(int32_t request_id, int32_t value) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    dict_write_int32(iter, 1, value);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static void identical_requests_share_one_response() {
+    test_begin();
+    send_request(1, 5);
+    send_request(2, 5);
+    send_request(3, 6);
+    CHECK_EQ(ack_all(), 2);
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK_EQ(sent_int(KEY_COOKIE), 3);
+    reply_http(1, 200);
+    CHECK_LOG("success 1 200; success 2 200");
+    reply_http(3, 200);
+    CHECK_LOG("success 3 200");
+}
+
+static void failures_are_shared_too() {
+    test_begin();
+    send_request(1, 5);
+    send_request(2, 5);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("failure 2 1004; failure 1 1004");
+}
+
+static void answered_requests_are_sent_again() {
+    test_begin();
+    send_request(1, 5);
+    fake_ack();
+    reply_http(1, 200);
+    send_request(2, 5);
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK_EQ(sent_int(KEY_COOKIE), 2);
+}
+
+static void streamed_requests_are_not_shared() {
+    test_begin();
+    DictionaryIterator* iter;
+    for(int32_t id = 1; id <= 2; ++id) {
+        CHECK_EQ(http_out_get("http://example.com/", id, &iter), HTTP_OK);
+        CHECK_EQ(http_out_stream(NULL, 0), HTTP_OK);
+        CHECK_EQ(http_out_send(), HTTP_OK);
+    }
+    CHECK_EQ(ack_all(), 2);
+}
+
+static void requests_that_only_hash_alike_are_not_shared() {
+    test_begin();
+    // These two values give the same fingerprint.
+    send_request(1, 644220227);
+    send_request(2, 420109927);
+    CHECK_EQ(ack_all(), 2);
+    CHECK_EQ(sent_int(1), 420109927);
+    reply_http(1, 200);
+    reply_http(2, 200);
+    CHECK_LOG("success 1 200; success 2 200");
+}
+
+static void long_requests_are_not_shared() {
+    test_begin();
+    char url[90];
+    memset(url, 'a', sizeof(url) - 1);
+    url[sizeof(url) - 1] = '\0';
+    DictionaryIterator* iter;
+    for(int32_t id = 1; id <= 2; ++id) {
+        CHECK_EQ(http_out_get(url, id, &iter), HTTP_OK);
+        CHECK_EQ(http_out_send(), HTTP_OK);
+    }
+    CHECK_EQ(ack_all(), 2);
+    reply_http(1, 200);
+    reply_http(2, 200);
+    test_log_take();
+}
+
+int main() {
+    RUN(identical_requests_share_one_response);
+    RUN(failures_are_shared_too);
+    RUN(answered_requests_are_sent_again);
+    RUN(streamed_requests_are_not_shared);
+    RUN(requests_that_only_hash_alike_are_not_shared);
+    RUN(long_requests_are_not_shared);
+    return test_report();
+}
@@ -0,0 +1,82 @@
+#include "test.h"
+
+static void send_request(int32_t request_id) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+}
+
+static void counters_follow_requests() {
+    test_begin();
+    send_request(1);
+    send_request(2);
+    fake_advance(3000);
+    ack_all();
+    fake_advance(5000);
+    reply_http(1, 200);
+    fake_advance(30000);
+    HTTPStats stats;
+    CHECK(http_stats_get(HTTP_STATS_HTTP, &stats));
+    CHECK_EQ(stats.sent, 2);
+    CHECK_EQ(stats.answered, 1);
+    CHECK_EQ(stats.failed, 1);
+    CHECK_EQ(stats.timeouts, 1);
+    CHECK_EQ(stats.busy, 0);
+    // The second waited three seconds behind the first, which was answered after eight.
+    CHECK_EQ(stats.wait[0], 1);
+    CHECK_EQ(stats.wait[2], 1);
+    CHECK_EQ(stats.latency[4], 1);
+    CHECK(http_stats_get(HTTP_STATS_COOKIE, &stats));
+    CHECK_EQ(stats.sent, 0);
+}
+
+static void busy_calls_are_counted() {
+    test_begin();
+    DictionaryIterator* iter;
+    for(int32_t id = 1; id <= 6; ++id) {
+        if(http_out_get("http://example.com/", id, &iter) == HTTP_OK) {
+            http_out_send();
+        }
+    }
+    HTTPStats stats;
+    http_stats_get(HTTP_STATS_HTTP, &stats);
+    CHECK_EQ(stats.busy, 1);
+    http_stats_reset();
+    http_stats_get(HTTP_STATS_HTTP, &stats);
+    CHECK_EQ(stats.busy, 0);
+}
+
+static void trace_records_each_step() {
+    test_begin();
+    send_request(1);
+    fake_ack();
+    reply_http(1, 200);
+    HTTPTraceEvent events[8];
+    CHECK_EQ(http_trace_read(events, 8), 2);
+    CHECK_EQ(events[0].kind, HTTP_TRACE_SENT);
+    CHECK_EQ(events[0].request_id, 1);
+    CHECK_EQ(events[1].kind, HTTP_TRACE_ANSWERED);
+    CHECK_EQ(events[1].request_id, 1);
+}
+
+static void trace_can_be_saved() {
+    test_begin();
+    send_request(1);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    test_log_take();
+    CHECK_EQ(http_trace_save(9, 42), HTTP_OK);
+    Tuple* saved = fake_sent_find(42);
+    CHECK(saved);
+    CHECK_EQ(saved->length, 2 * sizeof(HTTPTraceEvent));
+    fake_ack();
+    reply_cookie(KEY_COOKIE_STORE, 9);
+    CHECK_LOG("cookie_set 9 1");
+}
+
+int main() {
+    RUN(counters_follow_requests);
+    RUN(busy_calls_are_counted);
+    RUN(trace_records_each_step);
+    RUN(trace_can_be_saved);
+    return test_report();
+}
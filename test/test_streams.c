@@ -0,0 +1,99 @@
+#include "test.h"
+
+static void stream_request(int32_t request_id, uint8_t* buffer, uint16_t size) {
+    DictionaryIterator* iter;
+    CHECK_EQ(http_out_get("http://example.com/", request_id, &iter), HTTP_OK);
+    CHECK_EQ(http_out_stream(buffer, size), HTTP_OK);
+    CHECK_EQ(http_out_send(), HTTP_OK);
+    CHECK(sent_has(KEY_STREAM));
+    fake_ack();
+}
+
+static void send_fragment(int32_t request_id, uint16_t index, uint16_t count) {
+    DictionaryIterator* reply = reply_http_begin(TEST_APP_ID, request_id, true, 200);
+    dict_write_uint16(reply, KEY_FRAGMENT, index);
+    dict_write_uint16(reply, KEY_FRAGMENT_COUNT, count);
+    for(int i = 0; i < 3; ++i) {
+        dict_write_int32(reply, index * 10 + i + 1, index);
+    }
+    fake_reply_send();
+}
+
+static void fragments_are_reassembled() {
+    test_begin();
+    uint8_t buffer[256];
+    stream_request(1, buffer, sizeof(buffer));
+    for(int i = 0; i < 3; ++i) {
+        send_fragment(1, i, 3);
+    }
+    CHECK_LOG("success 1 200 1=0");
+    // The body of every fragment, without their headers.
+    CHECK_EQ(buffer[0], 9);
+}
+
+static void fragments_without_a_buffer_are_passed_on() {
+    test_begin();
+    stream_request(2, NULL, 0);
+    send_fragment(2, 0, 2);
+    send_fragment(2, 1, 2);
+    CHECK_LOG("fragment 2 0/2; fragment 2 1/2");
+}
+
+static void missing_fragments_fail_the_request() {
+    test_begin();
+    stream_request(3, NULL, 0);
+    send_fragment(3, 0, 3);
+    send_fragment(3, 2, 3);
+    CHECK_LOG("fragment 3 0/3; failure 3 132072");
+}
+
+static void overflowing_the_buffer_fails_the_request() {
+    test_begin();
+    uint8_t buffer[40];
+    stream_request(4, buffer, sizeof(buffer));
+    for(int i = 0; i < 3; ++i) {
+        send_fragment(4, i, 3);
+    }
+    CHECK_LOG("failure 4 1128");
+}
+
+static void fragments_keep_the_request_alive() {
+    test_begin();
+    stream_request(5, NULL, 0);
+    for(int i = 0; i < 3; ++i) {
+        fake_advance(20000);
+        send_fragment(5, i, 4);
+    }
+    CHECK_LOG("fragment 5 0/4; fragment 5 1/4; fragment 5 2/4");
+    fake_advance(31000);
+    CHECK_LOG("failure 5 1002");
+}
+
+static void fragments_after_a_gap_are_dropped() {
+    test_begin();
+    stream_request(6, NULL, 0);
+    send_fragment(6, 0, 4);
+    send_fragment(6, 2, 4);
+    send_fragment(6, 3, 4);
+    CHECK_LOG("fragment 6 0/4; failure 6 132072");
+    // The cookie can be streamed again.
+    stream_request(6, NULL, 0);
+    send_fragment(6, 0, 1);
+    CHECK_LOG("fragment 6 0/1");
+}
+
+static void stream_needs_a_request_being_built() {
+    test_begin();
+    CHECK_EQ(http_out_stream(NULL, 0), HTTP_INVALID_ARGS);
+}
+
+int main() {
+    RUN(fragments_are_reassembled);
+    RUN(fragments_without_a_buffer_are_passed_on);
+    RUN(missing_fragments_fail_the_request);
+    RUN(overflowing_the_buffer_fails_the_request);
+    RUN(fragments_keep_the_request_alive);
+    RUN(fragments_after_a_gap_are_dropped);
+    RUN(stream_needs_a_request_being_built);
+    return test_report();
+}
@@ -0,0 +1,163 @@
+#include "test.h"
+
+static void first_read_asks_the_phone() {
+    test_begin();
+    CHECK(!http_time_get(NULL, NULL, NULL, NULL));
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK(sent_has(KEY_TIME));
+    // Already on its way.
+    CHECK(!http_time_get(NULL, NULL, NULL, NULL));
+    CHECK_EQ(fake_sent_count, 1);
+    fake_ack();
+    reply_time(1700000000, 3600, false, "Europe/London");
+    CHECK_LOG("time 3600 0 1700000000 Europe/London");
+    int32_t offset;
+    bool is_dst;
+    uint32_t unixtime;
+    const char* name;
+    CHECK(http_time_get(&offset, &is_dst, &unixtime, &name));
+    CHECK_EQ(offset, 3600);
+    CHECK(!is_dst);
+    CHECK_EQ(unixtime, 1700000000);
+    CHECK(strcmp(name, "Europe/London") == 0);
+}
+
+static void cached_time_is_extrapolated() {
+    test_begin();
+    http_time_get(NULL, NULL, NULL, NULL);
+    fake_ack();
+    reply_time(1700000000, 0, false, "UTC");
+    fake_advance(100000);
+    uint32_t unixtime;
+    CHECK(http_time_get(NULL, NULL, &unixtime, NULL));
+    CHECK_EQ(unixtime, 1700000100);
+    CHECK_EQ(fake_sent_count, 1);
+}
+
+static void old_time_is_refreshed_in_the_background() {
+    test_begin();
+    http_time_get(NULL, NULL, NULL, NULL);
+    fake_ack();
+    reply_time(1700000000, 0, false, "UTC");
+    fake_advance(21600 * 1000);
+    uint32_t unixtime;
+    CHECK(http_time_get(NULL, NULL, &unixtime, NULL));
+    CHECK_EQ(unixtime, 1700021600);
+    CHECK_EQ(fake_sent_count, 2);
+    fake_ack();
+    reply_time(1800000000, 0, false, "UTC");
+    CHECK(http_time_get(NULL, NULL, &unixtime, NULL));
+    CHECK_EQ(unixtime, 1800000000);
+}
+
+static void failed_refresh_is_tried_again() {
+    test_begin();
+    http_time_get(NULL, NULL, NULL, NULL);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    // Internal requests don't bother the app.
+    CHECK_LOG("");
+    http_time_get(NULL, NULL, NULL, NULL);
+    CHECK_EQ(fake_sent_count, 2);
+}
+
+static void reconnect_refreshes_the_time_zone() {
+    test_begin();
+    http_time_get(NULL, NULL, NULL, NULL);
+    fake_ack();
+    reply_time(1700000000, 0, false, "UTC");
+    fake_reconnect();
+    CHECK_EQ(fake_sent_count, 2);
+    CHECK(sent_has(KEY_TIME));
+}
+
+static void explicit_requests_still_work() {
+    test_begin();
+    CHECK_EQ(http_time_request(), HTTP_OK);
+    fake_ack();
+    reply_time(5, -60, true, "X");
+    CHECK_LOG("time -60 1 5 X");
+    CHECK(http_time_get(NULL, NULL, NULL, NULL));
+}
+
+static void answers_go_to_acknowledged_requests() {
+    test_begin();
+    CHECK_EQ(http_time_request(), HTTP_OK);
+    // Each request goes out as the one before is acknowledged, before that one's answer
+    // arrives, for longer than a request may wait.
+    for(int i = 0; i < 40; ++i) {
+        CHECK_EQ(http_time_request(), HTTP_OK);
+        fake_ack();
+        reply_time(i, 0, false, "UTC");
+        fake_advance(1000);
+    }
+    CHECK(!strstr(test_log_take(), "failure"));
+}
+
+static void untracked_refreshes_dont_block_later_ones() {
+    test_begin();
+    http_time_get(NULL, NULL, NULL, NULL);
+    fake_ack();
+    reply_time(1700000000, 0, false, "UTC");
+    fake_advance(21600 * 1000);
+    test_log_take();
+    // Fill the in-flight table with requests that are never answered.
+    http_set_priority(HTTP_PRIORITY_INTERACTIVE);
+    for(int i = 0; i < 8; ++i) {
+        DictionaryIterator* iter;
+        CHECK_EQ(http_out_get("http://example.com/", 100 + i, &iter), HTTP_OK);
+        CHECK_EQ(http_out_send(), HTTP_OK);
+        fake_ack();
+    }
+    http_set_priority(HTTP_PRIORITY_NORMAL);
+    uint32_t sent = fake_sent_count;
+    CHECK(http_time_get(NULL, NULL, NULL, NULL));
+    CHECK_EQ(fake_sent_count, sent + 1);
+    fake_ack();
+    CHECK(http_time_get(NULL, NULL, NULL, NULL));
+    CHECK_EQ(fake_sent_count, sent + 2);
+    fake_advance(31000);
+    test_log_take();
+}
+
+static void clock_changes_refresh_the_time_zone() {
+    test_begin();
+    http_time_get(NULL, NULL, NULL, NULL);
+    fake_ack();
+    reply_time(1700000000, 0, false, "Europe/London");
+    test_log_take();
+    uint32_t sent = fake_sent_count;
+    // Clocks go forward an hour.
+    fake_advance(60000);
+    fake_clock_offset_ms += 3600 * 1000;
+    fake_advance(580 * 1000);
+    CHECK_EQ(fake_sent_count, sent + 1);
+    CHECK(sent_has(KEY_TIME));
+    // Until the answer arrives, the time is still counted from when the last one did.
+    uint32_t unixtime;
+    CHECK(http_time_get(NULL, NULL, &unixtime, NULL));
+    CHECK_EQ(unixtime, 1700000640);
+    fake_ack();
+    reply_time(1700000640, 3600, true, "Europe/London");
+    CHECK_LOG("time 3600 1 1700000640 Europe/London");
+    // A clock that keeps time doesn't.
+    fake_advance(1200 * 1000);
+    CHECK_EQ(fake_sent_count, sent + 1);
+    fake_clock_offset_ms = 0;
+    fake_advance(600 * 1000);
+    fake_ack();
+    reply_time(1700002460, 0, false, "Europe/London");
+    test_log_take();
+}
+
+int main() {
+    RUN(first_read_asks_the_phone);
+    RUN(cached_time_is_extrapolated);
+    RUN(old_time_is_refreshed_in_the_background);
+    RUN(failed_refresh_is_tried_again);
+    RUN(reconnect_refreshes_the_time_zone);
+    RUN(explicit_requests_still_work);
+    RUN(answers_go_to_acknowledged_requests);
+    RUN(untracked_refreshes_dont_block_later_ones);
+    RUN(clock_changes_refresh_the_time_zone);
+    return test_report();
+}
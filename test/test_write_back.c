@@ -0,0 +1,87 @@
+#include "test.h"
+
+#define WRITE_BACK_REQUEST_ID 0x7FFFFF80
+
+static void sets_are_staged_and_flushed_together() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_int32(1, 10, 100), HTTP_OK);
+    CHECK_EQ(http_cookie_set_int32(2, 11, 110), HTTP_OK);
+    CHECK_EQ(http_cookie_set_cstring(3, 12, "hi"), HTTP_OK);
+    CHECK_EQ(fake_sent_count, 0);
+    fake_advance(5000);
+    CHECK_EQ(fake_sent_count, 1);
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), WRITE_BACK_REQUEST_ID);
+    CHECK_EQ(sent_user_values(), 3);
+    fake_ack();
+    CHECK_LOG("");
+    reply_cookie(KEY_COOKIE_STORE, WRITE_BACK_REQUEST_ID);
+    CHECK_LOG("cookie_set 1 1; cookie_set 2 1; cookie_set 3 1");
+}
+
+static void later_values_replace_staged_ones() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_int32(1, 10, 100), HTTP_OK);
+    CHECK_EQ(http_cookie_set_int32(1, 10, 101), HTTP_OK);
+    CHECK_EQ(http_cookie_flush(), HTTP_OK);
+    CHECK_EQ(sent_user_values(), 1);
+    CHECK_EQ(sent_int(10), 101);
+    fake_ack();
+    reply_cookie(KEY_COOKIE_STORE, WRITE_BACK_REQUEST_ID);
+    CHECK_LOG("cookie_set 1 1");
+}
+
+static void reads_see_staged_values_first() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_int32(1, 10, 100), HTTP_OK);
+    CHECK_EQ(http_cookie_get(2, 10), HTTP_OK);
+    // The flush went first; the get follows it.
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), WRITE_BACK_REQUEST_ID);
+    fake_ack();
+    CHECK_EQ(sent_int(KEY_COOKIE_LOAD), 2);
+}
+
+static void failed_flush_fails_every_caller() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_int32(1, 10, 100), HTTP_OK);
+    CHECK_EQ(http_cookie_set_int32(2, 11, 110), HTTP_OK);
+    CHECK_EQ(http_cookie_flush(), HTTP_OK);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_LOG("cookie_set 1 0; cookie_set 2 0");
+}
+
+static void unconfirmed_flush_times_out() {
+    test_begin();
+    CHECK_EQ(http_cookie_set_int32(1, 10, 100), HTTP_OK);
+    CHECK_EQ(http_cookie_flush(), HTTP_OK);
+    fake_ack();
+    fake_advance(31000);
+    CHECK_LOG("cookie_set 1 0");
+}
+
+static void each_caller_hears_about_its_own_values() {
+    test_begin();
+    fake_config.outbox_size = 64;
+    CHECK_EQ(http_cookie_set_cstring(1, 10, "a value that fills a message"), HTTP_OK);
+    CHECK_EQ(http_cookie_set_cstring(2, 11, "and one that needs the next"), HTTP_OK);
+    CHECK_EQ(http_cookie_set_int32(3, 10, 100), HTTP_OK);
+    CHECK_EQ(http_cookie_flush(), HTTP_OK);
+    CHECK_EQ(http_queue_depth(), 1);
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), WRITE_BACK_REQUEST_ID);
+    fake_nack(APP_MSG_SEND_REJECTED);
+    CHECK_EQ(sent_int(KEY_COOKIE_STORE), WRITE_BACK_REQUEST_ID + 1);
+    fake_ack();
+    reply_cookie(KEY_COOKIE_STORE, WRITE_BACK_REQUEST_ID + 1);
+    // 2's value went in the message that failed; 1 hears how 3's replacement fared.
+    CHECK_LOG("cookie_set 1 1; cookie_set 2 0; cookie_set 3 1");
+    fake_config.outbox_size = 256;
+}
+
+int main() {
+    RUN(sets_are_staged_and_flushed_together);
+    RUN(later_values_replace_staged_ones);
+    RUN(reads_see_staged_values_first);
+    RUN(failed_flush_fails_every_caller);
+    RUN(unconfirmed_flush_times_out);
+    RUN(each_caller_hears_about_its_own_values);
+    return test_report();
+}